@@ -0,0 +1,46 @@
+#ifndef HAVE_ARENA_H
+#define HAVE_ARENA_H
+#include "common.h"
+
+/* System */
+
+#include <pthread.h>
+
+/* Definition */
+
+#define ARENA_CHUNK_SIZE    0x10000U    // 64K, larger allocations get chunks of their own
+
+/* Structure */
+
+struct
+    arena {
+        struct arena_chunk *    chunks;     // Newest first, only the first one is allocated from
+        pthread_mutex_t         lock;
+    };
+
+/* Function */
+
+void *
+    arena_alloc(
+        struct arena *  arena,
+        size_t          size
+    );
+
+void *
+    arena_calloc(
+        struct arena *  arena,
+        size_t          count,
+        size_t          size
+    );
+
+void
+    arena_free(
+        struct arena *  arena
+    );
+
+void
+    arena_init(
+        struct arena *  arena
+    );
+
+#endif
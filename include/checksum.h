@@ -0,0 +1,13 @@
+#ifndef HAVE_CHECKSUM_H
+#define HAVE_CHECKSUM_H
+#include "common.h"
+
+/* Function */
+
+uint32_t
+    checksum_sum32(
+        void const *    data,
+        size_t          count
+    );
+
+#endif
@@ -9,6 +9,7 @@
 /* Local */
 
 #include "ept.h"
+#include "gzip.h"
 
 /* Enumerable */
 
@@ -40,7 +41,18 @@ enum
         CLI_MODE_WEBREPORT,
         CLI_MODE_DCLONE,
         CLI_MODE_ECLONE,
-        CLI_MODE_ECREATE
+        CLI_MODE_ECREATE,
+        CLI_MODE_EMAP,
+        CLI_MODE_DQUERY,
+        CLI_MODE_DDIFF,
+        CLI_MODE_DPROP
+    };
+
+enum
+    cli_verify {
+        CLI_VERIFY_FULL,
+        CLI_VERIFY_STRUCTURAL,
+        CLI_VERIFY_NONE
     };
 
 /* Structure */
@@ -53,11 +65,17 @@ struct
         bool                    dry_run;
         bool                    strict_device;
         bool                    rereadpart;
+        bool                    current_board;
+        bool                    tight_pack;
         uint8_t                 write;
         uint64_t                offset_reserved;
         uint64_t                offset_dtb;
         uint64_t                gap_partition;
         uint64_t                gap_reserved;
+        enum gzip_preference    compress;
+        unsigned                threads;    // 0 for CPU count
+        enum cli_verify         verify;
+        int64_t                 timestamp;  // -1 for the current time
         size_t                  size;
         char                    target[PATH_MAX];
     };
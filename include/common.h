@@ -16,10 +16,14 @@
 #define MAX_PARTITION_NAME_LENGTH 16
 #define MAX_PARTITIONS_COUNT      32
 
+/* Variable */
+
+extern __thread FILE *  prln_stream;    // Where logs of this thread go, NULL for stderr, see pool_run()
+
 /* Macro */
 
 #define prln_with_level(level, format, arg...) \
-    fprintf(stderr, "[%s@"__FILE__":%u] " #level ": " format "\n", __func__, __LINE__, ##arg)
+    fprintf(prln_stream ? prln_stream : stderr, "[%s@"__FILE__":%u] " #level ": " format "\n", __func__, __LINE__, ##arg)
 
 #define prln_fatal(format, arg...) \
     prln_with_level(fatal, format, ##arg)
@@ -0,0 +1,58 @@
+#ifndef HAVE_DM_H
+#define HAVE_DM_H
+#include "common.h"
+
+/* Local */
+
+#include "ept.h"
+
+/* Definition */
+
+#define DM_LINEAR_NAME_PREFIX       "ampart-"
+#define DM_LINEAR_SECTOR_SIZE       512U
+#define DM_LINEAR_SEGMENTS_MAXIMUM  2
+
+/* Structure */
+
+struct
+    dm_linear_segment {
+        uint64_t    start;  // All in 512-byte sectors, as device-mapper wants
+        uint64_t    length;
+        uint64_t    offset;
+    };
+
+struct
+    dm_linear_device {
+        char                        name[sizeof DM_LINEAR_NAME_PREFIX + MAX_PARTITION_NAME_LENGTH];
+        struct dm_linear_segment    segments[DM_LINEAR_SEGMENTS_MAXIMUM];
+        uint32_t                    segments_count;
+    };
+
+struct
+    dm_linear_table {
+        struct dm_linear_device devices[MAX_PARTITIONS_COUNT];
+        uint32_t                devices_count;
+    };
+
+/* Function */
+
+int
+    dm_linear_load(
+        struct dm_linear_table const *  dtable,
+        char const *                    backing
+    );
+
+int
+    dm_linear_plan(
+        struct dm_linear_table *    dtable,
+        struct ept_table const *    source,
+        struct ept_table const *    target
+    );
+
+void
+    dm_linear_report(
+        struct dm_linear_table const *  dtable,
+        char const *                    backing
+    );
+
+#endif
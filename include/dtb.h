@@ -14,6 +14,7 @@
 #define DTB_PARTITION_OFFSET        0x400000U //4M
 #define DTB_PARTITION_SIZE          0x40000U  //256K
 #define DTB_PARTITION_DATA_SIZE     DTB_PARTITION_SIZE - 4*sizeof(uint32_t)
+#define DTB_PARTITION_ALIGNMENT     0x1000U   //4K, page
 
 #define DTB_MULTI_HEADER_PROPERTY_LENGTH_V1 4U
 #define DTB_MULTI_HEADER_PROPERTY_LENGTH_V2 16U
@@ -41,6 +42,10 @@ struct
         size_t                          size;
         struct dts_partitions_helper    phelper;
         bool                            has_partitions;
+        bool                            borrowed;   // buffer points into dtb_buffer_helper.buffer and must not be freed alone
+        bool                            parsed;     // Body scanned, entries of a multi-DTB are only scanned on first access
+        uint64_t                        fingerprint_partitions; // Of phelper, see dts_get_partitions_fingerprint()
+        uint64_t                        fingerprint_blob;       // Of the whole DTB
         char                            target[DTB_MULTI_TARGET_LENGTH_V2];
         char                            soc[DTB_MULTI_HEADER_PROPERTY_LENGTH_V2];
         char                            platform[DTB_MULTI_HEADER_PROPERTY_LENGTH_V2];
@@ -49,11 +54,13 @@ struct
 
 struct
     dtb_buffer_helper {
+        uint8_t *                   buffer;     // Read or decompressed buffer borrowed entries point into
         struct dtb_buffer_entry *   dtbs;
         unsigned                    dtb_count;
         unsigned                    multi_version;
         enum dtb_type               type_main;
         enum dtb_type               type_sub;
+        struct arena *              arena;      // Optional, dtbs and buffers of entries not borrowed come from it and go with it
     };
 
 struct 
@@ -115,17 +122,21 @@ struct
 
 /* Function */
 
-int
-    dtb_as_partition(
-        uint8_t * * dtb,
-        size_t *    size
-    );
+struct dtb_partition *
+    dtb_alloc_partition();
 
 int
     dtb_buffer_helper_implement_partitions(
         struct dtb_buffer_helper *                  new,
         struct dtb_buffer_helper const *            old,
-        struct dts_partitions_helper_simple const * phelper
+        struct dts_partitions_helper_simple const * phelper,
+        struct arena *                              arena
+    );
+
+int
+    dtb_buffer_helper_materialize(
+        struct dtb_buffer_helper *  bhelper,
+        unsigned                    index
     );
 
 uint32_t 
@@ -140,12 +151,34 @@ int
 
 int
     dtb_compose(
-        uint8_t * *                                 dtb,
+        struct dtb_partition *                      part,
         size_t *                                    size,
         struct dtb_buffer_helper const *            bhelper,
         struct dts_partitions_helper_simple const * phelper
     );
 
+int
+    dtb_diff(
+        struct dtb_buffer_helper const *    bhelper_a,
+        struct dtb_buffer_helper const *    bhelper_b,
+        unsigned *                          diffs
+    );
+
+int
+    dtb_edit_properties(
+        struct dtb_buffer_helper *          new,
+        struct dtb_buffer_helper const *    old,
+        struct dts_property_edit const *    edits,
+        int                                 count,
+        struct arena *                      arena,
+        unsigned *                          changed
+    );
+
+void
+    dtb_finish_partition(
+        struct dtb_partition *  part
+    );
+
 void
     dtb_free_buffer_helper(
         struct dtb_buffer_helper *  bhelper
@@ -158,21 +191,30 @@ int
         size_t                          size
     );
 
-struct dts_phandle_list *
-    dtb_get_phandles(
-        uint8_t const * dtb,
-        size_t          size
-    );
-
 enum dtb_type 
     dtb_identify_type(
         uint8_t const * dtb
     );
 
+int
+    dtb_pack(
+        struct dtb_partition *      part,
+        size_t *                    size,
+        struct dtb_buffer_helper *  bhelper
+    );
+
 int
     dtb_parse_multi_entries(
         struct dtb_multi_entries_helper *   mhelper,
-        uint8_t const *                     dtb
+        uint8_t const *                     dtb,
+        size_t                              size
+    );
+
+int
+    dtb_query(
+        struct dtb_buffer_helper *          bhelper,
+        int                                 argc,
+        char const * const *                argv
     );
 
 int
@@ -180,7 +222,9 @@ int
         struct dtb_buffer_helper *  bhelper,
         int                         fd,
         size_t                      size_max,
-        bool                        should_checksum
+        bool                        should_checksum,
+        bool                        current_board,
+        bool                        lazy
     );
 
 int
@@ -188,7 +232,9 @@ int
         struct dtb_buffer_helper *  bhelper,
         int                         fd, 
         size_t                      size_max, 
-        bool                        should_checksum
+        bool                        should_checksum,
+        bool                        current_board,
+        bool                        lazy
     );
 
 int
@@ -4,6 +4,7 @@
 
 /* Local */
 
+#include "arena.h"
 #include "stringblock.h"
 
 /* Definition */
@@ -24,6 +25,8 @@
 #define DTS_HAS_PHANDLE         0b00000001U
 #define DTS_HAS_LINUX_PHANDLE   0b00000010U
 
+#define DTS_WALK_DEPTH_MAXIMUM  64U
+
 /* Structure */
 
 struct 
@@ -39,6 +42,7 @@ struct
     dts_partitions_helper {
         struct dts_partition_entry  partitions[MAX_PARTITIONS_COUNT];
         uint8_t *                   node;
+        size_t                      node_length;    // Including the BEGIN_NODE and END_NODE token
         uint32_t                    phandle_root;
         uint32_t                    linux_phandle_root;
         uint32_t                    phandles[MAX_PARTITIONS_COUNT];
@@ -61,21 +65,99 @@ struct
 
 struct
     dts_phandle_entry {
+        uint32_t    phandle;    // 0 means empty slot
         uint8_t *   node;
         uint8_t     status;
     };
 
 struct 
     dts_phandle_list {
-        struct dts_phandle_entry *  entries;
+        struct dts_phandle_entry *  entries;        // Open-addressing map of phandles owned by nodes
+        uint64_t *                  bitmap;         // Phandles in use, only covers the range new ones are assigned from
         uint32_t                    min;
         uint32_t                    max;
         uint32_t                    allocated;
+        uint32_t                    count;
+        uint32_t                    bitmap_words;
         uint8_t                     status;
+        struct arena *              arena;          // Optional, entries and bitmap come from it and are not freed alone
+    };
+
+struct
+    dts_node_index_entry {
+        uint32_t    offset; // Of the node name right after BEGIN_NODE, in the structure block
+        uint32_t    props;  // Of the first token after the node name
+        uint32_t    end;    // Of the END_NODE token
+        uint32_t    parent; // Index of the parent node, the root node is its own parent
+        uint32_t    next;   // Index of the first node after this node's subtree
+        uint64_t    hash;   // Of the whole subtree, only if indexed with stringblock
+    };
+
+struct
+    dts_node_index {
+        struct dts_node_index_entry *   entries;
+        uint32_t                        count;
+        uint32_t                        allocated;
+    };
+
+struct
+    dts_diff_side {
+        uint8_t const *                     dts;
+        struct dts_node_index const *       nindex;
+        struct stringblock_helper const *   shelper;
+    };
+
+struct
+    dts_property_edit {
+        char const *    path;       // Of the node the property belongs to, not NUL-terminated
+        size_t          len_path;
+        char *          name;
+        uint8_t *       value;      // NULL to delete the property
+        uint32_t        len;
+    };
+
+struct
+    dts_walker {
+        int (*begin_node)(void *context, uint8_t const *node, uint32_t depth);
+        int (*end_node)(void *context, uint8_t const *node, uint8_t const *end, uint32_t depth);
+        int (*prop)(void *context, uint8_t const *node, uint32_t name_off, uint32_t len, uint8_t const *value, uint32_t depth);
+    };
+
+struct
+    dts_scan_helper {
+        struct dts_partitions_helper *  phelper;    // Optional, partitions node parsed into it
+        struct dts_phandle_list *       plist;      // Optional, all phandles collected into it
+        struct arena *                  arena;      // Optional, plist is allocated from it
+        uint8_t const *                 target;     // amlogic-dt-id property of root node
+        uint32_t                        len_target;
+        off_t                           offset_phandle;
+        off_t                           offset_linux_phandle;
+        bool                            has_partitions;
     };
 
 /* Function */
 
+void
+    dts_append_partitions_node_strings(
+        struct dts_partitions_helper_simple const * phelper,
+        struct stringblock_helper *                 shelper
+    );
+
+int
+    dts_collect_strings(
+        uint8_t *                   dts,
+        uint32_t                    max_offset,
+        struct stringblock_helper * shelper,
+        struct arena *              arena,
+        size_t *                    saved
+    );
+
+uint32_t 
+    dts_compare_partitions(
+        struct dts_partitions_helper const *        phelper_a, 
+        struct dts_partitions_helper const *        phelper_b
+    );
+
 uint32_t 
     dts_compare_partitions_mixed(
         struct dts_partitions_helper const *        phelper_a, 
@@ -84,8 +166,7 @@ uint32_t
 
 int
     dts_compose_partitions_node(
-        uint8_t * *                                 node,
-        size_t *                                    length,
+        uint8_t *                                   node,
         struct dts_phandle_list *                   plist,
         struct dts_partitions_helper_simple const * phelper,
         struct stringblock_helper *                 shelper,
@@ -107,47 +188,89 @@ int
         char const * const *                    argv
     );
 
+unsigned
+    dts_diff(
+        struct dts_diff_side const *    a,
+        struct dts_diff_side const *    b,
+        char const *                    prefix
+    );
+
 int
     dts_drop_partitions_phandles(
         struct dts_phandle_list *               plist,
         struct dts_partitions_helper const *    phelper
     );
 
-uint8_t *
-    dts_get_node_from_path(
-        uint8_t const * dts, 
-        uint32_t        max_offset,
-        char const *    path,
-        size_t          len_path
+uint64_t
+    dts_get_partitions_fingerprint(
+        struct dts_partitions_helper const *    phelper
+    );
+
+uint64_t
+    dts_get_partitions_fingerprint_simple(
+        struct dts_partitions_helper_simple const * phelper
+    );
+
+uint64_t
+    dts_get_partitions_node_fingerprint(
+        struct dts_phandle_list const *             plist,
+        struct dts_partitions_helper_simple const * phelper,
+        struct stringblock_helper const *           shelper,
+        off_t                                       offset_phandle,
+        off_t                                       offset_linux_phandle
+    );
+
+size_t
+    dts_get_partitions_node_length(
+        struct dts_partitions_helper_simple const * phelper,
+        bool                                        have_linux_phandle
     );
 
 size_t
-    dts_get_node_full_length(
-        uint8_t const * node,
-        uint32_t        max_offset
+    dts_get_partitions_node_strings_length(
+        struct dts_partitions_helper_simple const * phelper
     );
 
 int
-    dts_get_partitions_from_node(
-        struct dts_partitions_helper *          phelper,
-        struct stringblock_helper const *   shelper
+    dts_node_get_property(
+        uint8_t const *                     dts,
+        struct dts_node_index_entry const * entry,
+        struct stringblock_helper const *   shelper,
+        char const *                        name,
+        uint8_t const **                    value,
+        uint32_t *                          len
     );
 
 int
-    dts_get_phandles(
-        struct dts_phandle_list *   plist,
-        uint8_t const *             node, 
-        uint32_t                    max_offset,
-        uint32_t                    offset_phandle,
-        uint32_t                    offset_linux_phandle
+    dts_node_index_build(
+        struct dts_node_index *             nindex,
+        uint8_t const *                     dts,
+        uint32_t                            max_offset,
+        struct stringblock_helper const *   shelper
+    );
+
+int64_t
+    dts_node_index_find(
+        struct dts_node_index const *   nindex,
+        uint8_t const *                 dts,
+        char const *                    path,
+        size_t                          len_path
+    );
+
+void
+    dts_node_index_free(
+        struct dts_node_index * nindex
     );
 
 int
-    dts_get_property_string(
-        uint8_t const * const   node,
-        uint32_t const          property_offset,
-        char *                  string,
-        size_t const            max_len
+    dts_node_next_property(
+        uint8_t const *                     dts,
+        struct dts_node_index_entry const * entry,
+        struct stringblock_helper const *   shelper,
+        uint32_t *                          offset,
+        char const **                       name,
+        uint8_t const **                    value,
+        uint32_t *                          len
     );
 
 int
@@ -156,10 +279,10 @@ int
         struct dts_partitions_helper const *    generic
     );
 
-// int 
-//     dts_phandle_list_finish(
-//         struct dts_phandle_list *   plist
-//     );
+void
+    dts_phandle_list_free(
+        struct dts_phandle_list *   plist
+    );
 
 void
     dts_report_partitions(
@@ -171,6 +294,27 @@ void
         struct dts_partitions_helper_simple const * phelper
     );
 
+void
+    dts_property_edits_free(
+        struct dts_property_edit *  edits,
+        int                         count
+    );
+
+int
+    dts_property_edits_parse(
+        struct dts_property_edit *  edits,
+        int                         argc,
+        char const * const *        argv
+    );
+
+int
+    dts_scan(
+        struct dts_scan_helper *            scan,
+        uint8_t const *                     dts,
+        uint32_t                            max_offset,
+        struct stringblock_helper const *   shelper
+    );
+
 int
     dts_sort_partitions(
         struct dts_partitions_helper *  phelper
@@ -180,5 +324,13 @@ int
     dts_valid_partitions_simple(
         struct dts_partitions_helper_simple const * dparts
     );
+
+int
+    dts_walk(
+        uint8_t const *             dts,
+        uint32_t                    max_offset,
+        struct dts_walker const *   walker,
+        void *                      context
+    );
     
-#endif
\ No newline at end of file
+#endif
@@ -6,6 +6,15 @@
 
 #define GZIP_MAGIC              0x8b1fU
 
+/* Enumerable */
+
+enum
+    gzip_preference {
+        GZIP_PREFER_NONE,   // No search, a single pass with the default parameters
+        GZIP_PREFER_SIZE,
+        GZIP_PREFER_SPEED
+    };
+
 /* Structure */
 
 struct 
@@ -33,5 +42,16 @@ size_t
         size_t      in_size, 
         uint8_t **  out
     );
+
+size_t
+    gzip_zip_search(
+        uint8_t *               in,
+        size_t                  in_size,
+        uint8_t **              out,
+        size_t                  size_max,
+        enum gzip_preference    preference,
+        unsigned                threads,
+        uint32_t                mtime
+    );
     
 #endif
\ No newline at end of file
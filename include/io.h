@@ -12,6 +12,14 @@
 
 /* Enumerable */
 
+enum
+    io_commit_stages {
+        IO_COMMIT_STAGE_DTB,
+        IO_COMMIT_STAGE_DTB_BACKUP,
+        IO_COMMIT_STAGE_EPT,
+        IO_COMMIT_STAGE_COUNT
+    };
+
 enum 
     io_target_type_content{
         IO_TARGET_TYPE_CONTENT_UNSUPPORTED,
@@ -51,6 +59,22 @@ struct
 #endif
     };
 
+struct
+    io_commit_stage {
+        void *      buffer;
+        size_t      size;       // 0 if not staged
+        off_t       offset;
+        bool        owned;      // buffer is freed along with the commit
+        bool        truncate;   // Regular file is truncated right after this stage
+    };
+
+struct
+    io_commit {
+        struct io_commit_stage      stages[IO_COMMIT_STAGE_COUNT];
+        struct io_migrate_helper    mhelper;
+        bool                        migrate;
+    };
+
 struct 
     io_target_type {
         enum io_target_type_content content;
@@ -59,8 +83,34 @@ struct
         size_t                      size;
     };
 
+/* Variable */
+
+extern char const   io_commit_stage_strings[][11];
+
 /* Function */
 
+void
+    io_commit_free(
+        struct io_commit *  commit
+    );
+
+int
+    io_commit_run(
+        struct io_commit *  commit,
+        int                 fd,
+        size_t *            written
+    );
+
+void
+    io_commit_set_stage(
+        struct io_commit *      commit,
+        enum io_commit_stages   stage,
+        void *                  buffer,
+        size_t                  size,
+        off_t                   offset,
+        bool                    owned
+    );
+
 void 
     io_describe_target_type(
         struct io_target_type * type,
@@ -72,6 +122,12 @@ char *
         char const *    path
     );
 
+off_t
+    io_get_dtb_offset();
+
+off_t
+    io_get_ept_offset();
+
 int
     io_identify_target_type(
         struct io_target_type * type,
@@ -83,6 +139,14 @@ int
         struct io_migrate_helper *  mhelper
     );
     
+int
+    io_pread_till_finish(
+        int     fd,
+        void *  buffer,
+        size_t  size,
+        off_t   offset
+    );
+
 int 
     io_read_till_finish(
         int     fd, 
@@ -105,6 +169,15 @@ off_t
         int fd
     );
 
+int
+    io_write_differing(
+        int             fd,
+        void const *    buffer,
+        size_t          size,
+        off_t           offset,
+        size_t *        written
+    );
+
 int 
     io_write_till_finish(
         int     fd,
@@ -0,0 +1,24 @@
+#ifndef HAVE_POOL_H
+#define HAVE_POOL_H
+#include "common.h"
+
+/* Definition */
+
+#define POOL_THREADS_MAXIMUM    64U
+
+/* Function */
+
+unsigned
+    pool_get_threads(
+        unsigned    threads
+    );
+
+int
+    pool_run(
+        unsigned    count,
+        unsigned    threads,
+        void        (*function)(void *context, unsigned index),
+        void *      context
+    );
+
+#endif
@@ -2,13 +2,34 @@
 #define HAVE_STRINGBLOCK_H
 #include "common.h"
 
+/* Local */
+
+#include "arena.h"
+
 /* Structure */
 
+struct
+    stringblock_index_entry {
+        off_t       offset; // -1 means empty slot
+        uint32_t    hash;
+    };
+
+struct
+    stringblock_index {
+        struct stringblock_index_entry *    entries;
+        uint32_t                            allocated;
+        uint32_t                            count;
+        off_t                               length_indexed; // Leading part of the stringblock already in the index
+        struct arena *                      arena;          // Optional, entries come from it and are not freed alone
+    };
+
 struct 
     stringblock_helper {
-        off_t   length;
-        off_t   allocated_length;
-        char *  stringblock;
+        off_t                       length;
+        off_t                       allocated_length;
+        char *                      stringblock;
+        struct stringblock_index *  index;  // Optional, built lazily on first lookup, set to NULL for plain scanning
+        bool                        owned;  // stringblock is from malloc() and may be grown by realloc(), otherwise it is borrowed (e.g. from an arena) and never grown
     };
 
 /* Function */
@@ -27,6 +48,13 @@ off_t
         size_t                      slength
     );
     
+off_t
+    stringblock_compact(
+        struct stringblock_helper * shelper,
+        uint8_t const *             used,
+        uint32_t *                  remap
+    );
+
 off_t 
     stringblock_find_string(
         struct stringblock_helper const *   shelper, 
@@ -40,4 +68,9 @@ off_t
         char const *    string
     );
 
+void
+    stringblock_index_free(
+        struct stringblock_index *  index
+    );
+
 #endif
\ No newline at end of file
@@ -3,6 +3,10 @@
 
 #include "common.h"
 
+/* Definition */
+
+#define UTIL_HASH64_INITIAL 0xcbf29ce484222325ULL  // FNV-1a 64-bit offset basis
+
 /* Function */
 
 int 
@@ -15,6 +19,13 @@ size_t
         char const *    literal
     );
 
+uint64_t
+    util_hash64(
+        uint64_t        hash,
+        void const *    data,
+        size_t          length
+    );
+
 long 
     util_nearest_upper_bound_long(
         long    value,
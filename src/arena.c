@@ -0,0 +1,111 @@
+/* Self */
+
+#include "arena.h"
+
+/* System */
+
+#include <stddef.h>
+#include <string.h>
+
+/* Local */
+
+#include "util.h"
+
+/* Definition */
+
+#define ARENA_ALIGNMENT     _Alignof(max_align_t)
+
+/* Structure */
+
+struct
+    arena_chunk {
+        struct arena_chunk *    next;
+        size_t                  size;
+        size_t                  used;
+        _Alignas(max_align_t) uint8_t data[];
+    };
+
+/* Function */
+
+void
+arena_init(
+    struct arena * const    arena
+){
+    arena->chunks = NULL;
+    pthread_mutex_init(&arena->lock, NULL);
+}
+
+/*
+ Bump-allocate size bytes aligned for any type, the memory is only given back by
+ arena_free(), all at once. Safe to be called from multiple threads
+*/
+void *
+arena_alloc(
+    struct arena * const    arena,
+    size_t const            size
+){
+    if (!arena || !size) {
+        return NULL;
+    }
+    size_t const size_aligned = util_nearest_upper_bound_ulong(size, ARENA_ALIGNMENT);
+    void *allocated;
+    pthread_mutex_lock(&arena->lock);
+    struct arena_chunk *chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < size_aligned) {
+        size_t const size_chunk = size_aligned > ARENA_CHUNK_SIZE ? size_aligned : ARENA_CHUNK_SIZE;
+        if (!(chunk = malloc(sizeof *chunk + size_chunk))) {
+            pthread_mutex_unlock(&arena->lock);
+            prln_error_with_errno("failed to allocate memory for arena chunk");
+            return NULL;
+        }
+        chunk->size = size_chunk;
+        chunk->used = 0;
+        /* A dedicated chunk for a large allocation goes after the current one, so what's left in that is still used */
+        if (size_chunk > ARENA_CHUNK_SIZE && arena->chunks) {
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        } else {
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+    }
+    allocated = chunk->data + chunk->used;
+    chunk->used += size_aligned;
+    pthread_mutex_unlock(&arena->lock);
+    return allocated;
+}
+
+void *
+arena_calloc(
+    struct arena * const    arena,
+    size_t const            count,
+    size_t const            size
+){
+    if (count && size > SIZE_MAX / count) {
+        return NULL;
+    }
+    void *const allocated = arena_alloc(arena, count * size);
+    if (allocated) {
+        memset(allocated, 0, count * size);
+    }
+    return allocated;
+}
+
+void
+arena_free(
+    struct arena * const    arena
+){
+    if (!arena) {
+        return;
+    }
+    struct arena_chunk *chunk = arena->chunks, *next;
+    while (chunk) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+    pthread_mutex_destroy(&arena->lock);
+}
+
+/* arena.c: bump allocator for the temporaries of one operation, released at once */
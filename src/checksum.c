@@ -0,0 +1,160 @@
+/* Self */
+
+#include "checksum.h"
+
+/* System */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_HAVE_X86
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define CHECKSUM_HAVE_NEON
+#endif
+
+/* Structure */
+
+struct
+    checksum_kernel {
+        uint32_t    (*sum32)(uint32_t const *words, size_t count);
+    };
+
+/* Function */
+
+/*
+ Wrapping 32-bit sum of count little-endian words, which is all both DTB partitions
+ and EPT need. Lane-wise vector adds wrap the same way, so every kernel below
+ gives bit-identical results to this one, no matter how the words are split up
+*/
+static
+uint32_t
+checksum_sum32_scalar(
+    uint32_t const * const  words,
+    size_t const            count
+){
+    uint32_t sum = 0;
+    for (size_t i = 0; i < count; ++i) {
+        sum += words[i];
+    }
+    return sum;
+}
+
+#ifdef CHECKSUM_HAVE_X86
+#if defined(__SSE2__)
+static
+uint32_t
+checksum_sum32_sse2(
+    uint32_t const * const  words,
+    size_t const            count
+){
+    __m128i sums[4] = {_mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128()};
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        sums[0] = _mm_add_epi32(sums[0], _mm_loadu_si128((__m128i const *)(words + i)));
+        sums[1] = _mm_add_epi32(sums[1], _mm_loadu_si128((__m128i const *)(words + i + 4)));
+        sums[2] = _mm_add_epi32(sums[2], _mm_loadu_si128((__m128i const *)(words + i + 8)));
+        sums[3] = _mm_add_epi32(sums[3], _mm_loadu_si128((__m128i const *)(words + i + 12)));
+    }
+    __m128i sum = _mm_add_epi32(_mm_add_epi32(sums[0], sums[1]), _mm_add_epi32(sums[2], sums[3]));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (uint32_t)_mm_cvtsi128_si32(sum) + checksum_sum32_scalar(words + i, count - i);
+}
+#endif
+
+__attribute__((target("avx2")))
+static
+uint32_t
+checksum_sum32_avx2(
+    uint32_t const * const  words,
+    size_t const            count
+){
+    __m256i sums[4] = {_mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256()};
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        sums[0] = _mm256_add_epi32(sums[0], _mm256_loadu_si256((__m256i const *)(words + i)));
+        sums[1] = _mm256_add_epi32(sums[1], _mm256_loadu_si256((__m256i const *)(words + i + 8)));
+        sums[2] = _mm256_add_epi32(sums[2], _mm256_loadu_si256((__m256i const *)(words + i + 16)));
+        sums[3] = _mm256_add_epi32(sums[3], _mm256_loadu_si256((__m256i const *)(words + i + 24)));
+    }
+    __m256i const sum256 = _mm256_add_epi32(_mm256_add_epi32(sums[0], sums[1]), _mm256_add_epi32(sums[2], sums[3]));
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(sum256), _mm256_extracti128_si256(sum256, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (uint32_t)_mm_cvtsi128_si32(sum) + checksum_sum32_scalar(words + i, count - i);
+}
+#endif
+
+#ifdef CHECKSUM_HAVE_NEON
+static
+uint32_t
+checksum_sum32_neon(
+    uint32_t const * const  words,
+    size_t const            count
+){
+    uint32x4_t sums[4] = {vdupq_n_u32(0), vdupq_n_u32(0), vdupq_n_u32(0), vdupq_n_u32(0)};
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        sums[0] = vaddq_u32(sums[0], vld1q_u32(words + i));
+        sums[1] = vaddq_u32(sums[1], vld1q_u32(words + i + 4));
+        sums[2] = vaddq_u32(sums[2], vld1q_u32(words + i + 8));
+        sums[3] = vaddq_u32(sums[3], vld1q_u32(words + i + 12));
+    }
+    uint32x4_t const sum = vaddq_u32(vaddq_u32(sums[0], sums[1]), vaddq_u32(sums[2], sums[3]));
+    uint32x2_t const half = vadd_u32(vget_low_u32(sum), vget_high_u32(sum));
+    return vget_lane_u32(vpadd_u32(half, half), 0) + checksum_sum32_scalar(words + i, count - i);
+}
+#endif
+
+static
+struct checksum_kernel const *
+checksum_choose_kernel(){
+    static struct checksum_kernel const kernels[] = {
+        {checksum_sum32_scalar},
+#ifdef CHECKSUM_HAVE_X86
+#if defined(__SSE2__)
+        {checksum_sum32_sse2},
+#endif
+        {checksum_sum32_avx2},
+#endif
+#ifdef CHECKSUM_HAVE_NEON
+        {checksum_sum32_neon},
+#endif
+    };
+    struct checksum_kernel const *kernel = kernels;
+#ifdef CHECKSUM_HAVE_X86
+    __builtin_cpu_init();
+#if defined(__SSE2__)
+    if (__builtin_cpu_supports("sse2")) {
+        kernel = kernels + 1;
+    }
+#endif
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = kernels + sizeof kernels / sizeof *kernels - 1;
+    }
+#endif
+#ifdef CHECKSUM_HAVE_NEON
+    kernel = kernels + 1; // Guaranteed by aarch64, and by the build flags on armv7 if __ARM_NEON is defined
+#endif
+    return kernel;
+}
+
+/*
+ Sum of count 32-bit words at data, the kernel is chosen on the first call
+ by what the running CPU supports
+*/
+uint32_t
+checksum_sum32(
+    void const * const  data,
+    size_t const        count
+){
+    static struct checksum_kernel const *kernel_chosen = NULL;
+    struct checksum_kernel const *kernel = __atomic_load_n(&kernel_chosen, __ATOMIC_ACQUIRE);
+    if (!kernel) {
+        kernel = checksum_choose_kernel();
+        __atomic_store_n(&kernel_chosen, kernel, __ATOMIC_RELEASE);
+    }
+    return kernel->sum32(data, count);
+}
+
+/* checksum.c: 32-bit word sums used as checksums, with SIMD kernels picked at runtime */
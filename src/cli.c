@@ -10,13 +10,18 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/stat.h>
+
 /* Local */
 
+#include "arena.h"
 #include "common.h"
+#include "dm.h"
 #include "ept.h"
 #include "gzip.h"
 #include "io.h"
 #include "parg.h"
+#include "pool.h"
 #include "util.h"
 #include "version.h"
 
@@ -49,7 +54,11 @@ char const  cli_mode_strings[][10] = {
     "webreport",
     "dclone",
     "eclone",
-    "ecreate"
+    "ecreate",
+    "emap",
+    "dquery",
+    "ddiff",
+    "dprop"
 };
 
 char const  cli_migrate_strings[][20] = {
@@ -65,6 +74,18 @@ char const  cli_content_type_strings[][9] = {
     "disk"
 };
 
+char const  cli_compress_strings[][6] = {
+    "none",
+    "size",
+    "speed"
+};
+
+char const  cli_verify_strings[][11] = {
+    "full",
+    "structural",
+    "none"
+};
+
 struct cli_options cli_options = {
     .mode = CLI_MODE_INVALID,
     .content = CLI_CONTENT_TYPE_AUTO,
@@ -72,15 +93,23 @@ struct cli_options cli_options = {
     .dry_run = false,
     .strict_device = false,
     .rereadpart = true,
+    .current_board = false,
+    .tight_pack = false,
     .write = CLI_WRITE_DTB | CLI_WRITE_TABLE | CLI_WRITE_MIGRATES,
     .offset_reserved = EPT_PARTITION_GAP_RESERVED + EPT_PARTITION_BOOTLOADER_SIZE,
     .offset_dtb = DTB_PARTITION_OFFSET,
     .gap_partition = EPT_PARTITION_GAP_GENERIC,
     .gap_reserved = EPT_PARTITION_GAP_RESERVED,
+    .compress = GZIP_PREFER_NONE,
+    .threads = 0,
+    .verify = CLI_VERIFY_FULL,
+    .timestamp = -1,
     .size = 0,
     .target = ""
 };
 
+static struct io_commit cli_commit;
+
 /* Function */
 
 void
@@ -111,6 +140,44 @@ cli_describe_options() {
     prln_info("mode %s, operating on %s, content type %s, migration strategy: %s, dry run: %s, reserved gap: %lu (%lf%c), generic gap: %lu (%lf%c), reserved offset: %lu (%lf%c), dtb offset: %lu (%lf%c)", cli_mode_strings[cli_options.mode], cli_options.target, cli_content_type_strings[cli_options.content], cli_migrate_strings[cli_options.migrate], cli_options.dry_run ? "yes" : "no", cli_options.gap_reserved, gap_reserved, suffix_gap_reserved, cli_options.gap_partition, gap_partition, suffix_gap_partition, cli_options.offset_reserved, offset_reserved, suffix_offset_reserved, cli_options.offset_dtb, offset_dtb, suffix_offset_dtb);
 }
 
+/* Only modes that don't write DTB back could do with the entry for the running board */
+static inline
+bool
+cli_read_current_board(){
+    if (!cli_options.current_board) {
+        return false;
+    }
+    switch (cli_options.mode) {
+        case CLI_MODE_DTOE:
+        case CLI_MODE_DSNAPSHOT:
+        case CLI_MODE_WEBREPORT:
+        case CLI_MODE_DQUERY:
+            return true;
+        default:
+            prln_warn("mode %s needs all entries in multi-DTB, ignored current-board", cli_mode_strings[cli_options.mode]);
+            return false;
+    }
+}
+
+/*
+ Modes that write DTB back, or rely on all entries in multi-DTB having the same
+ partitions (dtoe, dsnapshot, webreport), need every entry parsed upfront. With
+ --current-board they only get the entry for the running board anyway
+*/
+static inline
+bool
+cli_read_lazy(){
+    switch (cli_options.mode) {
+        case CLI_MODE_EPEDANTIC:
+        case CLI_MODE_ESNAPSHOT:
+        case CLI_MODE_EMAP:
+        case CLI_MODE_DQUERY:
+            return true;
+        default:
+            return false;
+    }
+}
+
 static inline
 int
 cli_read(
@@ -127,7 +194,7 @@ cli_read(
         close(fd);
         return 2;
     }
-    dtb_read_into_buffer_helper_and_report(bhelper, fd, cli_options.size - offset_dtb, cli_options.content != CLI_CONTENT_TYPE_DTB);
+    dtb_read_into_buffer_helper_and_report(bhelper, fd, cli_options.size - offset_dtb, cli_options.content != CLI_CONTENT_TYPE_DTB, cli_read_current_board(), cli_read_lazy());
     if (cli_options.content != CLI_CONTENT_TYPE_DTB) {
         off_t const offset_ept = io_seek_ept(fd);
         if (offset_ept < 0) {
@@ -143,7 +210,7 @@ cli_read(
 static inline
 int
 cli_parse_mode(){
-    for (enum cli_modes mode = CLI_MODE_INVALID; mode <= CLI_MODE_ECREATE; ++mode) {
+    for (enum cli_modes mode = CLI_MODE_INVALID; mode <= CLI_MODE_DPROP; ++mode) {
         if (!strcmp(cli_mode_strings[mode], optarg)) {
             prln_info("mode is set to %s", optarg);
             cli_options.mode = mode;
@@ -182,6 +249,73 @@ cli_parse_migrate(){
     return 1;
 }
 
+static inline
+int
+cli_parse_compress(){
+    for (enum gzip_preference compress = GZIP_PREFER_NONE; compress <= GZIP_PREFER_SPEED; ++compress) {
+        if (!strcmp(cli_compress_strings[compress], optarg)) {
+            prln_info("compression preference is set to %s", optarg);
+            cli_options.compress = compress;
+            return 0;
+        }
+    }
+    prln_fatal("invalid compression preference %s", optarg);
+    return 1;
+}
+
+static inline
+int
+cli_parse_verify(){
+    for (enum cli_verify verify = CLI_VERIFY_FULL; verify <= CLI_VERIFY_NONE; ++verify) {
+        if (!strcmp(cli_verify_strings[verify], optarg)) {
+            prln_info("verification level is set to %s", optarg);
+            cli_options.verify = verify;
+            return 0;
+        }
+    }
+    prln_fatal("invalid verification level %s", optarg);
+    return 1;
+}
+
+static inline
+int
+cli_parse_threads(){
+    char *end;
+    errno = 0;
+    unsigned long const threads = strtoul(optarg, &end, 0);
+    if (errno || end == optarg || *end || optarg[0] == '-') {
+        prln_fatal("invalid thread count %s", optarg);
+        return 1;
+    }
+    if (threads > POOL_THREADS_MAXIMUM) {
+        prln_warn("thread count %lu is more than the maximum %u, using %u", threads, POOL_THREADS_MAXIMUM, POOL_THREADS_MAXIMUM);
+        cli_options.threads = POOL_THREADS_MAXIMUM;
+    } else {
+        cli_options.threads = threads;
+    }
+    if (cli_options.threads) {
+        prln_info("thread count is set to %u", cli_options.threads);
+    } else {
+        prln_info("thread count is set to the count of CPUs");
+    }
+    return 0;
+}
+
+static inline
+int
+cli_parse_timestamp(){
+    char *end;
+    errno = 0;
+    unsigned long long const timestamp = strtoull(optarg, &end, 0);
+    if (errno || end == optarg || *end || optarg[0] == '-' || timestamp > UINT32_MAX) {
+        prln_fatal("invalid timestamp %s", optarg);
+        return 1;
+    }
+    cli_options.timestamp = timestamp;
+    prln_info("timestamp is fixed to %"PRIi64", so new DTBs are reproducible", cli_options.timestamp);
+    return 0;
+}
+
 static inline
 void
 cli_help() {
@@ -204,6 +338,10 @@ cli_help() {
         "\t\t\t -> dclone: clone-in a previously taken dsnapshot\n"
         "\t\t\t -> eclone: clone-in a previously taken esnapshot\n"
         "\t\t\t -> ecreate: create partitions in a YOLO way\n"
+        "\t\t\t -> emap: map partitions in a new EPT to their current data with device-mapper\n"
+        "\t\t\t -> dquery: print nodes and properties in DTB by their paths\n"
+        "\t\t\t -> ddiff: compare DTB against the DTB in another target\n"
+        "\t\t\t -> dprop: set, add or delete properties in DTB by their paths\n"
         "   --content/-c [type]\tset the content type of [target] to one of the following:\n"
         "\t\t\t -> auto: auto-identifying (default)\n"
         "\t\t\t -> dtb: content is DTB, either plain, multi or gzipped\n"
@@ -215,10 +353,22 @@ cli_help() {
         "\t\t\t -> all: migrate all partitions\n"
         "   --strict-device/-s\tif target is a block device and --content is set, stick with that, don't try to find corresponding block device for whole eMMC\n"
         "   --dry-run/-d\t\tdon't write anything\n"
+        "   --current-board/-b\tonly use the entry in multi-DTB for the running board, for dtoe, dsnapshot, webreport and dquery modes\n"
         "   --offset-reserved/-R [value]\toffset of reserved partition in disk\n"
         "   --offset-dtb/-D [value]\toffset of dtb in reserved partition\n"
         "   --gap-partition/-p [value]\tgap between partitions\n"
         "   --gap-reserved/-r [value]\tgap before reserved partition\n"
+        "   --compress/-z [preference]\twhen DTB needs to be gzipped to fit:\n"
+        "\t\t\t -> none: compress once with the default parameters (default)\n"
+        "\t\t\t -> size: search for the smallest result\n"
+        "\t\t\t -> speed: search for the fastest result that fits\n"
+        "   --tight-pack/-P\tif a gzipped multi-DTB still does not fit, pack DTBs in it with 8-byte alignment and try again, u-boot might refuse to load it\n"
+        "   --verify/-V [level]\thow to verify a DTB after new partitions are composed into it:\n"
+        "\t\t\t -> full: parse it again and compare the partitions (default)\n"
+        "\t\t\t -> structural: only check the header and the tokens around the new partitions node\n"
+        "\t\t\t -> none: don't verify\n"
+        "   --threads/-j [count]\tthreads to parse, compose and compress DTBs with, 0 for the count of CPUs (default)\n"
+        "   --timestamp/-T [seconds]\tfixed timestamp to put into new DTB partitions and gzip headers, instead of the current time\n"
         "\n"
         " => [target]: target file or block device to operate on\n"
         "  -> could be or contain content of either DTB, reserved partition, or the whole disk\n"
@@ -245,13 +395,19 @@ cli_parse_options(
         {"migrate",         required_argument,  NULL,   'M'},
         {"strict-device",   no_argument,        NULL,   's'},
         {"dry-run",         no_argument,        NULL,   'd'},
+        {"current-board",   no_argument,        NULL,   'b'},
         {"offset-reserved", required_argument,  NULL,   'R'},
         {"offset-dtb",      required_argument,  NULL,   'D'},
         {"gap-partition",   required_argument,  NULL,   'p'},
         {"gap-reserved",    required_argument,  NULL,   'r'},
+        {"compress",        required_argument,  NULL,   'z'},
+        {"threads",         required_argument,  NULL,   'j'},
+        {"verify",          required_argument,  NULL,   'V'},
+        {"timestamp",       required_argument,  NULL,   'T'},
+        {"tight-pack",      no_argument,        NULL,   'P'},
         {NULL,              0,                  NULL,  '\0'}
     };
-    while ((c = getopt_long(*argc, argv, "vhm:c:dR:D:p:r:", long_options, &option_index)) != -1) {
+    while ((c = getopt_long(*argc, argv, "vhm:c:dbR:D:p:r:z:j:V:T:P", long_options, &option_index)) != -1) {
         switch (c) {
             case 'v':   // version
                 cli_version();
@@ -283,6 +439,10 @@ cli_parse_options(
                 prln_warn("enabled dry-run, no write will be made to the underlying files/devices");
                 cli_options.dry_run = true;
                 break;
+            case 'b':   // current-board
+                prln_info("enabled current-board, only the entry in multi-DTB for the running board will be parsed");
+                cli_options.current_board = true;
+                break;
             case 'R':   // offset-reserved:
                 cli_options.offset_reserved = cli_human_readable_to_size_and_report(optarg, "offset of reserved partition relative to the whole eMMC drive");
                 break;
@@ -295,6 +455,30 @@ cli_parse_options(
             case 'r':   // gap-reserved:
                 cli_options.gap_reserved = cli_human_readable_to_size_and_report(optarg, "gap between bootloader and reserved partitions");
                 break;
+            case 'z':   // compress:
+                if (cli_parse_compress()) {
+                    return 4;
+                }
+                break;
+            case 'j':   // threads:
+                if (cli_parse_threads()) {
+                    return 5;
+                }
+                break;
+            case 'V':   // verify:
+                if (cli_parse_verify()) {
+                    return 6;
+                }
+                break;
+            case 'P':   // tight-pack
+                prln_warn("enabled tight-pack, DTBs in a multi-DTB could be packed with 8-byte alignment to fit, u-boot might refuse to load such a multi-DTB");
+                cli_options.tight_pack = true;
+                break;
+            case 'T':   // timestamp:
+                if (cli_parse_timestamp()) {
+                    return 7;
+                }
+                break;
             default:
                 prln_fatal("unrecognizable option %s", argv[optind-1]);
                 return 3;
@@ -413,6 +597,42 @@ cli_complete_options(
     return 0;
 }
 
+/* 
+ part is always consumed, a plain DTB file only gets the DTB in it, otherwise the
+ partition is staged twice from the same buffer, as its backup copy. Nothing is
+ written until cli_commit_staged()
+*/
+static inline
+int
+cli_write_dtb_partition(
+    struct dtb_partition *  part,
+    size_t                  dtb_new_size
+){
+    prln_error("size of new DTB (as a whole) is 0x%lx", dtb_new_size);
+    if (cli_options.dry_run) {
+        prln_info("in dry-run mode, assuming success");
+        free(part);
+        return 0;
+    }
+    off_t const dtb_offset = io_get_dtb_offset();
+    if (dtb_offset < 0) {
+        prln_error("failed to get offset of DTB");
+        free(part);
+        return 1;
+    }
+    if (cli_options.content == CLI_CONTENT_TYPE_DTB) {
+        io_commit_set_stage(&cli_commit, IO_COMMIT_STAGE_DTB, part, dtb_new_size, dtb_offset, true);
+        cli_commit.stages[IO_COMMIT_STAGE_DTB].truncate = true;
+        io_commit_set_stage(&cli_commit, IO_COMMIT_STAGE_DTB_BACKUP, NULL, 0, 0, false);
+    } else {
+        dtb_finish_partition(part);
+        io_commit_set_stage(&cli_commit, IO_COMMIT_STAGE_DTB, part, sizeof *part, dtb_offset, true);
+        io_commit_set_stage(&cli_commit, IO_COMMIT_STAGE_DTB_BACKUP, part, sizeof *part, dtb_offset + sizeof *part, false);
+    }
+    prln_info("DTB staged for commit");
+    return 0;
+}
+
 static inline
 int
 cli_write_dtb(
@@ -437,51 +657,17 @@ cli_write_dtb(
     } else {
         prln_info("trying to write DTB with no partitions");
     }
-    uint8_t *dtb_new;
-    size_t dtb_new_size;
-    if (dtb_compose(&dtb_new, &dtb_new_size, bhelper, dparts)) {
-        prln_error("failed to generate new DTBs");
+    struct dtb_partition *const part = dtb_alloc_partition();
+    if (!part) {
         return 1;
     }
-    prln_error("size of new DTB (as a whole) is 0x%lx", dtb_new_size);
-    if (cli_options.content != CLI_CONTENT_TYPE_DTB && dtb_as_partition(&dtb_new, &dtb_new_size)) {
-        prln_error("failed to package DTB in partition");
-        return 2;
-    }
-    if (cli_options.dry_run) {
-        prln_info("in dry-run mode, assuming success");
-        free(dtb_new);
-        return 0;
-    }
-    int fd = open(cli_options.target, cli_options.content == CLI_CONTENT_TYPE_DTB ? O_WRONLY | O_TRUNC : O_WRONLY);
-    if (fd < 0) {
-        prln_error("failed to open target");
-        free(dtb_new);
+    size_t dtb_new_size;
+    if (dtb_compose(part, &dtb_new_size, bhelper, dparts)) {
+        prln_error("failed to generate new DTBs");
+        free(part);
         return 1;
     }
-    off_t const dtb_offset = io_seek_dtb(fd);
-    if (dtb_offset < 0) {
-        prln_error("failed to seek");
-        close(fd);
-        free(dtb_new);
-        return 2;
-    }
-    if (io_write_till_finish(fd, dtb_new, dtb_new_size)) {
-        prln_error("failed to write");
-        close(fd);
-        free(dtb_new);
-        return 3;
-    }
-    if (fsync(fd)) {
-        prln_error("failed to sync");
-        close(fd);
-        free(dtb_new);
-        return 4;
-    }
-    close(fd);
-    free(dtb_new);
-    prln_info("write successful");
-    return 0;
+    return cli_write_dtb_partition(part, dtb_new_size);
 }
 
 static inline
@@ -525,42 +711,57 @@ cli_write_ept(
         }
         return 0;
     }
-    int const fd = open(cli_options.target, (can_migrate ? O_RDWR : O_WRONLY) | O_DSYNC);
-    if (fd < 0) {
-        prln_error("failed to open target");
+    off_t const ept_offset = io_get_ept_offset();
+    struct ept_table *const staged = ept_offset < 0 ? NULL : malloc(sizeof *staged);
+    if (!staged) {
+        prln_error("failed to prepare EPT for commit");
         if (can_migrate) {
             free(mhelper.entries);
         }
-        return 1;
+        return 4;
     }
+    *staged = *new;
+    io_commit_set_stage(&cli_commit, IO_COMMIT_STAGE_EPT, staged, sizeof *staged, ept_offset, true);
     if (can_migrate) {
-        mhelper.fd = fd;
-        if (io_migrate(&mhelper)) {
-            prln_error("failed to migrate");
-            close(fd);
-            free(mhelper.entries);
-            return 2;
+        if (cli_commit.migrate) {
+            free(cli_commit.mhelper.entries);
         }
-        free(mhelper.entries);
+        cli_commit.mhelper = mhelper;
+        cli_commit.migrate = true;
     }
-    off_t const ept_offset = io_seek_ept(fd);
-    if (ept_offset < 0) {
-        prln_error("failed to seek");
-        close(fd);
-        return 3;
+    prln_info("EPT staged for commit");
+    return 0;
+}
+
+/* Everything staged is written to the target at once, after the mode succeeds */
+static inline
+int
+cli_commit_staged(){
+    bool staged = cli_commit.migrate;
+    for (unsigned i = 0; i < IO_COMMIT_STAGE_COUNT; ++i) {
+        if (cli_commit.stages[i].size) {
+            staged = true;
+        }
     }
-    if (io_write_till_finish(fd, (struct ept_table *)new, sizeof *new)){
-        prln_error("failed to write");
-        close(fd);
-        return 4;
+    if (!staged) {
+        return 0;
+    }
+    int const fd = open(cli_options.target, O_RDWR);
+    if (fd < 0) {
+        prln_error_with_errno("failed to open target for commit");
+        io_commit_free(&cli_commit);
+        return 1;
     }
-    if (fsync(fd)) {
-        prln_error("failed to sync");
+    bool const ept = cli_commit.stages[IO_COMMIT_STAGE_EPT].size;
+    size_t written;
+    int const r = io_commit_run(&cli_commit, fd, &written);
+    io_commit_free(&cli_commit);
+    if (r) {
         close(fd);
-        return 5;
+        return r < 0 ? 1 : 1 + r; // -1 for illegal arguments must not become 0
     }
-    prln_info("write successful");
-    if (cli_options.rereadpart) {
+    prln_info("write successful, 0x%lx bytes actually written", written);
+    if (ept && cli_options.rereadpart) {
         prln_error("trying to tell kernel to re-read partitions");
         /* Just don't care about return value */
         io_rereadpart(fd);
@@ -649,7 +850,7 @@ cli_mode_etod(
     struct ept_table const * const          table
 ){
     prln_info("recreate partitions node in DTB from EPT");
-    if (!bhelper) {
+    if (!bhelper || !bhelper->dtb_count) {
         prln_error("DTB does not exist, refuse to continue");
         return -1;
     }
@@ -747,7 +948,7 @@ cli_mode_dedit(
     char const * const * const              argv
 ){
     prln_info("edit partitions node in DTB, and potentially create EPT from it");
-    if (cli_check_parg_count(argc, 0) || !bhelper) {
+    if (cli_check_parg_count(argc, 0) || !bhelper || !bhelper->dtb_count) {
         prln_error("illegal arguments");
         return -1;
     }
@@ -925,6 +1126,9 @@ cli_mode_webreport(
         prln_error("DTB not correct or invalid");
         return 1;
     }
+    if (dtb_check_buffers_partitions(bhelper)) {
+        prln_warn("not all DTB entries have partitions node and identical, web report would only contain the first one");
+    }
     if (table && table->partitions_count && !ept_valid_table(table)) {
         has_esnapshot = true;
     } else {
@@ -1104,10 +1308,203 @@ cli_mode_ecreate(
     return 0;
 }
 
+static inline
+int
+cli_mode_emap(
+    struct ept_table const * const  table,
+    int const                       argc,
+    char const * const * const      argv
+){
+    prln_info("map partitions in new EPT to their current data with device-mapper linear tables");
+    int const r = cli_check_parg_count(argc, MAX_PARTITIONS_COUNT);
+    if (r) {
+        if (r < 0) return 0; else return 1;
+    }
+    if (cli_options.content != CLI_CONTENT_TYPE_DISK) {
+        prln_error("device-mapper tables can only be built against a whole disk, refuse to work");
+        return 2;
+    }
+    if (!table || !table->partitions_count || ept_valid_table(table)) {
+        prln_error("old EPT does not exist or is invalid, refuse to work");
+        return 3;
+    }
+    size_t const capacity = cli_get_capacity(table);
+    if (!capacity) {
+        prln_error("cannot get valid capacity, give up");
+        return 4;
+    }
+    struct ept_table table_new;
+    if (ept_eclone_parse(&table_new, argc, argv, capacity)) {
+        prln_error("failed to get new EPT");
+        return 5;
+    }
+    if (ept_valid_table(&table_new)) {
+        prln_error("new EPT illegal, refuse to continue");
+        return 6;
+    }
+    ept_report(&table_new);
+    struct dm_linear_table dtable;
+    if (dm_linear_plan(&dtable, table, &table_new)) {
+        prln_error("failed to plan device-mapper tables");
+        return 7;
+    }
+    dm_linear_report(&dtable, cli_options.target);
+    if (cli_options.dry_run) {
+        prln_info("in dry-run mode, not loading the tables");
+        return 0;
+    }
+    struct stat st;
+    if (stat(cli_options.target, &st) || !S_ISBLK(st.st_mode)) {
+        prln_info("target is not a block device, not loading the tables, attach it to a loop device first to load them");
+        return 0;
+    }
+    if (dm_linear_load(&dtable, cli_options.target)) {
+        prln_error("failed to load device-mapper tables");
+        return 8;
+    }
+    prln_info("new layout is now presented under /dev/mapper/"DM_LINEAR_NAME_PREFIX"*, EPT on disk is left untouched");
+    return 0;
+}
+
+static inline
+int
+cli_mode_dquery(
+    struct dtb_buffer_helper * const        bhelper,
+    int const                               argc,
+    char const * const * const              argv
+){
+    prln_info("query nodes and properties in DTB");
+    int const r = cli_check_parg_count(argc, 0);
+    if (r) {
+        if (r < 0) return 0; else return 1;
+    }
+    if (!bhelper || !bhelper->dtb_count) {
+        prln_error("DTB not correct or invalid");
+        return 2;
+    }
+    if (dtb_query(bhelper, argc, argv)) {
+        prln_error("not all paths could be queried");
+        return 3;
+    }
+    return 0;
+}
+
+static inline
+int
+cli_mode_ddiff(
+    struct dtb_buffer_helper const * const  bhelper,
+    int const                               argc,
+    char const * const * const              argv
+){
+    prln_info("compare nodes and properties in DTB against another target");
+    if (argc != 1) {
+        prln_error("exactly 1 PARG, the other target, is needed, yet you've defined %d", argc);
+        return 1;
+    }
+    if (!bhelper || !bhelper->dtb_count) {
+        prln_error("DTB not correct or invalid");
+        return 2;
+    }
+    /* The other target is identified and read the same way as the main one, with its content type always auto-identified */
+    struct cli_options const options = cli_options;
+    cli_option_replace_target(argv[0]);
+    cli_options.content = CLI_CONTENT_TYPE_AUTO;
+    prln_info("reading the other target '%s'", cli_options.target);
+    struct dtb_buffer_helper bhelper_other;
+    struct ept_table table_other;
+    int r = cli_options_complete_target_info();
+    if (!r) {
+        r = cli_read(&bhelper_other, &table_other);
+    }
+    cli_options = options;
+    if (r) {
+        prln_error("failed to read the other target");
+        return 3;
+    }
+    if (!bhelper_other.dtb_count) {
+        prln_error("DTB in the other target not correct or invalid");
+        dtb_free_buffer_helper(&bhelper_other);
+        return 4;
+    }
+    unsigned diffs;
+    r = dtb_diff(bhelper, &bhelper_other, &diffs);
+    dtb_free_buffer_helper(&bhelper_other);
+    if (r) {
+        prln_error("failed to compare DTBs");
+        return 5;
+    }
+    if (diffs) {
+        prln_info("%u difference(s) found", diffs);
+        return 6;
+    }
+    prln_info("no difference found");
+    return 0;
+}
+
+static inline
+int
+cli_mode_dprop(
+    struct dtb_buffer_helper const * const  bhelper,
+    int const                               argc,
+    char const * const * const              argv
+){
+    prln_info("set, add or delete properties in DTB");
+    int r = cli_check_parg_count(argc, 0);
+    if (r) {
+        if (r < 0) return 0; else return 1;
+    }
+    if (!bhelper || !bhelper->dtb_count) {
+        prln_error("DTB not correct or invalid");
+        return 2;
+    }
+    struct dts_property_edit *const edits = malloc(argc * sizeof *edits);
+    if (!edits) {
+        prln_error_with_errno("failed to allocate memory for property edits");
+        return 3;
+    }
+    if (dts_property_edits_parse(edits, argc, argv)) {
+        prln_error("failed to parse PARGs");
+        free(edits);
+        return 4;
+    }
+    struct arena arena;
+    arena_init(&arena);
+    struct dtb_buffer_helper bhelper_new;
+    unsigned changed;
+    r = dtb_edit_properties(&bhelper_new, bhelper, edits, argc, &arena, &changed);
+    dts_property_edits_free(edits, argc);
+    free(edits);
+    if (r) {
+        prln_error("failed to edit properties in DTB");
+        arena_free(&arena);
+        return 5;
+    }
+    if (!changed) {
+        prln_info("properties already as wanted, no need to write");
+        arena_free(&arena);
+        return 0;
+    }
+    prln_info("properties changed in %u of %u DTBs", changed, bhelper_new.dtb_count);
+    struct dtb_partition *const part = dtb_alloc_partition();
+    size_t dtb_new_size;
+    r = !part || dtb_pack(part, &dtb_new_size, &bhelper_new);
+    arena_free(&arena);
+    if (r) {
+        prln_error("failed to pack new DTB");
+        free(part);
+        return 6;
+    }
+    if (cli_write_dtb_partition(part, dtb_new_size)) {
+        prln_error("failed to write DTB");
+        return 7;
+    }
+    return 0;
+}
+
 static inline
 int 
 cli_dispatcher(
-    struct dtb_buffer_helper const * const  bhelper,
+    struct dtb_buffer_helper * const        bhelper,
     struct ept_table const * const          table,
     int const                               argc,
     char const * const * const              argv
@@ -1143,6 +1540,14 @@ cli_dispatcher(
             return cli_mode_eclone(bhelper, table, argc, argv);
         case CLI_MODE_ECREATE:
             return cli_mode_ecreate(bhelper, table, argc, argv);
+        case CLI_MODE_EMAP:
+            return cli_mode_emap(table, argc, argv);
+        case CLI_MODE_DQUERY:
+            return cli_mode_dquery(bhelper, argc, argv);
+        case CLI_MODE_DDIFF:
+            return cli_mode_ddiff(bhelper, argc, argv);
+        case CLI_MODE_DPROP:
+            return cli_mode_dprop(bhelper, argc, argv);
     }
     return 0;
 }
@@ -1170,8 +1575,13 @@ cli_interface(
     r = cli_dispatcher(&bhelper, &table, argc - optind, (char const * const *)(argv + optind));
     dtb_free_buffer_helper(&bhelper);
     if (r) {
+        io_commit_free(&cli_commit);
         return 30 + r;
     }
+    if ((r = cli_commit_staged())) {
+        prln_error("failed to commit staged writes");
+        return 40 + r;
+    }
     return 0;
 }
 
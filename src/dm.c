@@ -0,0 +1,273 @@
+/* Self */
+
+#include "dm.h"
+
+/* System */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <linux/dm-ioctl.h>
+#include <linux/limits.h>
+
+#include <sys/ioctl.h>
+
+/* Local */
+
+#include "util.h"
+
+/* Definition */
+
+#define DM_CONTROL_PATH         "/dev/mapper/control"
+#define DM_LINEAR_TARGET_TYPE   "linear"
+#define DM_LINEAR_PARAMS_SIZE   (PATH_MAX + 24) // "[backing] [offset]\0", offset at most 20 digits
+#define DM_LINEAR_SPEC_SIZE     ((sizeof(struct dm_target_spec) + DM_LINEAR_PARAMS_SIZE + 7) & ~7UL)
+
+/* Function */
+
+static inline
+struct ept_partition const *
+dm_find_partition(
+    struct ept_table const * const  table,
+    char const * const              name
+){
+    uint32_t const pcount = util_safe_partitions_count(table->partitions_count);
+    for (uint32_t i = 0; i < pcount; ++i) {
+        if (!strncmp(table->partitions[i].name, name, MAX_PARTITION_NAME_LENGTH)) {
+            return table->partitions + i;
+        }
+    }
+    return NULL;
+}
+
+static inline
+void
+dm_linear_add_segment(
+    struct dm_linear_device * const device,
+    uint64_t const                  start,
+    uint64_t const                  length,
+    uint64_t const                  offset
+){
+    if (device->segments_count) {
+        struct dm_linear_segment *const last = device->segments + device->segments_count - 1;
+        if (last->start + last->length == start && last->offset + last->length == offset) {
+            last->length += length;
+            return;
+        }
+    }
+    struct dm_linear_segment *const segment = device->segments + device->segments_count++;
+    segment->start = start;
+    segment->length = length;
+    segment->offset = offset;
+}
+
+static inline
+int
+dm_linear_check_overlap(
+    struct dm_linear_table const * const    dtable
+){
+    struct dm_linear_device const *device_a, *device_b;
+    struct dm_linear_segment const *segment_a, *segment_b;
+    for (uint32_t i = 0; i < dtable->devices_count; ++i) {
+        device_a = dtable->devices + i;
+        for (uint32_t j = 0; j < device_a->segments_count; ++j) {
+            segment_a = device_a->segments + j;
+            for (uint32_t k = i; k < dtable->devices_count; ++k) {
+                device_b = dtable->devices + k;
+                for (uint32_t l = k == i ? j + 1 : 0; l < device_b->segments_count; ++l) {
+                    segment_b = device_b->segments + l;
+                    if (segment_a->offset < segment_b->offset + segment_b->length && segment_b->offset < segment_a->offset + segment_a->length) {
+                        prln_error("device %s is backed by sectors %"PRIu64"-%"PRIu64" which are also backing device %s (sectors %"PRIu64"-%"PRIu64"), this layout can not be presented without actually migrating data", device_a->name, segment_a->offset, segment_a->offset + segment_a->length, device_b->name, segment_b->offset, segment_b->offset + segment_b->length);
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int
+dm_linear_plan(
+    struct dm_linear_table * const  dtable,
+    struct ept_table const * const  source,
+    struct ept_table const * const  target
+){
+    if (!dtable || !source || !target || !target->partitions_count) {
+        prln_error("illegal arguments");
+        return -1;
+    }
+    dtable->devices_count = 0;
+    uint32_t const pcount_target = util_safe_partitions_count(target->partitions_count);
+    struct ept_partition const *part_target, *part_source;
+    struct dm_linear_device *device;
+    uint64_t length_kept;
+    for (uint32_t i = 0; i < pcount_target; ++i) {
+        part_target = target->partitions + i;
+        if (!part_target->size) {
+            prln_warn("partition %.*s has no size, no device will be mapped for it", MAX_PARTITION_NAME_LENGTH, part_target->name);
+            continue;
+        }
+        if (part_target->offset % DM_LINEAR_SECTOR_SIZE || part_target->size % DM_LINEAR_SECTOR_SIZE) {
+            prln_error("partition %.*s in new table is not aligned to %u-byte sectors, device-mapper can not map it", MAX_PARTITION_NAME_LENGTH, part_target->name, DM_LINEAR_SECTOR_SIZE);
+            return 1;
+        }
+        device = dtable->devices + dtable->devices_count++;
+        snprintf(device->name, sizeof device->name, DM_LINEAR_NAME_PREFIX"%.*s", MAX_PARTITION_NAME_LENGTH, part_target->name);
+        device->segments_count = 0;
+        if ((part_source = dm_find_partition(source, part_target->name))) {
+            if (part_source->offset % DM_LINEAR_SECTOR_SIZE || part_source->size % DM_LINEAR_SECTOR_SIZE) {
+                prln_error("partition %.*s in old table is not aligned to %u-byte sectors, device-mapper can not map it", MAX_PARTITION_NAME_LENGTH, part_source->name, DM_LINEAR_SECTOR_SIZE);
+                return 2;
+            }
+            length_kept = part_source->size > part_target->size ? part_target->size : part_source->size;
+            if (length_kept) {
+                dm_linear_add_segment(device, 0, length_kept / DM_LINEAR_SECTOR_SIZE, part_source->offset / DM_LINEAR_SECTOR_SIZE);
+            }
+        } else {
+            length_kept = 0;
+        }
+        if (part_target->size > length_kept) {
+            dm_linear_add_segment(device, length_kept / DM_LINEAR_SECTOR_SIZE, (part_target->size - length_kept) / DM_LINEAR_SECTOR_SIZE, (part_target->offset + length_kept) / DM_LINEAR_SECTOR_SIZE);
+        }
+        if (!part_source) {
+            prln_info("partition %.*s does not exist in old table, mapping it to its new location directly", MAX_PARTITION_NAME_LENGTH, part_target->name);
+        } else if (part_source->offset != part_target->offset) {
+            prln_info("partition %.*s moved from 0x%"PRIx64" to 0x%"PRIx64", mapping it to its old location", MAX_PARTITION_NAME_LENGTH, part_target->name, part_source->offset, part_target->offset);
+        }
+    }
+    if (!dtable->devices_count) {
+        prln_error("no device to map");
+        return 3;
+    }
+    if (dm_linear_check_overlap(dtable)) {
+        prln_error("new layout overlaps with data still in use by old layout");
+        return 4;
+    }
+    return 0;
+}
+
+void
+dm_linear_report(
+    struct dm_linear_table const * const    dtable,
+    char const * const                      backing
+){
+    prln_info("device-mapper tables (dmsetup table format, in %u-byte sectors):", DM_LINEAR_SECTOR_SIZE);
+    struct dm_linear_device const *device;
+    struct dm_linear_segment const *segment;
+    for (uint32_t i = 0; i < dtable->devices_count; ++i) {
+        device = dtable->devices + i;
+        for (uint32_t j = 0; j < device->segments_count; ++j) {
+            segment = device->segments + j;
+            printf("%s: %"PRIu64" %"PRIu64" "DM_LINEAR_TARGET_TYPE" %s %"PRIu64"\n", device->name, segment->start, segment->length, backing, segment->offset);
+        }
+    }
+}
+
+static inline
+void
+dm_ioctl_init(
+    struct dm_ioctl * const dio,
+    size_t const            size,
+    char const * const      name
+){
+    memset(dio, 0, size);
+    dio->version[0] = DM_VERSION_MAJOR;
+    dio->data_size = size;
+    dio->data_start = sizeof *dio;
+    memcpy(dio->name, name, strlen(name) + 1); // Always fits, asserted in size.c
+}
+
+static inline
+int
+dm_linear_remove_device(
+    int const                               fd,
+    struct dm_linear_device const * const   device
+){
+    struct dm_ioctl dio;
+    dm_ioctl_init(&dio, sizeof dio, device->name);
+    if (ioctl(fd, DM_DEV_REMOVE, &dio)) {
+        prln_error_with_errno("failed to remove device %s", device->name);
+        return 1;
+    }
+    return 0;
+}
+
+static inline
+int
+dm_linear_create_device(
+    int const                               fd,
+    struct dm_linear_device const * const   device,
+    char const * const                      backing,
+    uint8_t * const                         buffer
+){
+    struct dm_ioctl *const dio = (struct dm_ioctl *)buffer;
+    dm_ioctl_init(dio, sizeof *dio, device->name);
+    if (ioctl(fd, DM_DEV_CREATE, dio)) {
+        prln_error_with_errno("failed to create device %s, if it exists already remove it with 'dmsetup remove %s'", device->name, device->name);
+        return 1;
+    }
+    size_t const size = sizeof *dio + device->segments_count * DM_LINEAR_SPEC_SIZE;
+    dm_ioctl_init(dio, size, device->name);
+    dio->target_count = device->segments_count;
+    struct dm_target_spec *spec;
+    for (uint32_t i = 0; i < device->segments_count; ++i) {
+        spec = (struct dm_target_spec *)(buffer + sizeof *dio + i * DM_LINEAR_SPEC_SIZE);
+        spec->sector_start = device->segments[i].start;
+        spec->length = device->segments[i].length;
+        spec->next = DM_LINEAR_SPEC_SIZE;
+        strcpy(spec->target_type, DM_LINEAR_TARGET_TYPE);
+        snprintf((char *)(spec + 1), DM_LINEAR_PARAMS_SIZE, "%s %"PRIu64, backing, device->segments[i].offset);
+    }
+    if (ioctl(fd, DM_TABLE_LOAD, dio)) {
+        prln_error_with_errno("failed to load table for device %s", device->name);
+        dm_linear_remove_device(fd, device);
+        return 2;
+    }
+    dm_ioctl_init(dio, sizeof *dio, device->name); // No DM_SUSPEND_FLAG means resume
+    if (ioctl(fd, DM_DEV_SUSPEND, dio)) {
+        prln_error_with_errno("failed to activate device %s", device->name);
+        dm_linear_remove_device(fd, device);
+        return 3;
+    }
+    prln_info("device /dev/mapper/%s is now active", device->name);
+    return 0;
+}
+
+int
+dm_linear_load(
+    struct dm_linear_table const * const    dtable,
+    char const * const                      backing
+){
+    if (!dtable || !backing) {
+        prln_error("illegal arguments");
+        return -1;
+    }
+    int const fd = open(DM_CONTROL_PATH, O_RDWR);
+    if (fd < 0) {
+        prln_error_with_errno("failed to open device-mapper control node "DM_CONTROL_PATH", is dm-mod loaded?");
+        return 1;
+    }
+    uint8_t *const buffer = malloc(sizeof(struct dm_ioctl) + DM_LINEAR_SEGMENTS_MAXIMUM * DM_LINEAR_SPEC_SIZE);
+    if (!buffer) {
+        prln_error("failed to allocate memory for ioctl buffer");
+        close(fd);
+        return 2;
+    }
+    for (uint32_t i = 0; i < dtable->devices_count; ++i) {
+        if (dm_linear_create_device(fd, dtable->devices + i, backing, buffer)) {
+            prln_error("failed to create device %u of %u, removing devices created in this run", i + 1, dtable->devices_count);
+            while (i--) {
+                dm_linear_remove_device(fd, dtable->devices + i);
+            }
+            free(buffer);
+            close(fd);
+            return 3;
+        }
+    }
+    free(buffer);
+    close(fd);
+    return 0;
+}
+
+/* dm.c: device-mapper linear tables to present a new layout without moving data */
@@ -7,16 +7,21 @@
 #include <byteswap.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
 /* Local */
 
+#include "arena.h"
+#include "checksum.h"
+#include "cli.h"
 #include "common.h"
 #include "dts.h"
 #include "gzip.h"
 #include "io.h"
+#include "pool.h"
 #include "stringblock.h"
 #include "util.h"
 
@@ -24,15 +29,62 @@
 
 #define DTB_PARTITION_CHECKSUM_COUNT    (DTB_PARTITION_SIZE - 4U) >> 2U
 #define DTB_PAGE_SIZE                   0x800U
+#define DTB_TIGHT_ALIGNMENT             8U  // What FDT itself requires, only used with --tight-pack, u-boot is only known to load page-aligned DTBs
 #define DTB_MULTI_HEADER_ENTRY_LENGTH_v2    (DTB_MULTI_HEADER_PROPERTY_LENGTH_V2 * 3 + 8)
 #define DTB_PARTITION_VERSION           1
 #define DTB_PARTITION_MAGIC             0x00447E41U
 #define DTB_WEBREPORT_ARG_MAXLEN        0x800U
+#define DTB_CURRENT_BOARD_ID_PATH       "/proc/device-tree/amlogic-dt-id"
 
-/* Macro */
+/* Structure */
 
-#define DTB_GET_PARTITIONS_NODE_FROM_DTS(dts, max_offset) \
-    dts_get_node_from_path(dts, max_offset, "/partitions", 11)
+struct
+    dtb_compose_memo_entry {
+        uint64_t        fingerprint;
+        uint8_t const * node;   // Inside the buffer of the new entry it was composed for
+        size_t          len_node;
+    };
+
+struct
+    dtb_compose_memo {
+        struct dtb_compose_memo_entry * entries;
+        unsigned                        count;
+        pthread_mutex_t                 lock;   // Entries are implemented concurrently
+    };
+
+struct
+    dtb_verify_context {
+        uint32_t    size_dt_strings;
+        uint32_t    partitions_count;
+    };
+
+struct
+    dtb_query_list_context {
+        struct stringblock_helper const *   shelper;
+        bool                                listed;
+    };
+
+struct
+    dtb_parse_result {
+        int     r;
+        char    target_header[DTB_MULTI_TARGET_LENGTH_V2];  // Only if the target in DTS differs from it
+    };
+
+struct
+    dtb_parse_job {
+        struct dtb_buffer_entry *   dtbs;
+        struct dtb_parse_result *   results;
+    };
+
+struct
+    dtb_implement_job {
+        struct dtb_buffer_entry *                   dtbs_new;
+        struct dtb_buffer_entry const *             dtbs_old;
+        struct dts_partitions_helper_simple const * phelper;
+        struct dtb_compose_memo *                   memo;
+        struct arena *                              arena;
+        int *                                       results;
+    };
 
 /* Function */
 
@@ -40,11 +92,7 @@ uint32_t
 dtb_checksum(
     struct dtb_partition const * const  dtb
 ){
-    uint32_t checksum = 0;
-    uint32_t const * const dtb_as_uint = (uint32_t const *)dtb;
-    for (uint32_t i=0; i<DTB_PARTITION_CHECKSUM_COUNT; ++i) {
-        checksum += dtb_as_uint[i];
-    }
+    uint32_t const checksum = checksum_sum32(dtb, DTB_PARTITION_CHECKSUM_COUNT);
     prln_info("calculated %08x, recorded %08x", checksum, dtb->checksum);
     return checksum;
 }
@@ -53,11 +101,7 @@ void
 dtb_checksum_partition(
     struct dtb_partition * const  dtb
 ){
-    dtb->checksum = 0;
-    uint32_t const * const dtb_as_uint = (uint32_t const *)dtb;
-    for (uint32_t i=0; i<DTB_PARTITION_CHECKSUM_COUNT; ++i) {
-        dtb->checksum += dtb_as_uint[i];
-    }
+    dtb->checksum = checksum_sum32(dtb, DTB_PARTITION_CHECKSUM_COUNT);
     prln_info("calculated %08x", dtb->checksum);
 }
 
@@ -140,11 +184,16 @@ dtb_parse_multi_entries_each(
 int
 dtb_parse_multi_entries(
     struct dtb_multi_entries_helper * const mhelper,
-    uint8_t const * const                   dtb
+    uint8_t const * const                   dtb,
+    size_t const                            size
 ){
     if (!mhelper || !dtb) {
         return 1;
     }
+    if (size < sizeof(struct dtb_multi_header)) {
+        prln_error("multi-DTB header overflows, size: 0x%lx", size);
+        return 5;
+    }
     struct dtb_multi_header const *const header = (struct dtb_multi_header const *)dtb;
     if (header->magic != DTB_MAGIC_MULTI) {
         prln_error("given dtb's magic is not correct, expecting %08x, got %08x", DTB_MAGIC_MULTI, header->magic);
@@ -154,6 +203,11 @@ dtb_parse_multi_entries(
     if (!len_property) {
         return 3;
     }
+    uint64_t const end = sizeof(struct dtb_multi_header) + (uint64_t)(len_property * 3 + 8) * header->entry_count;
+    if (end > size) {
+        prln_error("multi-DTB entry table overflows, end: 0x%"PRIx64", size: 0x%lx", end, size);
+        return 5;
+    }
     mhelper->version = header->version;
     mhelper->entry_count = header->entry_count;
     mhelper->entries = malloc(mhelper->entry_count * sizeof *mhelper->entries);
@@ -181,20 +235,28 @@ dtb_get_partitions(
         prln_error("dtb end point overflows, end: 0x%x, size: 0x%lx", dh.off_dt_strings + dh.size_dt_strings, size);
         return 2;
     }
-    if (!(phelper->node = DTB_GET_PARTITIONS_NODE_FROM_DTS(dtb + dh.off_dt_struct, dh.size_dt_struct))) {
-        prln_error("partitions node does not exist in dtb");
-        return 3;
-    }
+    struct stringblock_index sindex = {0};
     struct stringblock_helper const shelper = {
         .stringblock = (char *)(dtb + dh.off_dt_strings),
         .length = dh.size_dt_strings,
-        .allocated_length = dh.size_dt_strings
+        .allocated_length = dh.size_dt_strings,
+        .index = &sindex
     };
-    if (dts_get_partitions_from_node(phelper, &shelper)) {
-        prln_error("failed to get partitions");
+    struct dts_scan_helper scan = {.phelper = phelper};
+    int const r = dts_scan(&scan, dtb + dh.off_dt_struct, dh.size_dt_struct, &shelper);
+    stringblock_index_free(&sindex);
+    if (r) {
+        prln_error("failed to scan DTS");
+        return 3;
+    }
+    if (!phelper->node) {
+        prln_error("partitions node does not exist in dtb");
         return 4;
     }
-    dts_sort_partitions(phelper);
+    if (!scan.has_partitions) {
+        prln_error("failed to get partitions");
+        return 5;
+    }
     return 0;
 }
 
@@ -216,29 +278,11 @@ dtb_identify_type(
     }
 }
 
-uint8_t *
-dtb_partition_choose_correct(
-    uint8_t *const buffer
-){
-    struct dtb_partition const *dtb = (struct dtb_partition const*)buffer;
-    if (dtb_checksum(dtb) == dtb->checksum) {
-        prln_info("using first 256K in DTB partition");
-        return buffer;
-    }
-    ++dtb;
-    if (dtb_checksum(dtb) == dtb->checksum) {
-        prln_info("using second 256K in DTB partition");
-        return buffer + DTB_PARTITION_SIZE;
-    }
-    prln_info("both copies in DTB partition invalid, using first one");
-    return buffer;
-}
-
 uint8_t *
 dtb_identify_and_redirect_buffer(
     struct dtb_buffer_helper *const bhelper,
     uint8_t       * const           buffer,
-    size_t const                    size_max
+    size_t * const                  size
 ){
     if (!buffer || !buffer[0]) {
         return NULL;
@@ -253,7 +297,7 @@ dtb_identify_and_redirect_buffer(
         case DTB_TYPE_GZIPPED: {
             bhelper->type_main = DTB_TYPE_GZIPPED;
             uint8_t *gbuffer;
-            if (!gzip_unzip(buffer, size_max, &gbuffer)) {
+            if (!(*size = gzip_unzip(buffer, *size, &gbuffer))) {
                 prln_error("failed to unzipped gzipped DTB");
                 return NULL;
             }
@@ -287,22 +331,6 @@ dtb_get_size(
     return size;
 }
 
-static inline
-uint8_t *
-dtb_get_dts(
-    uint8_t const * const   dtb
-){
-    return (uint8_t *)dtb + bswap_32(((struct dtb_header *)dtb)->off_dt_struct);
-}
-
-static inline
-uint32_t
-dtb_get_dts_size(
-    uint8_t const * const   dtb
-){
-    return bswap_32(((struct dtb_header *)dtb)->size_dt_struct);
-}
-
 static inline
 void
 dtb_complete_stringblock_helper(
@@ -313,29 +341,8 @@ dtb_complete_stringblock_helper(
     shelper->stringblock = (char *)dtb + bswap_32(dh->off_dt_strings);
     shelper->length = bswap_32(dh->size_dt_strings);
     shelper->allocated_length = shelper->length;
-}
-
-static inline
-int
-dtb_get_target(
-    uint8_t const * const   dtb,
-    char * const            target
-){
-    struct stringblock_helper shelper;
-    dtb_complete_stringblock_helper(dtb, &shelper);
-    off_t off_target = stringblock_find_string(&shelper, "amlogic-dt-id");
-    if (off_target < 0) {
-        return 1;
-    }
-    uint8_t const * const dts = dtb_get_dts(dtb);
-    uint32_t const size_dts = dtb_get_dts_size(dtb);
-    uint8_t const * node = dts_get_node_from_path(dts, size_dts, "/", 1);
-    if (!node) {
-        return 2;
-    }
-    dts_get_property_string(node, off_target, target, 36);
-    prln_info("target is %s", target);
-    return 0;
+    shelper->index = NULL;
+    shelper->owned = false;
 }
 
 static inline
@@ -362,63 +369,211 @@ dtb_entry_split_target_string(
     strncpy(entry->soc, key[0], DTB_MULTI_HEADER_PROPERTY_LENGTH_V2);
     strncpy(entry->platform, key[1], DTB_MULTI_HEADER_PROPERTY_LENGTH_V2);
     strncpy(entry->variant, key[2], DTB_MULTI_HEADER_PROPERTY_LENGTH_V2);
-    prln_info("soc %s, platform %s, variant %s", entry->soc, entry->platform, entry->variant);
+    prln_info("soc %.*s, platform %.*s, variant %.*s", DTB_MULTI_HEADER_PROPERTY_LENGTH_V2, entry->soc, DTB_MULTI_HEADER_PROPERTY_LENGTH_V2, entry->platform, DTB_MULTI_HEADER_PROPERTY_LENGTH_V2, entry->variant);
     return 0;
 }
 
+/*
+ If borrow is true, the entry only references buffer, which must outlive it.
+ Otherwise the entry owns buffer: it is freed by dtb_free_buffer_helper() with
+ the entry if the helper has no arena, so it must then be from malloc(); if the
+ helper has an arena, buffer may come from it and is only freed with the arena
+*/
 static inline
 int
 dtb_parse_entry(
     struct dtb_buffer_entry * const entry,
-    uint8_t const * const           buffer
+    uint8_t * const                 buffer,
+    size_t const                    size_max,
+    bool const                      borrow
 ){
     entry->size = dtb_get_size(buffer);
-    entry->buffer = malloc(entry->size);
-    if (!entry->buffer) {
-        prln_error("failed to allocate memory for buffer");
+    if (entry->size > size_max) {
+        prln_error("DTB size 0x%lx larger than the available data 0x%lx", entry->size, size_max);
         return 1;
     }
-    memcpy(entry->buffer, buffer, entry->size);
-    if (dtb_get_target(entry->buffer, entry->target)) {
-        prln_error("failed get target name");
+    entry->buffer = buffer;
+    entry->borrowed = borrow;
+    struct dtb_header const dh = dtb_header_swapbytes((struct dtb_header *)buffer);
+    if (dh.off_dt_strings + dh.size_dt_strings > entry->size || dh.off_dt_struct + dh.size_dt_struct > entry->size) {
+        prln_error("DTB blocks overflow, struct end 0x%x, strings end 0x%x, size 0x%lx", dh.off_dt_struct + dh.size_dt_struct, dh.off_dt_strings + dh.size_dt_strings, entry->size);
         return 2;
     }
+    struct stringblock_helper shelper;
+    dtb_complete_stringblock_helper(buffer, &shelper);
+    struct stringblock_index sindex = {0};
+    shelper.index = &sindex;
+    struct dts_scan_helper scan = {.phelper = &entry->phelper};
+    int const r = dts_scan(&scan, buffer + dh.off_dt_struct, dh.size_dt_struct, &shelper);
+    stringblock_index_free(&sindex);
+    if (r) {
+        prln_error("failed to scan DTS");
+        return 3;
+    }
+    if (!scan.target) {
+        prln_error("failed get target name");
+        return 4;
+    }
+    memset(entry->target, 0, sizeof entry->target);
+    size_t len_target = strnlen((char const *)scan.target, scan.len_target);
+    if (len_target >= sizeof entry->target) {
+        prln_warn("target string too long (%zu bytes), clipped to %zu bytes", len_target, sizeof entry->target - 1);
+        len_target = sizeof entry->target - 1;
+    }
+    strncpy(entry->target, (char const *)scan.target, len_target);
+    prln_info("target is %s", entry->target);
     if (dtb_entry_split_target_string(entry)) {
         prln_error("failed split target string into SoC, platform and variant");
-        return 3;
+        return 5;
     }
-    if (dtb_get_partitions(&(entry->phelper), entry->buffer, entry->size)) {
+    entry->parsed = true;
+    entry->fingerprint_blob = util_hash64(UTIL_HASH64_INITIAL, buffer, entry->size);
+    if (!(entry->has_partitions = scan.has_partitions)) {
         prln_error("failed to get partitions in DTB");
-        entry->has_partitions = false;
+        entry->fingerprint_partitions = 0;
         return -1;
     }
-    entry->has_partitions = true;
+    entry->fingerprint_partitions = dts_get_partitions_fingerprint(&entry->phelper);
     return 0;
 }
 
+/*
+ Only the first copy is read, the second one is read after it only if the
+ first one fails the checksum. Both are kept in buffer_read, in order
+*/
 static inline
 int
-dtb_get_read_size(
-    bool const      checksum,
-    size_t const    size_max,
-    size_t          *size_read,
-    size_t          *size_dtb
+dtb_read_partition_correct(
+    int const           fd,
+    off_t const         offset,
+    uint8_t * * const   buffer_read,
+    uint8_t * * const   buffer_use
 ){
-    if (checksum) {
-        *size_read = DTB_PARTITION_SIZE * 2;
-        if (*size_read > size_max) {
-            prln_error("remaning data size smaller than minimum required for DTB checksum");
-            return 1;
+    if (!(*buffer_read = malloc(DTB_PARTITION_SIZE))) {
+        prln_error_with_errno("failed to allocate memory for read buffer");
+        return 1;
+    }
+    if (io_pread_till_finish(fd, *buffer_read, DTB_PARTITION_SIZE, offset)) {
+        prln_error("failed to read first copy in DTB partition");
+        free(*buffer_read);
+        return 2;
+    }
+    struct dtb_partition const *dtb = (struct dtb_partition const *)*buffer_read;
+    if (dtb_checksum(dtb) == dtb->checksum) {
+        prln_info("using first 256K in DTB partition");
+        *buffer_use = *buffer_read;
+        return 0;
+    }
+    uint8_t *const buffer_both = realloc(*buffer_read, DTB_PARTITION_SIZE * 2);
+    if (!buffer_both) {
+        prln_error_with_errno("failed to allocate memory for second copy in DTB partition");
+        free(*buffer_read);
+        return 1;
+    }
+    *buffer_read = buffer_both;
+    if (io_pread_till_finish(fd, buffer_both + DTB_PARTITION_SIZE, DTB_PARTITION_SIZE, offset + DTB_PARTITION_SIZE)) {
+        prln_error("failed to read second copy in DTB partition");
+        free(buffer_both);
+        return 2;
+    }
+    dtb = (struct dtb_partition const *)(buffer_both + DTB_PARTITION_SIZE);
+    if (dtb_checksum(dtb) == dtb->checksum) {
+        prln_info("using second 256K in DTB partition");
+        *buffer_use = buffer_both + DTB_PARTITION_SIZE;
+        return 0;
+    }
+    prln_info("both copies in DTB partition invalid, using first one");
+    *buffer_use = buffer_both;
+    return 0;
+}
+
+/*
+ How much of the DTB needs to be read, as far as its first have bytes could
+ tell. A multi-DTB needs its entry table, then all entries the table points to
+*/
+static inline
+size_t
+dtb_get_size_to_read(
+    uint8_t const * const   dtb,
+    size_t const            have,
+    size_t const            size_max
+){
+    size_t need = size_max;
+    if (have < sizeof(struct dtb_header)) {
+        return size_max;
+    }
+    switch (*(uint32_t const *)dtb) {
+        case DTB_MAGIC_PLAIN:
+            need = bswap_32(((struct dtb_header const *)dtb)->totalsize);
+            break;
+        case DTB_MAGIC_MULTI: {
+            struct dtb_multi_header const *const header = (struct dtb_multi_header const *)dtb;
+            uint32_t len_property;
+            switch (header->version) {
+                case 1:
+                    len_property = DTB_MULTI_HEADER_PROPERTY_LENGTH_V1;
+                    break;
+                case 2:
+                    len_property = DTB_MULTI_HEADER_PROPERTY_LENGTH_V2;
+                    break;
+                default:
+                    return size_max;    // Let the parser complain
+            }
+            size_t const len_entry = len_property * 3 + 8;
+            if ((need = 12 + len_entry * header->entry_count) > have) {
+                break;
+            }
+            for (uint32_t i = 0; i < header->entry_count; ++i) {
+                uint8_t const *const prop = dtb + 12 + len_entry * i + len_property * 3;
+                size_t const offset = *(uint32_t const *)prop;
+                size_t end = offset + *(uint32_t const *)(prop + 4);
+                if (offset + sizeof(struct dtb_header) > have) {
+                    if (end < offset + sizeof(struct dtb_header)) {
+                        end = offset + sizeof(struct dtb_header);
+                    }
+                } else if (end < offset + bswap_32(((struct dtb_header const *)(dtb + offset))->totalsize)) {
+                    end = offset + bswap_32(((struct dtb_header const *)(dtb + offset))->totalsize);
+                }
+                if (end > need) {
+                    need = end;
+                }
+            }
+            break;
         }
-        *size_dtb = DTB_PARTITION_DATA_SIZE;
-    } else {
-        if (size_max > DTB_PARTITION_DATA_SIZE) {
-            *size_read = DTB_PARTITION_DATA_SIZE;
-        } else {
-            *size_read = size_max;
+        default:
+            break;  // Gzipped or invalid, no length to tell from the head
+    }
+    return need < size_max ? need : size_max;
+}
+
+/*
+ Read the head of the DTB first, then only as much as its header says it takes,
+ size is set to how much has been read
+*/
+static inline
+int
+dtb_read_by_header(
+    int const       fd,
+    off_t const     offset,
+    uint8_t * const buffer,
+    size_t const    size_max,
+    size_t * const  size
+){
+    size_t have = size_max < DTB_PAGE_SIZE ? size_max : DTB_PAGE_SIZE;
+    size_t need;
+    if (io_pread_till_finish(fd, buffer, have, offset)) {
+        prln_error("failed to read head of DTB");
+        return 1;
+    }
+    while ((need = dtb_get_size_to_read(buffer, have, size_max)) > have) {
+        if (io_pread_till_finish(fd, buffer + have, need - have, offset + have)) {
+            prln_error("failed to read DTB");
+            return 2;
         }
-        *size_dtb = *size_read;
+        have = need;
     }
+    prln_info("read 0x%lx bytes of DTB", have);
+    *size = have;
     return 0;
 }
 
@@ -426,108 +581,298 @@ void
 dtb_free_buffer_helper(
     struct dtb_buffer_helper * const  bhelper
 ){
-    if (bhelper && bhelper->dtb_count && bhelper->dtbs) {
+    if (!bhelper) {
+        return;
+    }
+    if (bhelper->arena) { // Released all together with the arena
+        return;
+    }
+    if (bhelper->dtb_count && bhelper->dtbs) {
         for (unsigned i = 0; i < bhelper->dtb_count; ++i) {
-            if (bhelper->dtbs[i].buffer) {
+            if (bhelper->dtbs[i].buffer && !bhelper->dtbs[i].borrowed) {
                 free(bhelper->dtbs[i].buffer);
             }
         }
         free(bhelper->dtbs);
     }
+    if (bhelper->buffer) {
+        free(bhelper->buffer);
+    }
+}
+
+/*
+ Only the header of a multi-DTB entry is looked at, its body is left for
+ dtb_buffer_entry_materialize() to scan on first access
+*/
+static inline
+int
+dtb_buffer_entry_from_multi_entry(
+    struct dtb_buffer_entry * const         entry,
+    struct dtb_multi_entry const * const    mentry,
+    size_t const                            size_use
+){
+    if (mentry->offset >= size_use || size_use - mentry->offset < sizeof(struct dtb_header)) {
+        prln_error("entry offset 0x%x leaves no room for a DTB header in the available data 0x%lx", mentry->offset, size_use);
+        return 1;
+    }
+    entry->buffer = mentry->dtb;
+    entry->borrowed = true;
+    entry->parsed = false;
+    if ((entry->size = dtb_get_size(entry->buffer)) > size_use - mentry->offset) {
+        prln_error("DTB size 0x%lx larger than the available data 0x%lx", entry->size, size_use - mentry->offset);
+        return 2;
+    }
+    memcpy(entry->target, mentry->target, sizeof entry->target);
+    memcpy(entry->soc, mentry->soc, sizeof entry->soc);
+    memcpy(entry->platform, mentry->platform, sizeof entry->platform);
+    memcpy(entry->variant, mentry->variant, sizeof entry->variant);
+    return 0;
+}
+
+static inline
+int
+dtb_buffer_entry_materialize(
+    struct dtb_buffer_entry * const entry,
+    char * const                    target_header   // The target name in multi header, if it differs from the one in DTS
+){
+    if (entry->parsed) {
+        return 0;
+    }
+    char target[DTB_MULTI_TARGET_LENGTH_V2];
+    memcpy(target, entry->target, sizeof target);
+    if (dtb_parse_entry(entry, entry->buffer, entry->size, true) > 0) {
+        return 1;
+    }
+    if (strncmp(entry->target, target, DTB_MULTI_HEADER_PROPERTY_LENGTH_V2 * 3)) {
+        memcpy(target_header, target, sizeof target);
+        return 2;
+    }
+    return 0;
+}
+
+static inline
+void
+dtb_buffer_helper_report_materialize(
+    struct dtb_buffer_helper const * const  bhelper,
+    unsigned const                          index,
+    struct dtb_parse_result const * const   result
+){
+    if (result->r == 1) {
+        prln_error("failed to parse entry %u of %u", index + 1, bhelper->dtb_count);
+    } else if (result->r == 2) {
+        prln_error("target name in header is different from amlogic-dt-id in DTS: %s != %s", result->target_header, bhelper->dtbs[index].target);
+    }
+}
+
+int
+dtb_buffer_helper_materialize(
+    struct dtb_buffer_helper * const    bhelper,
+    unsigned const                      index
+){
+    if (!bhelper || index >= bhelper->dtb_count) {
+        prln_error("illegal arguments");
+        return -1;
+    }
+    struct dtb_parse_result result;
+    result.r = dtb_buffer_entry_materialize(bhelper->dtbs + index, result.target_header);
+    dtb_buffer_helper_report_materialize(bhelper, index, &result);
+    return result.r;
+}
+
+static
+void
+dtb_parse_job_run(
+    void * const    context,
+    unsigned const  index
+){
+    struct dtb_parse_job const *const job = context;
+    job->results[index].r = dtb_buffer_entry_materialize(job->dtbs + index, job->results[index].target_header);
+}
+
+/* Entries are parsed concurrently, but failures are still reported in order */
+static inline
+int
+dtb_buffer_helper_materialize_all(
+    struct dtb_buffer_helper * const    bhelper
+){
+    struct dtb_parse_result *const results = malloc(bhelper->dtb_count * sizeof *results);
+    if (!results) {
+        prln_error_with_errno("failed to allocate memory for parsing results");
+        return -1;
+    }
+    struct dtb_parse_job job = {
+        .dtbs = bhelper->dtbs,
+        .results = results
+    };
+    pool_run(bhelper->dtb_count, cli_options.threads, dtb_parse_job_run, &job);
+    for (unsigned i = 0; i < bhelper->dtb_count; ++i) {
+        if (results[i].r) {
+            dtb_buffer_helper_report_materialize(bhelper, i, results + i);
+            free(results);
+            return 1;
+        }
+    }
+    free(results);
+    return 0;
+}
+
+/* Returns the index of the entry for the running board, or dtb_count if it can't be told */
+static inline
+unsigned
+dtb_buffer_helper_find_current_board(
+    struct dtb_buffer_helper const * const  bhelper
+){
+    int const fd = open(DTB_CURRENT_BOARD_ID_PATH, O_RDONLY);
+    if (fd < 0) {
+        prln_warn("failed to open %s to get the running board, is this running on an Amlogic box?", DTB_CURRENT_BOARD_ID_PATH);
+        return bhelper->dtb_count;
+    }
+    char target[DTB_MULTI_TARGET_LENGTH_V2] = {0};
+    ssize_t const len_target = read(fd, target, sizeof target - 1);
+    close(fd);
+    if (len_target <= 0) {
+        prln_warn("failed to read the running board from %s", DTB_CURRENT_BOARD_ID_PATH);
+        return bhelper->dtb_count;
+    }
+    for (unsigned i = 0; i < bhelper->dtb_count; ++i) {
+        if (!strncmp(bhelper->dtbs[i].target, target, sizeof target)) {
+            prln_info("running board is %s, only entry %u of %u for it is used", target, i + 1, bhelper->dtb_count);
+            return i;
+        }
+    }
+    prln_warn("running board %s has no entry in multi-DTB", target);
+    return bhelper->dtb_count;
 }
 
+/*
+ With current_board, only the entry of a multi-DTB for the running board is
+ scanned, and bhelper only keeps that entry if it could be found. Otherwise with
+ lazy, no entry of a multi-DTB is scanned, only the ones that are needed later
+ should be, with dtb_buffer_helper_materialize()
+*/
 int
 dtb_read_into_buffer_helper(
     struct dtb_buffer_helper *  bhelper,
     int const                   fd,
     size_t const                size_max,
-    bool const                  should_checksum
+    bool const                  should_checksum,
+    bool const                  current_board,
+    bool const                  lazy
 ){
     if (!bhelper) {
         return 1;
     }
     memset(bhelper, 0, sizeof *bhelper);
-    size_t size_read, size_dtb;
-    if (dtb_get_read_size(should_checksum, size_max, &size_read, &size_dtb)) {
-        prln_error("failed to get size to read");
+    int r;
+    off_t const offset = lseek(fd, 0, SEEK_CUR);
+    if (offset < 0) {
+        prln_error_with_errno("failed to get offset of DTB");
         return 2;
     }
-    uint8_t *const buffer_read = malloc(size_read);
-    if (!buffer_read) {
-        prln_error_with_errno("failed to allocate memory for read buffer");
-        return 3;
-    }
-    if (io_read_till_finish(fd, buffer_read, size_read)) {
-        prln_error("failed to read into buffer buffer");
-        free(buffer_read);
-        return 4;
+    uint8_t *buffer_read, *buffer_use;
+    size_t size_use;
+    if (should_checksum) {
+        if (DTB_PARTITION_SIZE * 2 > size_max) {
+            prln_error("remaning data size smaller than minimum required for DTB checksum");
+            return 2;
+        }
+        if ((r = dtb_read_partition_correct(fd, offset, &buffer_read, &buffer_use))) {
+            return 2 + r;
+        }
+        size_use = DTB_PARTITION_DATA_SIZE;
+    } else {
+        size_t const size_read = size_max > DTB_PARTITION_DATA_SIZE ? DTB_PARTITION_DATA_SIZE : size_max;
+        if (!(buffer_read = malloc(size_read))) {
+            prln_error_with_errno("failed to allocate memory for read buffer");
+            return 3;
+        }
+        if (dtb_read_by_header(fd, offset, buffer_read, size_read, &size_use)) {
+            free(buffer_read);
+            return 4;
+        }
+        buffer_use = buffer_read;
     }
-    uint8_t *buffer_use = should_checksum ? dtb_partition_choose_correct(buffer_read) : buffer_read;
-    if (!(buffer_use = dtb_identify_and_redirect_buffer(bhelper, buffer_use, size_dtb))) {
+    if (!(buffer_use = dtb_identify_and_redirect_buffer(bhelper, buffer_use, &size_use))) {
         prln_error("failed to identify DTB type");
         free(buffer_read);
         return 5;
     }
+    /* Entries only borrow from the buffer, which now belongs to the helper */
+    if (bhelper->type_main == DTB_TYPE_GZIPPED) {
+        free(buffer_read);
+        bhelper->buffer = buffer_use;
+    } else {
+        bhelper->buffer = buffer_read;
+    }
     if (bhelper->type_main == DTB_TYPE_MULTI || bhelper->type_sub == DTB_TYPE_MULTI) {
         struct dtb_multi_entries_helper mhelper;
-        if (dtb_parse_multi_entries(&mhelper, buffer_use) || !mhelper.entry_count) {
+        if (dtb_parse_multi_entries(&mhelper, buffer_use, size_use) || !mhelper.entry_count) {
             prln_error("failed to get multi-DTB helper");
-            free(buffer_read);
+            dtb_free_buffer_helper(bhelper);
+            memset(bhelper, 0, sizeof *bhelper);
             return 6;
         }
         bhelper->dtb_count = mhelper.entry_count;
         bhelper->multi_version = mhelper.version;
         if (!(bhelper->dtbs = malloc(bhelper->dtb_count * sizeof *bhelper->dtbs))) {
             prln_error_with_errno("failed to allocate memory for multi DTBs");
-            free(buffer_read);
+            free(mhelper.entries);
+            dtb_free_buffer_helper(bhelper);
+            memset(bhelper, 0, sizeof *bhelper);
             return 7;
         }
         memset(bhelper->dtbs, 0, bhelper->dtb_count * sizeof *bhelper->dtbs);
         for (unsigned i = 0; i < bhelper->dtb_count; ++i) {
-            if (dtb_parse_entry(bhelper->dtbs + i, mhelper.entries[i].dtb) > 0) {
+            if (dtb_buffer_entry_from_multi_entry(bhelper->dtbs + i, mhelper.entries + i, size_use)) {
                 prln_error("failed to parse entry %u of %u", i + 1, bhelper->dtb_count);
-                for (unsigned j = 0; j < i; ++j) {
-                    free(bhelper->dtbs[j].buffer);
-                }
-                free(bhelper->dtbs);
-                free(buffer_read);
-                bhelper->dtbs = NULL;
-                bhelper->dtb_count = 0;
+                free(mhelper.entries);
+                dtb_free_buffer_helper(bhelper);
+                memset(bhelper, 0, sizeof *bhelper);
                 return 8;
             }
-            if (strncmp((bhelper->dtbs + i)->target, mhelper.entries[i].target, DTB_MULTI_HEADER_PROPERTY_LENGTH_V2 * 3)) {
-                prln_error("target name in header is different from amlogic-dt-id in DTS: %s != %s", mhelper.entries[i].target, (bhelper->dtbs + i)->target);
-                for (unsigned j = 0; j <= i; ++j) {
-                    free(bhelper->dtbs[j].buffer);
-                }
-                free(bhelper->dtbs);
-                free(buffer_read);
-                bhelper->dtbs = NULL;
-                bhelper->dtb_count = 0;
-                return 9;
+        }
+        free(mhelper.entries);
+        unsigned const current = current_board ? dtb_buffer_helper_find_current_board(bhelper) : bhelper->dtb_count;
+        if (current < bhelper->dtb_count) {
+            if (dtb_buffer_helper_materialize(bhelper, current)) {
+                dtb_free_buffer_helper(bhelper);
+                memset(bhelper, 0, sizeof *bhelper);
+                return 12;
             }
+            /* Entries only borrow from the buffer, nothing to free for the ones dropped */
+            bhelper->dtbs[0] = bhelper->dtbs[current];
+            bhelper->dtb_count = 1;
+            return 0;
+        }
+        if (!lazy && dtb_buffer_helper_materialize_all(bhelper)) {
+            dtb_free_buffer_helper(bhelper);
+            memset(bhelper, 0, sizeof *bhelper);
+            return 12;
         }
     } else {
         bhelper->dtb_count = 1;
         if (!(bhelper->dtbs = malloc(sizeof *bhelper->dtbs))) {
             prln_error("failed to allocate memory for DTB");
-            free(buffer_read);
+            dtb_free_buffer_helper(bhelper);
+            memset(bhelper, 0, sizeof *bhelper);
             return 10;
         }
-        if (dtb_parse_entry(bhelper->dtbs, buffer_use) > 0) {
+        memset(bhelper->dtbs, 0, sizeof *bhelper->dtbs);
+        if (dtb_parse_entry(bhelper->dtbs, buffer_use, size_use, true) > 0) {
             prln_error("failed to parse the only entry");
-            free(bhelper->dtbs);
-            free(buffer_read);
+            dtb_free_buffer_helper(bhelper);
+            memset(bhelper, 0, sizeof *bhelper);
             return 11;
         }
     }
-    if (bhelper->type_main == DTB_TYPE_GZIPPED) {
-        free(buffer_use);
-    }
-    free(buffer_read);
     return 0;
 }
 
+/*
+ Each entry only needs to be checked against the first one. Different
+ fingerprints prove different partitions, same ones are still confirmed by a
+ full comparison. Entries not parsed yet can't be vouched for and fail the check
+*/
 int
 dtb_check_buffers_partitions(
     struct dtb_buffer_helper const * const  bhelper
@@ -535,34 +880,24 @@ dtb_check_buffers_partitions(
     if (!bhelper || !bhelper->dtb_count) {
         return -1;
     }
-    if (bhelper->dtb_count == 1) {
-        if (!bhelper->dtbs->phelper.partitions_count) {
-            return -2;
-        }
-        return 0;
+    struct dtb_buffer_entry const *const first = bhelper->dtbs;
+    if (!first->parsed) {
+        return -3;
     }
-    struct dts_partitions_helper const *phelper_a, *phelper_b;
-    struct dts_partition_entry const *entry_a, *entry_b;
-    for (unsigned i = 0; i < bhelper->dtb_count; ++i) {
-        phelper_a = &((bhelper->dtbs+i)->phelper);
-        for (unsigned j = i; j < bhelper->dtb_count; ++j) {
-            phelper_b = &((bhelper->dtbs+j)->phelper);
-            if (phelper_a->partitions_count != phelper_b->partitions_count) {
-                return 1;
-            }
-            if (!phelper_a->partitions_count) { // Essentially should mean both 0
-                return -2;
-            }
-            if (phelper_a->partitions_count > MAX_PARTITIONS_COUNT) {
-                return -2;
-            }
-            for (unsigned k = 0; k <phelper_a->partitions_count; ++k) {
-                entry_a = phelper_a->partitions + k;
-                entry_b = phelper_a->partitions + k;
-                if (strncmp(entry_a->name, entry_b->name, MAX_PARTITION_NAME_LENGTH) || entry_a->size != entry_b->size || entry_a->mask != entry_b->mask) {
-                    return 2;
-                }
-            }
+    if (!first->phelper.partitions_count || first->phelper.partitions_count > MAX_PARTITIONS_COUNT) {
+        return -2;
+    }
+    struct dtb_buffer_entry const *entry;
+    for (unsigned i = 1; i < bhelper->dtb_count; ++i) {
+        entry = bhelper->dtbs + i;
+        if (!entry->parsed) {
+            return -3;
+        }
+        if (entry->phelper.partitions_count != first->phelper.partitions_count) {
+            return 1;
+        }
+        if (entry->fingerprint_partitions != first->fingerprint_partitions || dts_compare_partitions(&entry->phelper, &first->phelper)) {
+            return 2;
         }
     }
     return 0;
@@ -573,15 +908,21 @@ dtb_read_into_buffer_helper_and_report(
     struct dtb_buffer_helper *  bhelper,
     int const                   fd,
     size_t const                size_max,
-    bool const                  checksum
+    bool const                  checksum,
+    bool const                  current_board,
+    bool const                  lazy
 ){
     if (!bhelper) {
         return 1;
     }
-    if (dtb_read_into_buffer_helper(bhelper, fd, size_max, checksum)) {
+    if (dtb_read_into_buffer_helper(bhelper, fd, size_max, checksum, current_board, lazy)) {
         return 2;
     }
     for (unsigned i = 0; i < bhelper->dtb_count; ++i) {
+        if (!bhelper->dtbs[i].parsed) {
+            prln_info("DTB %u of %u for %s is not parsed yet", i + 1, bhelper->dtb_count, bhelper->dtbs[i].target);
+            continue;
+        }
         prln_info("DTB %u of %u", i + 1, bhelper->dtb_count);
         if (bhelper->dtbs[i].has_partitions) {
             dts_report_partitions(&bhelper->dtbs[i].phelper);
@@ -684,21 +1025,283 @@ dtb_snapshot(
     return 0;
 }
 
-int
-dtb_webreport(
-    struct dtb_buffer_helper const * const  bhelper,
-    char * const                            arg_dsnapshot,
-    uint32_t * const                        len_dsnapshot
+static inline
+bool
+dtb_query_value_is_strings(
+    uint8_t const * const   value,
+    uint32_t const          len
 ){
-    if (!bhelper || !bhelper->dtb_count || !bhelper->dtbs->phelper.partitions_count) {
-        prln_error("DTB invalid");
-        return 1;
+    if (!len || !value[0] || value[len - 1]) {
+        return false;
     }
-    char *current = arg_dsnapshot;
-    uint32_t len_available = DTB_WEBREPORT_ARG_MAXLEN;
-    // For each partition
-    struct dts_partitions_helper const *const phelper = &bhelper->dtbs->phelper;
-    uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
+    for (uint32_t i = 0; i < len; ++i) {
+        if (value[i]) {
+            if (value[i] < 0x20 || value[i] > 0x7e) {
+                return false;
+            }
+        } else if (i + 1 < len && !value[i + 1]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Values are printed the way dtc would: strings, cells, or bytes */
+static inline
+void
+dtb_query_print_value(
+    uint8_t const * const   value,
+    uint32_t const          len
+){
+    if (dtb_query_value_is_strings(value, len)) {
+        for (uint32_t i = 0; i < len; i += strlen((char const *)value + i) + 1) {
+            printf(i ? ", \"%s\"" : "\"%s\"", value + i);
+        }
+    } else if (len && !(len % 4)) {
+        putchar('<');
+        for (uint32_t i = 0; i < len; i += 4) {
+            printf(i ? " 0x%"PRIx32 : "0x%"PRIx32, bswap_32(*(uint32_t const *)(value + i)));
+        }
+        putchar('>');
+    } else if (len) {
+        putchar('[');
+        for (uint32_t i = 0; i < len; ++i) {
+            printf(i ? " %02x" : "%02x", value[i]);
+        }
+        putchar(']');
+    }
+}
+
+static
+int
+dtb_query_list_begin_node(
+    void * const            context_void,
+    uint8_t const * const   node,
+    uint32_t const          depth
+){
+    struct dtb_query_list_context *const context = context_void;
+    if (depth == 1) {
+        printf(context->listed ? " %s/" : "%s/", node);
+        context->listed = true;
+    }
+    return 0;
+}
+
+static
+int
+dtb_query_list_prop(
+    void * const            context_void,
+    uint8_t const * const   node,
+    uint32_t const          name_off,
+    uint32_t const          len,
+    uint8_t const * const   value,
+    uint32_t const          depth
+){
+    (void)node;
+    (void)len;
+    (void)value;
+    struct dtb_query_list_context *const context = context_void;
+    if (!depth) {
+        printf(context->listed ? " %s" : "%s", name_off < context->shelper->length ? context->shelper->stringblock + name_off : "?");
+        context->listed = true;
+    }
+    return 0;
+}
+
+/* A node is printed as the names of its properties and then its sub nodes, sub nodes ending with / */
+static inline
+void
+dtb_query_print_node(
+    uint8_t const * const                       dts,
+    struct dts_node_index_entry const * const   nentry,
+    struct stringblock_helper const * const     shelper
+){
+    struct dtb_query_list_context context = {
+        .shelper = shelper,
+        .listed = false
+    };
+    struct dts_walker const walker = {
+        .begin_node = dtb_query_list_begin_node,
+        .prop = dtb_query_list_prop
+    };
+    putchar('{');
+    dts_walk(dts + nentry->offset - 4, nentry->end + 8 - nentry->offset, &walker, &context);
+    putchar('}');
+}
+
+/*
+ Entries read lazily are only parsed here, so their blocks are validated
+ against their sizes before they are indexed
+*/
+int
+dtb_query(
+    struct dtb_buffer_helper * const    bhelper,
+    int const                           argc,
+    char const * const * const          argv
+){
+    if (!bhelper || !bhelper->dtb_count || !argv) {
+        prln_error("illegal arguments");
+        return -1;
+    }
+    int missing = 0;
+    struct dtb_buffer_entry const *entry;
+    struct dts_node_index nindex;
+    struct stringblock_helper shelper;
+    struct dtb_header dh;
+    uint8_t const *dts;
+    for (unsigned i = 0; i < bhelper->dtb_count; ++i) {
+        entry = bhelper->dtbs + i;
+        if (!entry->parsed && dtb_buffer_helper_materialize(bhelper, i)) {
+            prln_error("failed to parse DTB %u of %u", i + 1, bhelper->dtb_count);
+            return 1;
+        }
+        dh = dtb_header_swapbytes((struct dtb_header const *)entry->buffer);
+        dts = entry->buffer + dh.off_dt_struct;
+        if (dts_node_index_build(&nindex, dts, dh.size_dt_struct, NULL)) {
+            prln_error("failed to index nodes in DTB %u of %u", i + 1, bhelper->dtb_count);
+            return 1;
+        }
+        dtb_complete_stringblock_helper(entry->buffer, &shelper);
+        for (int j = 0; j < argc; ++j) {
+            char const *const path = argv[j];
+            size_t const len_path = strlen(path);
+            int64_t node = dts_node_index_find(&nindex, dts, path, len_path);
+            char const *const name = len_path ? memrchr(path, '/', len_path) : NULL;
+            uint8_t const *value;
+            uint32_t len;
+            if (node >= 0) {
+                if (bhelper->dtb_count > 1) {
+                    printf("%s:", entry->target);
+                }
+                printf("%s=", path);
+                dtb_query_print_node(dts, nindex.entries + node, &shelper);
+                putchar('\n');
+            } else if (name && (node = dts_node_index_find(&nindex, dts, path, name == path ? 1 : (size_t)(name - path))) >= 0 && !dts_node_get_property(dts, nindex.entries + node, &shelper, name + 1, &value, &len)) {
+                if (bhelper->dtb_count > 1) {
+                    printf("%s:", entry->target);
+                }
+                printf("%s=", path);
+                dtb_query_print_value(value, len);
+                putchar('\n');
+            } else {
+                prln_error("%s does not exist in DTB %u of %u", path, i + 1, bhelper->dtb_count);
+                ++missing;
+            }
+        }
+        dts_node_index_free(&nindex);
+    }
+    return missing ? 2 : 0;
+}
+
+static inline
+int
+dtb_diff_side_init(
+    struct dts_diff_side * const            side,
+    struct dts_node_index * const           nindex,
+    struct stringblock_helper * const       shelper,
+    struct dtb_buffer_entry const * const   entry
+){
+    struct dtb_header const dh = dtb_header_swapbytes((struct dtb_header const *)entry->buffer);
+    dtb_complete_stringblock_helper(entry->buffer, shelper);
+    side->dts = entry->buffer + dh.off_dt_struct;
+    side->nindex = nindex;
+    side->shelper = shelper;
+    return dts_node_index_build(nindex, side->dts, dh.size_dt_struct, shelper);
+}
+
+static inline
+int
+dtb_diff_entries(
+    struct dtb_buffer_entry const * const   entry_a,
+    struct dtb_buffer_entry const * const   entry_b,
+    char const * const                      prefix,
+    unsigned * const                        diffs
+){
+    if (entry_a->size == entry_b->size && entry_a->fingerprint_blob == entry_b->fingerprint_blob && !memcmp(entry_a->buffer, entry_b->buffer, entry_a->size)) {
+        return 0;
+    }
+    struct dts_node_index nindex_a, nindex_b;
+    struct stringblock_helper shelper_a, shelper_b;
+    struct dts_diff_side side_a, side_b;
+    if (dtb_diff_side_init(&side_a, &nindex_a, &shelper_a, entry_a)) {
+        return 1;
+    }
+    if (dtb_diff_side_init(&side_b, &nindex_b, &shelper_b, entry_b)) {
+        dts_node_index_free(&nindex_a);
+        return 2;
+    }
+    *diffs += dts_diff(&side_a, &side_b, prefix);
+    dts_node_index_free(&nindex_a);
+    dts_node_index_free(&nindex_b);
+    return 0;
+}
+
+/*
+ Compare DTBs in b against a, plain DTBs are compared directly, entries of multi-DTBs
+ are paired by their targets and every line is prefixed with the target
+*/
+int
+dtb_diff(
+    struct dtb_buffer_helper const * const  bhelper_a,
+    struct dtb_buffer_helper const * const  bhelper_b,
+    unsigned * const                        diffs
+){
+    if (!bhelper_a || !bhelper_b || !bhelper_a->dtb_count || !bhelper_b->dtb_count || !diffs) {
+        prln_error("illegal arguments");
+        return -1;
+    }
+    *diffs = 0;
+    if (bhelper_a->dtb_count == 1 && bhelper_b->dtb_count == 1) {
+        if (dtb_diff_entries(bhelper_a->dtbs, bhelper_b->dtbs, "", diffs)) {
+            prln_error("failed to compare DTBs");
+            return 1;
+        }
+        return 0;
+    }
+    char prefix[DTB_MULTI_TARGET_LENGTH_V2 + 2];
+    struct dtb_buffer_entry const *entry_a, *entry_b;
+    unsigned j;
+    for (unsigned i = 0; i < bhelper_a->dtb_count; ++i) {
+        entry_a = bhelper_a->dtbs + i;
+        snprintf(prefix, sizeof prefix, "%s:", entry_a->target);
+        for (j = 0; j < bhelper_b->dtb_count && strcmp(entry_a->target, bhelper_b->dtbs[j].target); ++j);
+        if (j == bhelper_b->dtb_count) {
+            printf("%s- /\n", prefix);
+            ++*diffs;
+            continue;
+        }
+        entry_b = bhelper_b->dtbs + j;
+        if (dtb_diff_entries(entry_a, entry_b, prefix, diffs)) {
+            prln_error("failed to compare DTB %s", entry_a->target);
+            return 2;
+        }
+    }
+    for (unsigned i = 0; i < bhelper_b->dtb_count; ++i) {
+        entry_b = bhelper_b->dtbs + i;
+        for (j = 0; j < bhelper_a->dtb_count && strcmp(entry_b->target, bhelper_a->dtbs[j].target); ++j);
+        if (j == bhelper_a->dtb_count) {
+            printf("%s:+ /\n", entry_b->target);
+            ++*diffs;
+        }
+    }
+    return 0;
+}
+
+int
+dtb_webreport(
+    struct dtb_buffer_helper const * const  bhelper,
+    char * const                            arg_dsnapshot,
+    uint32_t * const                        len_dsnapshot
+){
+    if (!bhelper || !bhelper->dtb_count || !bhelper->dtbs->phelper.partitions_count) {
+        prln_error("DTB invalid");
+        return 1;
+    }
+    char *current = arg_dsnapshot;
+    uint32_t len_available = DTB_WEBREPORT_ARG_MAXLEN;
+    // For each partition
+    struct dts_partitions_helper const *const phelper = &bhelper->dtbs->phelper;
+    uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
     struct dts_partition_entry const *pentry;
     int len_this;
     bool started = false;
@@ -732,71 +1335,187 @@ dtb_webreport(
     return 0;
 }
 
+static inline
+struct dtb_compose_memo_entry const *
+dtb_compose_memo_find(
+    struct dtb_compose_memo const * const   memo,
+    uint64_t const                          fingerprint,
+    size_t const                            len_node
+){
+    for (unsigned i = 0; i < memo->count; ++i) {
+        if (memo->entries[i].fingerprint == fingerprint && memo->entries[i].len_node == len_node) {
+            return memo->entries + i;
+        }
+    }
+    return NULL;
+}
+
+static
 int
-dtb_buffer_entry_implement_partitions(
+dtb_verify_splice_begin_node(
+    void * const            context,
+    uint8_t const * const   node,
+    uint32_t const          depth
+){
+    (void)node;
+    if (depth == 1) {
+        ++((struct dtb_verify_context *)context)->partitions_count;
+    }
+    return 0;
+}
+
+static
+int
+dtb_verify_splice_prop(
+    void * const            context,
+    uint8_t const * const   node,
+    uint32_t const          name_off,
+    uint32_t const          len,
+    uint8_t const * const   value,
+    uint32_t const          depth
+){
+    (void)node;
+    (void)len;
+    (void)value;
+    (void)depth;
+    if (name_off >= ((struct dtb_verify_context *)context)->size_dt_strings) {
+        prln_error("property name offset 0x%x outside of the string block", name_off);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ Everything outside of the new partitions node was copied verbatim from a DTB already
+ parsed successfully, so only the header, the new node and its boundaries need checks
+*/
+static inline
+int
+dtb_verify_splice(
+    uint8_t const * const                               dbuffer,
+    uint8_t const * const                               node,   // After the BEGIN_NODE token
+    size_t const                                        len_node,
+    struct dts_partitions_helper_simple const * const   phelper
+){
+    struct dtb_header const dh = dtb_header_swapbytes((struct dtb_header const *)dbuffer);
+    if (dh.off_dt_struct + dh.size_dt_struct > dh.off_dt_strings || dh.off_dt_strings + dh.size_dt_strings > dh.totalsize || dh.size_dt_struct < 8) {
+        prln_error("header offsets broken, struct 0x%x+0x%x, strings 0x%x+0x%x, total 0x%x", dh.off_dt_struct, dh.size_dt_struct, dh.off_dt_strings, dh.size_dt_strings, dh.totalsize);
+        return 1;
+    }
+    uint32_t const *const struct_end = (uint32_t const *)(dbuffer + dh.off_dt_struct + dh.size_dt_struct);
+    if (struct_end[-2] != DTS_END_NODE_ACTUAL || struct_end[-1] != DTS_END_ACTUAL) {
+        prln_error("structure block does not end with END_NODE and END");
+        return 2;
+    }
+    uint32_t const token_after = *(uint32_t const *)(node + len_node + 4);
+    if (token_after != DTS_BEGIN_NODE_ACTUAL && token_after != DTS_END_NODE_ACTUAL && token_after != DTS_PROP_ACTUAL && token_after != DTS_NOP_ACTUAL) {
+        prln_error("invalid token 0x%08x after new partitions node", bswap_32(token_after));
+        return 3;
+    }
+    struct dtb_verify_context context = {.size_dt_strings = dh.size_dt_strings};
+    struct dts_walker const walker = {
+        .begin_node = dtb_verify_splice_begin_node,
+        .prop = dtb_verify_splice_prop
+    };
+    if (dts_walk(node - 4, len_node + 8, &walker, &context)) {
+        prln_error("new partitions node is broken");
+        return 4;
+    }
+    if (context.partitions_count != phelper->partitions_count) {
+        prln_error("new partitions node has %u partitions instead of %u", context.partitions_count, phelper->partitions_count);
+        return 5;
+    }
+    return 0;
+}
+
+/* Without the full verification, the new entry takes what it needs from the old one and the wanted partitions */
+static inline
+void
+dtb_fill_composed_entry(
     struct dtb_buffer_entry * const                     new,
     struct dtb_buffer_entry const * const               old,
+    uint8_t * const                                     dbuffer,
+    size_t const                                        size,
+    uint8_t * const                                     node,
+    size_t const                                        len_node,
     struct dts_partitions_helper_simple const * const   phelper
+){
+    *new = *old;
+    new->buffer = dbuffer;
+    new->size = size;
+    new->borrowed = false;
+    new->has_partitions = true;
+    memset(&new->phelper, 0, sizeof new->phelper); // Phandles are not known without parsing, but nothing after composing needs them
+    uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
+    for (uint32_t i = 0; i < pcount; ++i) {
+        memcpy(new->phelper.partitions[i].name, phelper->partitions[i].name, MAX_PARTITION_NAME_LENGTH);
+        new->phelper.partitions[i].size = phelper->partitions[i].size;
+        new->phelper.partitions[i].mask = phelper->partitions[i].mask;
+    }
+    new->phelper.partitions_count = pcount;
+    new->phelper.record_count = pcount;
+    new->phelper.node = node;
+    new->phelper.node_length = len_node + 8;
+    new->fingerprint_partitions = dts_get_partitions_fingerprint_simple(phelper);
+    new->fingerprint_blob = util_hash64(UTIL_HASH64_INITIAL, dbuffer, size);
+}
+
+static inline
+int
+dtb_buffer_entry_implement_partitions(
+    struct dtb_buffer_entry * const                     new,
+    struct dtb_buffer_entry const * const               old,
+    struct dts_partitions_helper_simple const * const   phelper,
+    struct dtb_compose_memo * const                     memo,   // Optional, partitions nodes composed for earlier entries
+    struct arena * const                                arena   // The new buffer and all temporaries come from it
 ){
     if (!old || !new || !phelper || !old->buffer || !phelper->partitions_count) {
         prln_error("invalid arguments");
         return -1;
     }
+    if (old->has_partitions && old->fingerprint_partitions == dts_get_partitions_fingerprint_simple(phelper) && !dts_compare_partitions_mixed(&old->phelper, phelper)) {
+        prln_info("partitions in DTB already same as wanted, reusing it as is");
+        *new = *old;
+        new->borrowed = true;
+        return 0;
+    }
     struct dtb_header const dh = dtb_header_swapbytes((struct dtb_header *)old->buffer);
+    struct stringblock_index sindex = {.arena = arena};
     struct stringblock_helper shelper = {
         .stringblock = (char *)old->buffer + dh.off_dt_strings,
         .length = dh.size_dt_strings,
-        .allocated_length = dh.size_dt_strings
+        .allocated_length = dh.size_dt_strings,
+        .index = &sindex
     };
-    off_t const offset_phandle = stringblock_find_string(&shelper, "phandle");
+    struct dts_phandle_list plist = {0};
+    struct dts_scan_helper scan = {.plist = &plist, .arena = arena};
+    if (dts_scan(&scan, old->buffer + dh.off_dt_struct, dh.size_dt_struct, &shelper)) {
+        prln_error("failed to get phandles");
+        return 3;
+    }
+    off_t const offset_phandle = scan.offset_phandle;
     if (offset_phandle < 0) {
         prln_error("failed to get offset of phandle");
         return 2;
     }
-    off_t const offset_linux_phandle = stringblock_find_string(&shelper, "linux,phandle");
+    off_t const offset_linux_phandle = scan.offset_linux_phandle;
     if (offset_linux_phandle < 0) {
         prln_warn("failed to get offset of linux,phandle");
     }
-    struct dts_phandle_list plist = {0};
-    if (dts_get_phandles(&plist, old->buffer + dh.off_dt_struct, dh.size_dt_struct, offset_phandle, offset_linux_phandle)) {
-        prln_error("failed to get phandles");
-        return 3;
-    }
     if (old->has_partitions && dts_drop_partitions_phandles(&plist, &old->phelper)) {
         prln_error("failed to drop phandles occupied by partitions node");
-        free(plist.entries);
         return 4;
     }
-    shelper.allocated_length = util_nearest_upper_bound_with_multiply_long(shelper.length, 0x1000, 2);
-    char *const sbuffer = malloc(shelper.allocated_length * sizeof *sbuffer);
-    if (!sbuffer) {
-        free(plist.entries);
-        return 5;
-    }
-    memcpy(sbuffer, shelper.stringblock, shelper.length * sizeof *shelper.stringblock);
-    memset(sbuffer + shelper.length, 0, (shelper.allocated_length - shelper.length) * sizeof *sbuffer);
-    shelper.stringblock = sbuffer;
-    uint8_t *node = NULL;
-    size_t len_node = 0;
-    if (dts_compose_partitions_node(&node, &len_node, &plist, phelper, &shelper, offset_phandle, offset_linux_phandle) || !node) {
-        prln_error("failed to compose new partitions node");
-        free(shelper.stringblock);
-        free(plist.entries);
-        return 5;
-    }
     uint8_t *node_start, *end_start;
     size_t len_existing_node;
     if (old->phelper.node) {
         node_start = old->phelper.node - 4; // For the sake of DTS calling, it starts at the node's name instead of the BEGIN_NODE token, we get that 4 byte back here
-        len_existing_node = dts_get_node_full_length(old->phelper.node, dh.size_dt_struct);
+        len_existing_node = old->phelper.node_length;
         end_start = node_start + len_existing_node;
     } else {
         node_start = old->buffer + dh.off_dt_struct + dh.size_dt_struct - 8; 
         // e.g. 0x38 start, 0x11368 size, then start + size is 0x113a0, this address is after the acutal end (essentially the start of DT sting, so we need to go backwards by 8 (pass 4 for END, pass 4 for END_NODE))
         if (*(uint32_t*)node_start != DTS_END_NODE_ACTUAL || *(uint32_t *)(node_start + 4) != DTS_END_ACTUAL) {
-            free(node);
-            free(shelper.stringblock);
-            free(plist.entries);
             return 6;
         }
         len_existing_node = 0;
@@ -812,51 +1531,77 @@ dtb_buffer_entry_implement_partitions(
           . . . .   . . . .  [BEGIN_NODE . . . .  END_NODE] END_ROOT    END
         */
     }
+    size_t const len_node = dts_get_partitions_node_length(phelper, plist.status & DTS_HAS_LINUX_PHANDLE);
     size_t const size_before = node_start - old->buffer; // Before the new BEGIN_NODE token
     size_t const size_after = old->buffer + dh.off_dt_struct + dh.size_dt_struct - end_start;
     size_t const size_dt_struct = size_before - dh.off_dt_struct + size_after + len_node + 8;
     size_t const offset_dt_strings = dh.off_dt_strings + size_dt_struct - dh.size_dt_struct; 
-    size_t const size_new = util_nearest_upper_bound_ulong(old->size - dh.size_dt_struct + size_dt_struct - dh.size_dt_strings + shelper.length, 4);
-    prln_info("old DTB size 0x%lx, existing partitions node in it size is 0x%lx, DT struct offset 0x%x, size 0x%x; new node size 0x%lx, will insert between %p (off 0x%lx) and %p (off 0x%lx), size before insertion is 0x%lx, size after insertion is 0x%lx, size of new DT struct is 0x%lx, new DT strings offset 0x%lx, size 0x%lx; total size of new DTB is 0x%lx", old->size, len_existing_node, dh.off_dt_struct, dh.size_dt_struct, len_node, node_start, node_start - old->buffer, end_start, end_start - old->buffer, size_before, size_after, size_dt_struct, offset_dt_strings, shelper.length, size_new);
-    uint8_t *dbuffer = malloc(size_new * sizeof *dbuffer);
+    /*
+     Everything lands in its final place in one buffer: the node is composed right
+     between the spliced struct block parts, and the strings it needs are appended
+     right after the copied stringblock, which ends the DTB so it has room to grow
+    */
+    size_t const size_capacity = util_nearest_upper_bound_ulong(offset_dt_strings + dh.size_dt_strings + dts_get_partitions_node_strings_length(phelper), 4);
+    uint8_t *const dbuffer = arena_alloc(arena, size_capacity * sizeof *dbuffer);
     if (!dbuffer) {
-        free(node);
-        free(shelper.stringblock);
-        free(plist.entries);
         return 7;
     }
-    memset(dbuffer, 0, size_new * sizeof *dbuffer);
     uint8_t *offset_hot = dbuffer;
     memcpy(offset_hot, old->buffer, size_before);
     *(uint32_t *)(offset_hot += size_before) = DTS_BEGIN_NODE_ACTUAL;
-    memcpy((offset_hot += 4), node, len_node);
+    memset((offset_hot += 4), 0, len_node);
+    uint8_t *const node = offset_hot;
     *(uint32_t *)(offset_hot += len_node) = DTS_END_NODE_ACTUAL;
     memcpy((offset_hot += 4), end_start, size_after);
     memcpy((offset_hot += size_after), shelper.stringblock, shelper.length);
+    memset(offset_hot + shelper.length, 0, dbuffer + size_capacity - offset_hot - shelper.length);
+    shelper.stringblock = (char *)offset_hot;
+    shelper.allocated_length = dbuffer + size_capacity - offset_hot;
+    uint64_t fingerprint = 0;
+    struct dtb_compose_memo_entry const *memo_entry = NULL;
+    if (memo) {
+        fingerprint = dts_get_partitions_node_fingerprint(&plist, phelper, &shelper, offset_phandle, offset_linux_phandle);
+        pthread_mutex_lock(&memo->lock);
+        memo_entry = dtb_compose_memo_find(memo, fingerprint, len_node);
+        pthread_mutex_unlock(&memo->lock);
+    }
+    if (memo_entry) {
+        prln_info("phandles and strings same as an earlier entry, reusing the partitions node composed for it");
+        memcpy(node, memo_entry->node, len_node);
+        dts_append_partitions_node_strings(phelper, &shelper);
+    } else if (dts_compose_partitions_node(node, &plist, phelper, &shelper, offset_phandle, offset_linux_phandle)) {
+        prln_error("failed to compose new partitions node");
+        return 5;
+    } else if (memo) {
+        pthread_mutex_lock(&memo->lock);
+        memo->entries[memo->count++] = (struct dtb_compose_memo_entry){fingerprint, node, len_node};
+        pthread_mutex_unlock(&memo->lock);
+    }
+    size_t const size_new = util_nearest_upper_bound_ulong(offset_dt_strings + shelper.length, 4);
+    prln_info("old DTB size 0x%lx, existing partitions node in it size is 0x%lx, DT struct offset 0x%x, size 0x%x; new node size 0x%lx, will insert between %p (off 0x%lx) and %p (off 0x%lx), size before insertion is 0x%lx, size after insertion is 0x%lx, size of new DT struct is 0x%lx, new DT strings offset 0x%lx, size 0x%lx; total size of new DTB is 0x%lx", old->size, len_existing_node, dh.off_dt_struct, dh.size_dt_struct, len_node, node_start, node_start - old->buffer, end_start, end_start - old->buffer, size_before, size_after, size_dt_struct, offset_dt_strings, shelper.length, size_new);
     struct dtb_header *dh_new = (struct dtb_header *)dbuffer;
     dh_new->totalsize = bswap_32(size_new);
     dh_new->size_dt_struct = bswap_32(size_dt_struct);
     dh_new->off_dt_strings = bswap_32(offset_dt_strings);
     dh_new->size_dt_strings = bswap_32(shelper.length);
-    free(node);
-    free(shelper.stringblock);
-    free(plist.entries);
-    int r = dtb_parse_entry(new, dbuffer);
-    free(dbuffer);
-    if (r) {
+    if (cli_options.verify != CLI_VERIFY_FULL) {
+        if (cli_options.verify == CLI_VERIFY_STRUCTURAL && dtb_verify_splice(dbuffer, node, len_node, phelper)) {
+            prln_error("new DTB is structurally broken");
+            return 8;
+        }
+        dtb_fill_composed_entry(new, old, dbuffer, size_new, node, len_node, phelper);
+        return 0;
+    }
+    if (dtb_parse_entry(new, dbuffer, size_capacity, false)) {
         prln_error("failed to convert to buffer entry");
         return 8;
     }
     if (!new->has_partitions || !new->phelper.partitions_count) {
         prln_error("new buffer entry does not have partitions node, which is impossible");
-        free(new->buffer);
-        new->buffer = NULL;
         return 9;
     }
     if (dts_compare_partitions_mixed(&new->phelper, phelper)) {
         prln_error("reconstructed DTB yeilds different partitions:");
-        free(new->buffer);
-        new->buffer = NULL;
         return 10;
     }
     prln_error("constructed DTB yields same partitions, all good");
@@ -879,33 +1624,73 @@ dtb_buffer_helper_not_all_have_buffer(
     return r;
 }
 
+static
+void
+dtb_implement_job_run(
+    void * const    context,
+    unsigned const  index
+){
+    struct dtb_implement_job const *const job = context;
+    job->results[index] = dtb_buffer_entry_implement_partitions(job->dtbs_new + index, job->dtbs_old + index, job->phelper, job->memo, job->arena);
+}
+
+/* The new helper has the same types as the old one, with entries allocated from arena and zeroed */
+static inline
+int
+dtb_buffer_helper_init_like(
+    struct dtb_buffer_helper * const        new,
+    struct dtb_buffer_helper const * const  old,
+    struct arena * const                    arena
+){
+    memset(new, 0, sizeof *new);
+    if (!(new->dtbs = arena_calloc(arena, old->dtb_count, sizeof *new->dtbs))) {
+        prln_error_with_errno("failed to allocate memory for entries");
+        return 1;
+    }
+    new->dtb_count = old->dtb_count;
+    new->type_main = old->type_main;
+    new->type_sub = old->type_sub;
+    new->multi_version = old->multi_version;
+    new->arena = arena;
+    return 0;
+}
+
 int
 dtb_buffer_helper_implement_partitions(
     struct dtb_buffer_helper * const                    new,
     struct dtb_buffer_helper const * const              old,
-    struct dts_partitions_helper_simple const * const   phelper
+    struct dts_partitions_helper_simple const * const   phelper,
+    struct arena * const                                arena
 ){
-    if (!old || !new || !phelper || !old->dtb_count || dtb_buffer_helper_not_all_have_buffer(old) || !phelper->partitions_count) {
+    if (!old || !new || !phelper || !arena || !old->dtb_count || dtb_buffer_helper_not_all_have_buffer(old) || !phelper->partitions_count) {
         prln_error("invalid arguments");
         return -1;
     }
-    new->dtb_count = old->dtb_count;
-    if (!(new->dtbs = malloc(new->dtb_count * sizeof *new->dtbs))) {
-        prln_error("failed to allocate memory for entries");
-        new->dtb_count = 0;
+    if (dtb_buffer_helper_init_like(new, old, arena)) {
         return 1;
     }
-    new->type_main = old->type_main;
-    new->type_sub = old->type_sub;
-    new->multi_version = old->multi_version;
+    int *const results = arena_alloc(arena, new->dtb_count * sizeof *results);
+    if (!results) {
+        prln_error("failed to allocate memory for implementing results");
+        return 1;
+    }
+    struct dtb_compose_memo memo = {.lock = PTHREAD_MUTEX_INITIALIZER};
+    if (new->dtb_count > 1 && !(memo.entries = arena_alloc(arena, new->dtb_count * sizeof *memo.entries))) {
+        prln_warn("failed to allocate memory for composed partitions nodes, composing each entry on its own");
+    }
+    struct dtb_implement_job job = {
+        .dtbs_new = new->dtbs,
+        .dtbs_old = old->dtbs,
+        .phelper = phelper,
+        .memo = memo.entries ? &memo : NULL,
+        .arena = arena,
+        .results = results
+    };
+    pool_run(new->dtb_count, cli_options.threads, dtb_implement_job_run, &job);
+    /* Entries are implemented concurrently, but failures are still reported in order */
     for (unsigned i = 0; i < new->dtb_count; ++i) {
-        struct dtb_buffer_entry const *const entry_old = old->dtbs + i;
-        struct dtb_buffer_entry *const entry_new = new->dtbs + i;
-        if (dtb_buffer_entry_implement_partitions(entry_new, entry_old, phelper)) {
+        if (results[i]) {
             prln_error("failed to implement new partitions into DTB %u of %u", i + 1, new->dtb_count);
-            for (unsigned j = 0; j < i; ++j) {
-                free((new->dtbs + j)->buffer);
-            }
             return 2;
         }
     }
@@ -915,7 +1700,8 @@ dtb_buffer_helper_implement_partitions(
 int
 dtb_buffer_entry_remove_partitions(
     struct dtb_buffer_entry * const                     new,
-    struct dtb_buffer_entry const * const               old
+    struct dtb_buffer_entry const * const               old,
+    struct arena * const                                arena
 ){
     if (!old || !new || !old->buffer) {
         prln_error("invalid arguments");
@@ -923,11 +1709,12 @@ dtb_buffer_entry_remove_partitions(
     }
     memset(new, 0, sizeof *new);
     if (!old->phelper.node) {
-        if (!(new->buffer = malloc(old->size))) {
+        if (!(new->buffer = arena_alloc(arena, old->size))) {
             return 1;
         }
         new->size = old->size;
         memcpy(new->buffer, old->buffer, new->size);
+        new->fingerprint_blob = old->fingerprint_blob;
         memcpy(new->target, old->target, sizeof new->target);
         memcpy(new->soc, old->soc, sizeof new->soc);
         memcpy(new->platform, old->platform, sizeof new->platform);
@@ -936,7 +1723,7 @@ dtb_buffer_entry_remove_partitions(
     }
     struct dtb_header const dh = dtb_header_swapbytes((struct dtb_header *)old->buffer);
     uint8_t *const node_start = old->phelper.node - 4;
-    size_t len_existing_node =  dts_get_node_full_length(old->phelper.node, dh.size_dt_struct);
+    size_t const len_existing_node = old->phelper.node_length;
     if (!len_existing_node) {
         return 2;
     }
@@ -946,7 +1733,7 @@ dtb_buffer_entry_remove_partitions(
     size_t const size_dt_struct = size_before - dh.off_dt_struct + size_after;
     size_t const offset_dt_strings = dh.off_dt_strings + size_dt_struct - dh.size_dt_struct; 
     size_t const size_new = util_nearest_upper_bound_ulong(old->size - dh.size_dt_struct + size_dt_struct, 4);
-    uint8_t *dbuffer = malloc(size_new * sizeof *dbuffer);
+    uint8_t *const dbuffer = arena_alloc(arena, size_new * sizeof *dbuffer);
     if (!dbuffer) {
         return 3;
     }
@@ -958,16 +1745,12 @@ dtb_buffer_entry_remove_partitions(
     dh_new->size_dt_struct = bswap_32(size_dt_struct);
     dh_new->off_dt_strings = bswap_32(offset_dt_strings);
     dh_new->size_dt_strings = bswap_32(dh.size_dt_strings);
-    int r = dtb_parse_entry(new, dbuffer);
-    free(dbuffer);
-    if (r > 0) {
+    if (dtb_parse_entry(new, dbuffer, size_new, false) > 0) {
         prln_error("failed to convert to buffer entry");
         return 4;
     }
     if (new->has_partitions || new->phelper.partitions_count) {
         prln_error("result DTB has partitions, give up");
-        free(new->buffer);
-        new->buffer = NULL;
         return 5;
     }
     prln_error("constructed DTB does not have partition, all good");
@@ -977,35 +1760,34 @@ dtb_buffer_entry_remove_partitions(
 int
 dtb_buffer_helper_remove_partitions(
     struct dtb_buffer_helper * const                    new,
-    struct dtb_buffer_helper const * const              old
+    struct dtb_buffer_helper const * const              old,
+    struct arena * const                                arena
 ){
-    if (!old || !new || !old->dtb_count || dtb_buffer_helper_not_all_have_buffer(old)) {
+    if (!old || !new || !arena || !old->dtb_count || dtb_buffer_helper_not_all_have_buffer(old)) {
         prln_error("invalid arguments");
         return -1;
     }
-    new->dtb_count = old->dtb_count;
-    if (!(new->dtbs = malloc(new->dtb_count * sizeof *new->dtbs))) {
-        prln_error_with_errno("failed to allocate memory for entries");
-        new->dtb_count = 0;
+    if (dtb_buffer_helper_init_like(new, old, arena)) {
         return 1;
     }
-    new->type_main = old->type_main;
-    new->type_sub = old->type_sub;
-    new->multi_version = old->multi_version;
     for (unsigned i = 0; i < new->dtb_count; ++i) {
-        struct dtb_buffer_entry const *const entry_old = old->dtbs + i;
-        struct dtb_buffer_entry *const entry_new = new->dtbs + i;
-        if (dtb_buffer_entry_remove_partitions(entry_new, entry_old)) {
+        if (dtb_buffer_entry_remove_partitions(new->dtbs + i, old->dtbs + i, arena)) {
             prln_error("failed to remove partitions into DTB %u of %u", i + 1, new->dtb_count);
-            for (unsigned j = 0; j < i; ++j) {
-                free((new->dtbs + j)->buffer);
-            }
             return 2;
         }
     }
     return 0;
 }
 
+static inline
+bool
+dtb_buffer_entry_same(
+    struct dtb_buffer_entry const * const   entry_a,
+    struct dtb_buffer_entry const * const   entry_b
+){
+    return entry_a->size == entry_b->size && entry_a->fingerprint_blob == entry_b->fingerprint_blob && !memcmp(entry_a->buffer, entry_b->buffer, entry_a->size);
+}
+
 char
 dtb_pedantic_multi_entry_char(
     char c
@@ -1017,13 +1799,20 @@ dtb_pedantic_multi_entry_char(
     }
 }
 
+/*
+ Combine the entries into a multi-DTB right in dtb, which has room for size_max
+ bytes. If it does not fit, 1 is returned with size set to what it would need,
+ and dtb is left as is
+*/
 int
 dtb_combine_multi_dtb(
-    uint8_t * * const dtb,
-    size_t *size,
-    struct dtb_buffer_helper const * const  bhelper
+    uint8_t * const                         dtb,
+    size_t const                            size_max,
+    size_t * const                          size,
+    struct dtb_buffer_helper const * const  bhelper,
+    size_t const                            alignment
 ){
-    if (!dtb || !size || !bhelper || !bhelper->dtb_count || !bhelper->multi_version || dtb_buffer_helper_not_all_have_buffer(bhelper)) {
+    if (!dtb || !size || !bhelper || !bhelper->arena || !bhelper->dtb_count || !bhelper->multi_version || dtb_buffer_helper_not_all_have_buffer(bhelper)) {
         prln_error("illegal arguments");
         return -1;
     }
@@ -1038,31 +1827,44 @@ dtb_combine_multi_dtb(
         default:
             printf("%u", bhelper->multi_version);
             prln_error("illegal multi DTB version");
-            return 1;
+            return 2;
     }
     size_t const entry_length = property_length * 3 + 8;
-    *size = util_nearest_upper_bound_ulong(12 + entry_length * bhelper->dtb_count, DTB_PAGE_SIZE);
-    size_t *offsets = malloc(bhelper->dtb_count * sizeof *offsets);
-    if (!offsets) {
-        return 2;
-    }
-    size_t *sizes = malloc(bhelper->dtb_count * sizeof *offsets);
-    if (!sizes) {
-        free(offsets);
+    *size = util_nearest_upper_bound_ulong(12 + entry_length * bhelper->dtb_count, alignment);
+    size_t *const offsets = arena_alloc(bhelper->arena, bhelper->dtb_count * sizeof *offsets);
+    size_t *const sizes = arena_alloc(bhelper->arena, bhelper->dtb_count * sizeof *sizes);
+    bool *const shared = arena_alloc(bhelper->arena, bhelper->dtb_count * sizeof *shared);
+    if (!offsets || !sizes || !shared) {
         return 3;
     }
+    /* The header only records where each entry is, so identical entries could all point to one copy */
+    unsigned shared_count = 0;
     for (unsigned i = 0; i < bhelper->dtb_count; ++i) {
+        shared[i] = false;
+        for (unsigned j = 0; j < i; ++j) {
+            if (!shared[j] && dtb_buffer_entry_same(bhelper->dtbs + i, bhelper->dtbs + j)) {
+                offsets[i] = offsets[j];
+                sizes[i] = sizes[j];
+                shared[i] = true;
+                ++shared_count;
+                break;
+            }
+        }
+        if (shared[i]) {
+            continue;
+        }
         offsets[i] = *size;
-        sizes[i] = util_nearest_upper_bound_ulong(bhelper->dtbs[i].size, DTB_PAGE_SIZE);
+        sizes[i] = util_nearest_upper_bound_ulong(bhelper->dtbs[i].size, alignment);
         *size += sizes[i];
     }
-    if (!(*dtb = malloc(*size * sizeof **dtb))) {
-        free(sizes);
-        free(offsets);
-        return 3;
+    if (shared_count) {
+        prln_info("%u of %u DTBs are the same as earlier ones, sharing their copies", shared_count, bhelper->dtb_count);
     }
-    memset(*dtb, 0, *size);
-    uint32_t *current = (uint32_t *)(*dtb);
+    if (*size > size_max) {
+        return 1;
+    }
+    memset(dtb, 0, *size);
+    uint32_t *current = (uint32_t *)dtb;
     *(current++) = DTB_MAGIC_MULTI;
     *(current++) = bhelper->multi_version;
     *(current++) = bhelper->dtb_count;
@@ -1090,78 +1892,413 @@ dtb_combine_multi_dtb(
         *(current++) = sizes[i];
     }
     for (unsigned i = 0; i < bhelper->dtb_count; ++i) {
-        bentry = bhelper->dtbs + i;
-        memcpy(*dtb + offsets[i], bentry->buffer, bentry->size);
+        if (!shared[i]) {
+            bentry = bhelper->dtbs + i;
+            memcpy(dtb + offsets[i], bentry->buffer, bentry->size);
+        }
+    }
+    return 0;
+}
+
+/* Fixed by --timestamp so the same input always gives the same output */
+static inline
+uint32_t
+dtb_get_timestamp(){
+    return cli_options.timestamp < 0 ? (uint32_t)time(NULL) : (uint32_t)cli_options.timestamp;
+}
+
+/*
+ Gzip size_in bytes at in into dtb, which is left as is on failure,
+ returns positive if it just could not fit
+*/
+static inline
+int
+dtb_compress(
+    uint8_t * const     dtb,
+    size_t * const      size,
+    uint8_t * const     in,
+    size_t const        size_in
+){
+    uint8_t *buffer;
+    size_t const size_gzipped = gzip_zip_search(in, size_in, &buffer, DTB_PARTITION_DATA_SIZE, cli_options.compress, cli_options.threads, dtb_get_timestamp());
+    if (!size_gzipped) {
+        prln_error("failed to compose gzipped DTB");
+        return -1;
+    }
+    if (size_gzipped > DTB_PARTITION_DATA_SIZE) {
+        prln_error("gzipped DTB still too large (0x%lx)", size_gzipped);
+        free(buffer);
+        return 1;
+    }
+    memcpy(dtb, buffer, size_gzipped);
+    free(buffer);
+    *size = size_gzipped;
+    return 0;
+}
+
+static inline
+int
+dtb_buffer_entry_collect_strings(
+    struct dtb_buffer_entry * const entry,
+    struct arena * const            arena,
+    size_t * const                  saved
+){
+    struct dtb_header *const dh = (struct dtb_header *)entry->buffer;
+    struct dtb_header const dh_host = dtb_header_swapbytes(dh);
+    struct stringblock_helper shelper;
+    dtb_complete_stringblock_helper(entry->buffer, &shelper);
+    if (dts_collect_strings(entry->buffer + dh_host.off_dt_struct, dh_host.size_dt_struct, &shelper, arena, saved)) {
+        return 1;
+    }
+    if (!*saved) {
+        return 0;
+    }
+    size_t const size_new = util_nearest_upper_bound_ulong(dh_host.off_dt_strings + shelper.length, 4);
+    memset(entry->buffer + dh_host.off_dt_strings + shelper.length, 0, size_new - dh_host.off_dt_strings - shelper.length);
+    dh->size_dt_strings = bswap_32(shelper.length);
+    dh->totalsize = bswap_32(size_new);
+    entry->size = size_new;
+    entry->fingerprint_blob = util_hash64(UTIL_HASH64_INITIAL, entry->buffer, size_new);
+    return 0;
+}
+
+/*
+ Combine the entries into a multi-DTB, and gzip it into dtb if it does not fit
+ as is, with the entries packed tightly if not even the gzipped one fits
+*/
+static inline
+int
+dtb_pack_multi(
+    uint8_t * const                         dtb,
+    size_t * const                          size,
+    struct dtb_buffer_helper const * const  bhelper
+){
+    size_t const alignments[] = {DTB_PAGE_SIZE, DTB_TIGHT_ALIGNMENT};
+    unsigned const alignments_count = cli_options.tight_pack ? 2 : 1;
+    size_t size_combined;
+    uint8_t *combined;
+    int r = dtb_combine_multi_dtb(dtb, DTB_PARTITION_DATA_SIZE, size, bhelper, DTB_PAGE_SIZE);
+    if (r != 1) {
+        return r ? -1 : 0;
+    }
+    prln_error("DTB size too large (0x%lx), trying to gzip it", *size);
+    size_combined = *size;
+    for (unsigned i = 0; i < alignments_count; ++i) {
+        if (i) {
+            prln_warn("packing DTBs in multi-DTB with %lu-byte alignment instead of %u-byte pages and trying again, u-boot might refuse to load it", alignments[i], DTB_PAGE_SIZE);
+            if (dtb_combine_multi_dtb(dtb, 0, &size_combined, bhelper, alignments[i]) != 1) { // Only to get the size
+                prln_error("failed to compose multi-DTB");
+                return -1;
+            }
+        }
+        if (!(combined = arena_alloc(bhelper->arena, size_combined)) || dtb_combine_multi_dtb(combined, size_combined, &size_combined, bhelper, alignments[i])) {
+            prln_error("failed to compose multi-DTB");
+            return -1;
+        }
+        if ((r = dtb_compress(dtb, size, combined, size_combined)) <= 0) {
+            return r;
+        }
+    }
+    if (!cli_options.tight_pack) {
+        prln_error("multi-DTB does not fit even gzipped, --tight-pack could pack it tighter, but u-boot might refuse to load that");
+    }
+    return r;
+}
+
+/*
+ Put the entries of bhelper together right into the data of part, combining them
+ into a multi-DTB and gzipping it if needed, so the DTB is only written once to
+ where it is written to disk from. bhelper must be from an arena, entries owning
+ their buffers have unreferenced strings dropped first. The rest of the data is
+ zeroed, the trailer is left for dtb_finish_partition()
+*/
+int
+dtb_pack(
+    struct dtb_partition * const        part,
+    size_t * const                      size,
+    struct dtb_buffer_helper * const    bhelper
+){
+    if (!part || !size || !bhelper || !bhelper->arena || !bhelper->dtb_count || dtb_buffer_helper_not_all_have_buffer(bhelper)) {
+        return -1;
+    }
+    *size = 0;
+    /* Names of properties dropped with the old partitions node would otherwise pile up in every edit */
+    size_t saved, saved_all = 0;
+    for (unsigned i = 0; i < bhelper->dtb_count; ++i) {
+        if (bhelper->dtbs[i].borrowed) { // Reused as is
+            continue;
+        }
+        if (dtb_buffer_entry_collect_strings(bhelper->dtbs + i, bhelper->arena, &saved)) {
+            prln_warn("failed to collect unused strings in DTB %u of %u, keeping them", i + 1, bhelper->dtb_count);
+            continue;
+        }
+        saved_all += saved;
+    }
+    if (saved_all) {
+        prln_info("dropped 0x%lx bytes of strings no property refers to anymore", saved_all);
+    }
+    struct dtb_buffer_entry *const entry = bhelper->dtbs;
+    int r;
+    if (bhelper->dtb_count > 1) {
+        r = dtb_pack_multi(part->data, size, bhelper);
+    } else if (entry->size <= DTB_PARTITION_DATA_SIZE) {
+        memcpy(part->data, entry->buffer, entry->size);
+        *size = entry->size;
+        r = 0;
+    } else {
+        prln_error("DTB size too large (0x%lx), trying to gzip it", entry->size);
+        r = dtb_compress(part->data, size, entry->buffer, entry->size);
     }
-    free(sizes);
-    free(offsets);
+    if (r) {
+        return r > 0 ? 3 : 2;
+    }
+    memset(part->data + *size, 0, DTB_PARTITION_DATA_SIZE - *size);
     return 0;
 }
 
+/* All temporaries of composing come from one arena, released at once when done */
 int
 dtb_compose(
-    uint8_t * * const dtb,
-    size_t *size,
-    struct dtb_buffer_helper const * const bhelper,
+    struct dtb_partition * const                        part,
+    size_t * const                                      size,
+    struct dtb_buffer_helper const * const              bhelper,
     struct dts_partitions_helper_simple const * const   phelper
 ){
-    if (!dtb || !bhelper || !bhelper->dtb_count || dtb_buffer_helper_not_all_have_buffer(bhelper)) {
+    if (!part || !size || !bhelper || !bhelper->dtb_count || dtb_buffer_helper_not_all_have_buffer(bhelper)) {
         return -1;
     }
-    *dtb = NULL;
     *size = 0;
+    struct arena arena;
+    arena_init(&arena);
     struct dtb_buffer_helper bhelper_new;
+    int r = 0;
     if (phelper && phelper->partitions_count) {
-        if (dtb_buffer_helper_implement_partitions(&bhelper_new, bhelper, phelper)) {
+        if (dtb_buffer_helper_implement_partitions(&bhelper_new, bhelper, phelper, &arena)) {
             prln_error("failed to implement partitions into DTB");
-            return 1;
+            r = 1;
         }
     } else {
-        if (dtb_buffer_helper_remove_partitions(&bhelper_new, bhelper)) {
+        if (dtb_buffer_helper_remove_partitions(&bhelper_new, bhelper, &arena)) {
             prln_error("failed to remove partitions from DTB");
-            return 1;
+            r = 1;
+        }
+    }
+    if (!r && dtb_pack(part, size, &bhelper_new)) {
+        prln_error("failed to pack new DTB");
+        r = 3;
+    }
+    arena_free(&arena);
+    return r;
+}
+
+/*
+ Make the len_old bytes at offset at in the structure block take len_new bytes
+ instead, only the tail after them is moved, the buffer must have room for it
+*/
+static inline
+void
+dtb_buffer_entry_resize_struct(
+    struct dtb_buffer_entry * const entry,
+    uint32_t const                  at,
+    uint32_t const                  len_old,
+    uint32_t const                  len_new
+){
+    struct dtb_header *const dh = (struct dtb_header *)entry->buffer;
+    uint8_t *const start = entry->buffer + bswap_32(dh->off_dt_struct) + at;
+    memmove(start + len_new, start + len_old, entry->buffer + entry->size - start - len_old);
+    uint32_t const delta = len_new - len_old; // Wraps around for shrinking, which is fine for unsigned
+    dh->size_dt_struct = bswap_32(bswap_32(dh->size_dt_struct) + delta);
+    dh->off_dt_strings = bswap_32(bswap_32(dh->off_dt_strings) + delta);
+    dh->totalsize = bswap_32(bswap_32(dh->totalsize) + delta);
+    entry->size += (int32_t)delta;
+}
+
+static inline
+void
+dtb_buffer_entry_append_string(
+    struct dtb_buffer_entry * const entry,
+    char const * const              string
+){
+    struct dtb_header *const dh = (struct dtb_header *)entry->buffer;
+    struct dtb_header const dh_host = dtb_header_swapbytes(dh);
+    size_t const len = strlen(string) + 1;
+    uint32_t const end = dh_host.off_dt_strings + dh_host.size_dt_strings + len;
+    memcpy(entry->buffer + dh_host.off_dt_strings + dh_host.size_dt_strings, string, len);
+    dh->size_dt_strings = bswap_32(dh_host.size_dt_strings + len);
+    if (end > entry->size) {
+        entry->size = util_nearest_upper_bound_ulong(end, 4);
+        memset(entry->buffer + end, 0, entry->size - end);
+        dh->totalsize = bswap_32(entry->size);
+    }
+}
+
+/* Returns 0 if the property is set or deleted, or there is nothing to do, check changed for that */
+static inline
+int
+dtb_buffer_entry_edit_property(
+    struct dtb_buffer_entry * const         entry,
+    struct dts_property_edit const * const  edit,
+    bool * const                            changed
+){
+    struct dtb_header const dh = dtb_header_swapbytes((struct dtb_header const *)entry->buffer);
+    uint8_t *const dts = entry->buffer + dh.off_dt_struct;
+    struct dts_node_index nindex;
+    if (dts_node_index_build(&nindex, dts, dh.size_dt_struct, NULL)) {
+        prln_error("failed to index nodes");
+        return 1;
+    }
+    int64_t const node = dts_node_index_find(&nindex, dts, edit->path, edit->len_path);
+    if (node < 0) {
+        dts_node_index_free(&nindex);
+        if (!edit->value) {
+            prln_warn("node %.*s does not exist, no property %s to delete", (int)edit->len_path, edit->path, edit->name);
+            return 0;
+        }
+        prln_error("node %.*s does not exist, can't set property %s in it", (int)edit->len_path, edit->path, edit->name);
+        return 2;
+    }
+    struct dts_node_index_entry const nentry = nindex.entries[node];
+    dts_node_index_free(&nindex);
+    struct stringblock_helper shelper;
+    dtb_complete_stringblock_helper(entry->buffer, &shelper);
+    uint32_t offset = 0, at = nentry.props, len_old = 0;
+    char const *name;
+    uint8_t const *value;
+    bool found = false;
+    while (!dts_node_next_property(dts, &nentry, &shelper, &offset, &name, &value, &len_old)) {
+        if (!strcmp(name, edit->name)) {
+            found = true;
+            at = value - dts - 12;
+            break;
+        }
+        at = offset; // New properties go after the last one
+    }
+    if (!found) {
+        if (!edit->value) {
+            prln_warn("property %s does not exist in node %.*s, nothing to delete", edit->name, (int)edit->len_path, edit->path);
+            return 0;
         }
+        len_old = 0;
+    } else if (edit->value && len_old == edit->len && !memcmp(value, edit->value, len_old)) {
+        return 0;
     }
-    if (!bhelper_new.dtb_count) {
-        prln_error("new DTB count 0, which is impossible, refuse to work");
-        dtb_free_buffer_helper(&bhelper_new);
+    uint32_t const size_old = found ? 12 + util_nearest_upper_bound_ulong(len_old, 4) : 0;
+    uint32_t const size_new = edit->value ? 12 + util_nearest_upper_bound_ulong(edit->len, 4) : 0;
+    off_t name_off;
+    bool append_name = false;
+    if (found) {
+        name_off = bswap_32(*(uint32_t *)(dts + at + 8));
+    } else if ((name_off = stringblock_find_string(&shelper, edit->name)) < 0) {
+        name_off = shelper.length;
+        append_name = true;
+    }
+    if (size_old != size_new) {
+        dtb_buffer_entry_resize_struct(entry, at, size_old, size_new);
+    }
+    if (edit->value) {
+        uint8_t *const prop = dts + at;
+        *(uint32_t *)prop = DTS_PROP_ACTUAL;
+        *(uint32_t *)(prop + 4) = bswap_32(edit->len);
+        *(uint32_t *)(prop + 8) = bswap_32(name_off);
+        memcpy(prop + 12, edit->value, edit->len);
+        memset(prop + 12 + edit->len, 0, size_new - 12 - edit->len);
+    }
+    if (append_name) {
+        dtb_buffer_entry_append_string(entry, edit->name);
+    }
+    *changed = true;
+    return 0;
+}
+
+/* 
+ Values of the same length are patched in place, otherwise only the tail of the
+ structure block is moved, and new names are appended to the strings block
+*/
+static inline
+int
+dtb_buffer_entry_edit_properties(
+    struct dtb_buffer_entry * const         new,
+    struct dtb_buffer_entry const * const   old,
+    struct dts_property_edit const * const  edits,
+    int const                               count,
+    struct arena * const                    arena,
+    bool * const                            changed
+){
+    struct dtb_header const dh = dtb_header_swapbytes((struct dtb_header const *)old->buffer);
+    if (dh.off_mem_rsvmap > dh.off_dt_struct || dh.off_dt_struct + dh.size_dt_struct > dh.off_dt_strings) {
+        prln_error("blocks not in the order of memory reservation, structure and strings, refuse to edit");
+        return 1;
+    }
+    size_t size_max = old->size;
+    for (int i = 0; i < count; ++i) {
+        if (edits[i].value) {
+            size_max += 12 + util_nearest_upper_bound_ulong(edits[i].len, 4) + strlen(edits[i].name) + 4;
+        }
+    }
+    *new = *old;
+    if (!(new->buffer = arena_alloc(arena, size_max))) {
+        prln_error_with_errno("failed to allocate memory for edited DTB");
         return 2;
     }
-    if (bhelper_new.dtb_count == 1) {
-        if (!(*dtb = malloc(bhelper_new.dtbs->size * sizeof **dtb))) {
-            prln_error("failed to duplicate plain DTB");
-            dtb_free_buffer_helper(&bhelper_new);
+    memcpy(new->buffer, old->buffer, old->size);
+    new->borrowed = false;
+    new->phelper.node = NULL; // Partitions are as read, but the node is not in the old buffer anymore
+    *changed = false;
+    for (int i = 0; i < count; ++i) {
+        if (dtb_buffer_entry_edit_property(new, edits + i, changed)) {
+            prln_error("failed to apply edit %d", i + 1);
             return 3;
         }
-        memcpy(*dtb, bhelper_new.dtbs->buffer, bhelper_new.dtbs->size);
-        *size = bhelper_new.dtbs->size;
-    } else {
-        if (dtb_combine_multi_dtb(dtb, size, &bhelper_new)) {
-            prln_error("failed to compose multi-DTB");
-            dtb_free_buffer_helper(&bhelper_new);
+    }
+    if (!*changed) {
+        *new = *old;
+        new->borrowed = true;
+        return 0;
+    }
+    new->fingerprint_blob = util_hash64(UTIL_HASH64_INITIAL, new->buffer, new->size);
+    if (cli_options.verify != CLI_VERIFY_NONE) {
+        struct dts_node_index nindex;
+        struct dtb_header const dh_new = dtb_header_swapbytes((struct dtb_header const *)new->buffer);
+        if (dts_node_index_build(&nindex, new->buffer + dh_new.off_dt_struct, dh_new.size_dt_struct, NULL)) {
+            prln_error("edited DTB is broken");
             return 4;
         }
+        dts_node_index_free(&nindex);
     }
-    if (*size > DTB_PARTITION_DATA_SIZE) {
-        prln_error("DTB size too large (0x%lx), trying to gzip it", *size);
-        uint8_t *buffer;
-        if (!(*size = gzip_zip(*dtb, *size, &buffer))) {
-            prln_error("failed to compose gzipped multi-DTB");
-            free(*dtb);
-            dtb_free_buffer_helper(&bhelper_new);
-            return 6;
+    return 0;
+}
+
+/*
+ Apply the property edits to every DTB, entries not changed by any edit still
+ borrow the buffers of the old ones, changed ones get theirs from arena
+*/
+int
+dtb_edit_properties(
+    struct dtb_buffer_helper * const        new,
+    struct dtb_buffer_helper const * const  old,
+    struct dts_property_edit const * const  edits,
+    int const                               count,
+    struct arena * const                    arena,
+    unsigned * const                        changed
+){
+    if (!new || !old || !old->dtb_count || dtb_buffer_helper_not_all_have_buffer(old) || !edits || count <= 0 || !arena || !changed) {
+        prln_error("invalid arguments");
+        return -1;
+    }
+    if (dtb_buffer_helper_init_like(new, old, arena)) {
+        return 1;
+    }
+    *changed = 0;
+    bool changed_entry;
+    for (unsigned i = 0; i < new->dtb_count; ++i) {
+        if (dtb_buffer_entry_edit_properties(new->dtbs + i, old->dtbs + i, edits, count, arena, &changed_entry)) {
+            prln_error("failed to edit properties in DTB %u of %u", i + 1, new->dtb_count);
+            return 2;
         }
-        if (*size > DTB_PARTITION_DATA_SIZE) {
-            prln_error("gzipped DTB still too large (0x%lx), giving up", *size);
-            free(buffer);
-            free(*dtb);
-            dtb_free_buffer_helper(&bhelper_new);
-            return 6;
+        if (changed_entry) {
+            ++*changed;
         }
-        free(*dtb);
-        *dtb = buffer;
     }
-    dtb_free_buffer_helper(&bhelper_new);
     return 0;
 }
 
@@ -1171,34 +2308,17 @@ dtb_finish_partition(
 ){
     part->magic = DTB_PARTITION_MAGIC;
     part->version = DTB_PARTITION_VERSION;
-    part->timestamp = time(NULL);
+    part->timestamp = dtb_get_timestamp();
     dtb_checksum_partition(part);
 }
 
-int
-dtb_as_partition(
-    uint8_t * * const   dtb,
-    size_t * const      size
-){
-    if (!dtb || !*dtb || !size || !*size) {
-        prln_error("illegal arguments");
-        return -1;
-    }
-    if (*size > DTB_PARTITION_DATA_SIZE) {
-        prln_error("data too large");
-        return 1;
-    }
-    struct dtb_partition *part = malloc(2 * sizeof *part);
-    if (!part) {
-        prln_error("failed to allocate memory for DTB partition");
-        return 2;
+/* Page-aligned, so it could be written out as is */
+struct dtb_partition *
+dtb_alloc_partition(){
+    void *part;
+    if ((errno = posix_memalign(&part, DTB_PARTITION_ALIGNMENT, sizeof(struct dtb_partition)))) {
+        prln_error_with_errno("failed to allocate memory for DTB partition");
+        return NULL;
     }
-    memcpy(part, *dtb, *size);
-    memset((uint8_t *)part + *size, 0, sizeof *part - *size);
-    dtb_finish_partition(part);
-    memcpy(part + 1, part, sizeof *part);
-    free(*dtb);
-    *dtb = (uint8_t *)part;
-    *size = 2 * sizeof *part;
-    return 0;
+    return part;
 }
\ No newline at end of file
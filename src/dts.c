@@ -5,6 +5,7 @@
 /* System */
 
 #include <byteswap.h>
+#include <ctype.h>
 #include <string.h>
 
 /* Local */
@@ -19,6 +20,10 @@
 #define DTS_BE_4                            0x04000000U
 #define DTS_BE_8                            0x08000000U
 #define DTS_PARTITIONS_NODE_START_LENGTH    12U
+#define DTS_PHANDLE_MAP_INITIAL             64U  // Must be power of 2
+#define DTS_PHANDLE_BITMAP_SLACK            (MAX_PARTITIONS_COUNT + 1U) // Partitions and their root node
+#define DTS_NODE_INDEX_INITIAL              256U
+#define DTS_DIFF_PATH_MAXIMUM               0x1000U
 
 /* Enumerable */
 
@@ -41,12 +46,6 @@ struct
         uint32_t    phandle_be32;
     };
 
-struct 
-    dts_property {
-        uint32_t        len;
-        uint8_t const * value;
-    };
-
 struct 
     dts_stringblock_essential_offsets {
         off_t parts;
@@ -57,858 +56,1153 @@ struct
         off_t linux_phandle;
     };
 
+struct
+    dts_scan_context {
+        struct dts_scan_helper *                    scan;
+        struct stringblock_helper const *           shelper;
+        struct dts_stringblock_essential_offsets    offsets;
+        struct dts_partition_entry *                partition;
+        off_t                                       offset_target;
+        bool                                        in_partitions;
+        bool                                        partitions_invalid;
+    };
+
+struct
+    dts_diff_frame {
+        uint32_t    node_a;
+        uint32_t    node_b;
+        uint32_t    child_a;    // Next child of node_a to compare
+        size_t      len_path;   // Of the path of this node
+    };
+
+struct
+    dts_collect_strings_context {
+        uint8_t *       dts;
+        uint32_t        length;     // Of the stringblock
+        uint8_t *       used;       // Offsets of property names, or NULL when remapping
+        uint32_t const *remap;
+    };
+
+struct
+    dts_node_index_context {
+        struct dts_node_index *             nindex;
+        uint8_t const *                     dts;
+        struct stringblock_helper const *   shelper;
+        uint32_t                            stack[DTS_WALK_DEPTH_MAXIMUM];  // Index of the node opened at each depth
+        uint64_t                            hashes[DTS_WALK_DEPTH_MAXIMUM]; // Subtree hash of the node opened at each depth, so far
+    };
+
 /* Variable */
 
-struct dts_property dts_property = {0};
 uint8_t const       dts_partitions_node_start[DTS_PARTITIONS_NODE_START_LENGTH] = "partitions";
 struct dts_partitions_helper_simple const 
                     dts_partitions_helper_simple_empty = {.partitions_count = 0};
 
 /* Function */
 
-static inline
-uint32_t
-dts_report_offset(
-    uint32_t const          i,
-    uint32_t const * const  start,
-    uint8_t const * const   node
+int
+dts_walk(
+    uint8_t const * const           dts,
+    uint32_t const                  max_offset,
+    struct dts_walker const * const walker,
+    void * const                    context
 ){
-    return (i + start - (const uint32_t *)node);
+    if (!dts || !walker || max_offset % 4) {
+        prln_error("illegal arguments");
+        return -1;
+    }
+    uint32_t const *const start = (uint32_t const *)dts;
+    uint32_t const count = max_offset / 4;
+    uint8_t const *nodes[DTS_WALK_DEPTH_MAXIMUM];
+    uint32_t depth = 0;
+    uint32_t len_name, len_prop;
+    int r;
+    for (uint32_t i = 0; i < count; ++i) {
+        switch (start[i]) {
+            case DTS_BEGIN_NODE_ACTUAL:
+                if (depth >= DTS_WALK_DEPTH_MAXIMUM) {
+                    prln_error("nodes nested deeper than %u levels", DTS_WALK_DEPTH_MAXIMUM);
+                    return 1;
+                }
+                nodes[depth] = (uint8_t const *)(start + i + 1);
+                len_name = strnlen((char const *)nodes[depth], 4 * (count - i - 1)) + 1;
+                if (len_name > 4 * (count - i - 1)) {
+                    prln_error("node name at offset 0x%x not terminated", 4 * (i + 1));
+                    return 2;
+                }
+                if (walker->begin_node && (r = walker->begin_node(context, nodes[depth], depth))) {
+                    return r;
+                }
+                ++depth;
+                i += (len_name + 3) / 4;
+                break;
+            case DTS_END_NODE_ACTUAL:
+                if (!depth) {
+                    prln_error("END_NODE at offset 0x%x without corresponding BEGIN_NODE", 4 * i);
+                    return 3;
+                }
+                --depth;
+                if (walker->end_node && (r = walker->end_node(context, nodes[depth], (uint8_t const *)(start + i), depth))) {
+                    return r;
+                }
+                break;
+            case DTS_PROP_ACTUAL:
+                if (!depth || i + 3 > count) {
+                    prln_error("property at offset 0x%x outside of node or truncated", 4 * i);
+                    return 4;
+                }
+                len_prop = bswap_32(start[i + 1]);
+                if (len_prop > 4 * (count - i - 3)) {
+                    prln_error("property at offset 0x%x overflows the structure block", 4 * i);
+                    return 5;
+                }
+                if (walker->prop && (r = walker->prop(context, nodes[depth - 1], bswap_32(start[i + 2]), len_prop, (uint8_t const *)(start + i + 3), depth - 1))) {
+                    return r;
+                }
+                i += 2 + (len_prop + 3) / 4;
+                break;
+            case DTS_NOP_ACTUAL:
+                break;
+            case DTS_END_ACTUAL:
+                if (depth) {
+                    prln_error("structure block ends with %u node(s) not closed", depth);
+                    return 6;
+                }
+                return 0;
+            default:
+                prln_error("invalid token 0x%08x at offset 0x%x", bswap_32(start[i]), 4 * i);
+                return 7;
+        }
+    }
+    if (depth) {
+        prln_error("structure block ends with %u node(s) not closed", depth);
+        return 6;
+    }
+    return 0;
 }
 
 static inline
-uint32_t
-dts_get_prop_length(
-    uint32_t const * const  current
+off_t 
+dts_stringblock_essential_offset_get(
+    struct stringblock_helper const * const shelper,
+    char const * const                      name,
+    uint32_t * const                        invalids
 ){
-    return bswap_32(*(current+1));
+    const off_t offset = stringblock_find_string(shelper, name);
+    if (offset < 0) {
+        ++(*invalids);
+        prln_error("can not find %s in stringblock", name);
+    }
+    return offset;
 }
 
 static inline
+int
+dts_get_partitions_get_essential_offsets(
+    struct dts_stringblock_essential_offsets * const    offsets,
+    struct stringblock_helper const * const             shelper
+){
+    uint32_t offset_invalids = 0;
+    uint32_t optional_invalids = 0;
+    offsets->parts = dts_stringblock_essential_offset_get(shelper, "parts", &offset_invalids);
+    offsets->pname = dts_stringblock_essential_offset_get(shelper, "pname", &offset_invalids);
+    offsets->size = dts_stringblock_essential_offset_get(shelper, "size", &offset_invalids);
+    offsets->mask = dts_stringblock_essential_offset_get(shelper, "mask", &offset_invalids);
+    offsets->phandle = dts_stringblock_essential_offset_get(shelper, "phandle", &offset_invalids);
+    offsets->linux_phandle = dts_stringblock_essential_offset_get(shelper, "linux,phandle", &optional_invalids);
+    return offset_invalids;
+}
+
+int
+dts_sort_partitions(
+    struct dts_partitions_helper * const    phelper
+){
+    if (!phelper) {
+        prln_error("no partitions helper to sort");
+        return 1;
+    }
+    if (phelper->record_count > MAX_PARTITIONS_COUNT) {
+        prln_error("Too many partitions");
+        return 2;
+    }
+    uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
+    if (pcount != phelper->record_count) {
+        prln_error("partitions node count (%"PRIu32") != record count (%"PRIu32")", phelper->partitions_count, phelper->record_count);
+        return 3;
+    }
+    struct dts_partition_entry buffer;
+    for (uint32_t i = 0; i < pcount; ++i) {
+        if (phelper->phandles[i] != phelper->partitions[i].phandle) {
+            for (uint32_t j = i + 1; j < pcount; ++j) {
+                if (phelper->partitions[j].phandle == phelper->phandles[i]) {
+                    buffer = phelper->partitions[i];
+                    phelper->partitions[i] = phelper->partitions[j];
+                    phelper->partitions[j] = buffer;
+                    break;
+                }
+            }
+        }
+    }
+    prln_info("partitions now in part-num order defined in partitions node's properties");
+    return 0;
+}
+
 void
-dts_skip_prop_with_length(
-    uint32_t * const    i,
-    uint32_t const      length
+dts_report_partitions(
+    struct dts_partitions_helper const * const  phelper
 ){
-    *i += 2 + length / 4;
-    if (length % 4) {
-        *i += 1;
+    uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
+    prln_info("%u partitions in the DTB:\n=======================================================\nID| name            |            size|(   human)| masks\n-------------------------------------------------------", pcount);
+    const struct dts_partition_entry *part;
+    double num_size;
+    char suffix_size;
+    for (uint32_t i=0; i < pcount; ++i) {
+        part = phelper->partitions + i;
+        if (part->size == (uint64_t)-1) {
+            fprintf(stderr, "%2d: %-16s                  (AUTOFILL) %6"PRIu32"\n", i, part->name, part->mask);
+        } else {
+            num_size = util_size_to_human_readable(part->size, &suffix_size);
+            fprintf(stderr, "%2d: %-16s %16"PRIx64" (%7.2lf%c) %6"PRIu32"\n", i, part->name, part->size, num_size, suffix_size, part->mask);
+        }
     }
+    fprintf(stderr, "=======================================================\n");
+    return;
 }
 
-static inline
+
 void
-dts_skip_prop_without_length(
-    uint32_t * const        i,
-    uint32_t const * const  current
+dts_report_partitions_simple(
+    struct dts_partitions_helper_simple const * phelper
 ){
-    uint32_t len_prop = dts_get_prop_length(current);
-    dts_skip_prop_with_length(i, len_prop);
+    uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
+    prln_info("DTS report partitions: %u partitions in the DTB:\n=======================================================\nID| name            |            size|(   human)| masks\n-------------------------------------------------------", pcount);
+    const struct dts_partition_entry_simple *part;
+    double num_size;
+    char suffix_size;
+    for (uint32_t i=0; i < pcount; ++i) {
+        part = phelper->partitions + i;
+        if (part->size == (uint64_t)-1) {
+            fprintf(stderr, "%2d: %-16s                  (AUTOFILL) %6"PRIu32"\n", i, part->name, part->mask);
+        } else {
+            num_size = util_size_to_human_readable(part->size, &suffix_size);
+            fprintf(stderr, "%2d: %-16s %16"PRIx64" (%7.2lf%c) %6"PRIu32"\n", i, part->name, part->size, num_size, suffix_size, part->mask);
+        }
+    }
+    fprintf(stderr, "=======================================================\n");
+    return;
 }
 
 static inline
-size_t
-dts_get_len_name(
-    uint8_t const * const   node
+uint32_t
+dts_phandle_map_slot(
+    uint32_t const  phandle,
+    uint32_t const  allocated
 ){
-    return strlen((char const*)node) + 1;
+    return (phandle * 0x9E3779B1U) & (allocated - 1); // allocated is always power of 2
 }
 
 static inline
-uint32_t const *
-dts_get_start_with_len_name(
-    uint8_t const * const   node,
-    size_t const            len_name
-) {
-    return (uint32_t *)node + len_name / 4 + (bool)(len_name % 4);
+struct dts_phandle_entry *
+dts_phandle_map_find(
+    struct dts_phandle_list const * const   plist,
+    uint32_t const                          phandle
+){
+    struct dts_phandle_entry *entry;
+    for (uint32_t i = dts_phandle_map_slot(phandle, plist->allocated); ; i = (i + 1) & (plist->allocated - 1)) {
+        entry = plist->entries + i;
+        if (!entry->phandle || entry->phandle == phandle) {
+            return entry;
+        }
+    }
+}
+
+int
+dts_phandle_list_realloc(
+    struct dts_phandle_list * const plist
+){
+    if (!plist || !plist->entries || !plist->allocated) {
+        return -1;
+    }
+    struct dts_phandle_entry *const entries_old = plist->entries;
+    uint32_t const allocated_old = plist->allocated;
+    if (!(plist->entries = plist->arena ? arena_alloc(plist->arena, allocated_old * 2 * sizeof *plist->entries) : malloc(allocated_old * 2 * sizeof *plist->entries))) {
+        prln_error_with_errno("failed to re-allocate memory");
+        plist->entries = entries_old;
+        return 1;
+    }
+    memset(plist->entries, 0, allocated_old * 2 * sizeof *plist->entries);
+    plist->allocated = allocated_old * 2;
+    for (uint32_t i = 0; i < allocated_old; ++i) {
+        if (entries_old[i].phandle) {
+            *dts_phandle_map_find(plist, entries_old[i].phandle) = entries_old[i];
+        }
+    }
+    if (!plist->arena) {
+        free(entries_old);
+    }
+    return 0;
+}
+
+int
+dts_phandle_list_add(
+    struct dts_phandle_list * const plist,
+    uint32_t const                  phandle,
+    uint8_t const * const           node,
+    uint8_t const                   status
+){
+    if (!phandle) {
+        prln_error("node %p has phandle 0, this is impossible", node);
+        return 1;
+    }
+    if ((plist->count + 1) * 4 > plist->allocated * 3 && dts_phandle_list_realloc(plist)) {
+        prln_error("failed to re-allocate memory");
+        return 2;
+    }
+    struct dts_phandle_entry * const entry = dts_phandle_map_find(plist, phandle);
+    if (entry->phandle) {
+        if (entry->node != node) {
+            prln_error("phandle %"PRIu32" already encountered before, but previous node (%p) != current node (%p)", phandle, entry->node, node);
+            return 3;
+        }
+    } else {
+        entry->phandle = phandle;
+        entry->node = (uint8_t *)node;
+        ++plist->count;
+        if (!plist->min || phandle < plist->min) {
+            plist->min = phandle;
+        }
+        if (phandle > plist->max) {
+            plist->max = phandle;
+        }
+    }
+    entry->status |= status;
+    plist->status |= status;
+    return 0;
 }
 
 static inline
-uint32_t const *
-dts_get_start_without_len_name(
-    uint8_t const * const   node
+int
+dts_phandle_bitmap_resize(
+    struct dts_phandle_list * const plist,
+    uint32_t const                  words
+){
+    uint64_t *bitmap;
+    if (plist->arena) {
+        if ((bitmap = arena_alloc(plist->arena, words * sizeof *bitmap)) && plist->bitmap_words) {
+            memcpy(bitmap, plist->bitmap, plist->bitmap_words * sizeof *bitmap);
+        }
+    } else {
+        bitmap = realloc(plist->bitmap, words * sizeof *bitmap);
+    }
+    if (!bitmap) {
+        prln_error_with_errno("failed to allocate memory for phandle bitmap");
+        return 1;
+    }
+    memset(bitmap + plist->bitmap_words, 0, (words - plist->bitmap_words) * sizeof *bitmap);
+    uint32_t const bits_old = plist->bitmap_words * 64;
+    uint32_t const bits = words * 64;
+    if (!plist->bitmap_words) {
+        bitmap[0] = 1; // phandle 0 is never available
+    }
+    for (uint32_t i = 0; i < plist->allocated; ++i) {
+        uint32_t const phandle = plist->entries[i].phandle;
+        if (phandle >= bits_old && phandle < bits && plist->entries[i].node) {
+            bitmap[phandle / 64] |= 1ULL << (phandle % 64);
+        }
+    }
+    plist->bitmap = bitmap;
+    plist->bitmap_words = words;
+    return 0;
+}
+
+int
+dts_phandle_list_finish(
+    struct dts_phandle_list * const plist
+){
+    if (plist->status == DTS_NO_PHANDLE) {
+        prln_error("no phandle nor linux,phandle marked for whole DTS, which is impossible");
+        return 1;
+    }
+    if (!plist->max) {
+        prln_error("did not find max phandle, which is impossible");
+        return 2;
+    }
+    if (!plist->min) {
+        prln_error("did not find min phanle, which is impossible");
+        return 3;
+    }
+    /*
+     With count phandles in use the lowest free ones are all below count + slack,
+     so the bitmap only covers that range and higher phandles stay in the map only
+    */
+    if (dts_phandle_bitmap_resize(plist, (plist->count + DTS_PHANDLE_BITMAP_SLACK) / 64 + 1)) {
+        return 4;
+    }
+    return 0;
+}
+
+void
+dts_phandle_list_free(
+    struct dts_phandle_list * const plist
 ){
-    size_t const len_name = dts_get_len_name(node);
-    return (uint32_t *)node + len_name / 4 + (bool)(len_name % 4);
+    if (!plist) {
+        return;
+    }
+    if (!plist->arena) {
+        free(plist->entries);
+        free(plist->bitmap);
+    }
+    memset(plist, 0, sizeof *plist);
 }
 
 static inline
-uint32_t
-dts_get_count(
-    uint32_t const max_offset
+void
+dts_scan_invalidate_partitions(
+    struct dts_scan_context * const context
 ){
-    return max_offset / 4;
+    context->partitions_invalid = true;
+    context->partition = NULL;
 }
 
-/**
- * @brief Skip the node and return the steps needed to skip the node
- * 
- * @param node 
- * @param max_offset 
- * @return uint32_t The length of the node, excluding the BEGIN_NODE and END_NODE token, measured in 4-byte steps
- */
 static inline
-uint32_t
-dts_skip_node(
+int
+dts_scan_begin_node(
+    void * const            context_void,
     uint8_t const * const   node,
-    uint32_t const          max_offset
+    uint32_t const          depth
 ){
-    uint32_t const count = dts_get_count(max_offset);
-    if (!count) {
+    struct dts_scan_context *const context = context_void;
+    struct dts_partitions_helper *const phelper = context->scan->phelper;
+    if (!phelper) {
         return 0;
     }
-    uint32_t const *const start = dts_get_start_without_len_name(node);
-    const uint32_t *current;
-    uint32_t offset_child;
-    for (uint32_t i = 0; i < count; ++i) {
-        current = start + i;
-        switch (*current) {
-            case DTS_BEGIN_NODE_ACTUAL:
-                offset_child = dts_skip_node((const uint8_t *)(current + 1), max_offset - 4*i);
-                if (offset_child) {
-                    i += offset_child + 1;
-                } else {
-                    prln_error("failed to recursively skip child node");
-                    return 0;
-                }
-                break;
-            case DTS_END_NODE_ACTUAL:
-                return dts_report_offset(i, start, node);
-            case DTS_PROP_ACTUAL:
-                dts_skip_prop_without_length(&i, current);
-                break;
-            case DTS_NOP_ACTUAL:
-                break;
-            default:
-                prln_error("invalid token %"PRIu32" (address %p)", bswap_32(*current), current);
-                return 0;
+    if (depth == 1 && !memcmp(node, dts_partitions_node_start, DTS_PARTITIONS_NODE_START_LENGTH)) {
+        if (phelper->node) {
+            prln_error("multiple partitions node under root node");
+            dts_scan_invalidate_partitions(context);
+            return 0;
+        }
+        memset(phelper, 0, sizeof *phelper);
+        phelper->node = (uint8_t *)node;
+        context->in_partitions = true;
+        if (dts_get_partitions_get_essential_offsets(&context->offsets, context->shelper)) {
+            prln_error("essential strings for partitions node missing in stringblock");
+            dts_scan_invalidate_partitions(context);
         }
+        return 0;
     }
-    prln_error("node not properly ended");
-    return 0;
-}
-
-uint32_t 
-dts_get_node(
-    uint8_t const * const   node, 
-    uint32_t const          max_offset,
-    char const * const      name,
-    uint32_t const          layers,
-    uint8_t const * * const target
-){
-    uint32_t const count = dts_get_count(max_offset);
-    if (!count) {
+    if (!context->in_partitions || context->partitions_invalid) {
         return 0;
     }
-    if (strcmp((const char *)node, name)) {
-        return dts_skip_node(node, max_offset);
+    if (depth > 2) {
+        prln_error("encountered sub node inside partition, which is impossible");
+        dts_scan_invalidate_partitions(context);
+        return 0;
     }
-    if (!layers) {
-        *target = node;
-        return dts_skip_node(node, max_offset);
+    if (phelper->partitions_count >= MAX_PARTITIONS_COUNT) {
+        prln_error("partitions count exceeds maximum");
+        dts_scan_invalidate_partitions(context);
+        return 0;
     }
-    size_t const len_name = dts_get_len_name(node);
-    uint32_t const *const start = dts_get_start_with_len_name(node, len_name);
-    uint32_t const *current;
-    uint32_t offset_child;
-    for (uint32_t i = 0; i < count; ++i) {
-        current = start + i;
-        switch (*current) {
-            case DTS_BEGIN_NODE_ACTUAL:
-                offset_child = dts_get_node((uint8_t const *)(current + 1), max_offset - 4*i, name + len_name, layers - 1, target);
-                if (offset_child) {
-                    i += offset_child + 1;
-                } else {
-                    prln_error("failed to travel through child node");
-                    return 0;
-                }
-                break;
-            case DTS_END_NODE_ACTUAL:
-                return dts_report_offset(i, start, node);
-            case DTS_PROP_ACTUAL:
-                dts_skip_prop_without_length(&i, current);
-                break;
-            case DTS_NOP_ACTUAL:
-                break;
-            default:
-                prln_error("invalid token %"PRIu32" (address %p)", bswap_32(*current), current);
-                return 0;
-        }
+    size_t const len_node_name = strlen((char const *)node);
+    if (len_node_name >= MAX_PARTITION_NAME_LENGTH) {
+        prln_error("partition name '%s' too long", (char const *)node);
+        dts_scan_invalidate_partitions(context);
+        return 0;
     }
-    prln_error("node not properly ended");
+    context->partition = phelper->partitions + phelper->partitions_count++;
+    memcpy(context->partition->name, node, len_node_name);
     return 0;
 }
 
 static inline
-int 
-dts_get_property_actual(
+int
+dts_scan_end_node(
+    void * const            context_void,
     uint8_t const * const   node,
-    uint32_t const          property_offset
+    uint8_t const * const   end,
+    uint32_t const          depth
 ){
-    uint32_t const *const start = dts_get_start_without_len_name(node);
-    uint32_t const *current;
-    uint32_t len_prop, name_off;
-    for (uint32_t i = 0; ; ++i) {
-        current = start + i;
-        switch (*current) {
-            case DTS_BEGIN_NODE_ACTUAL:
-                prln_error("child node starts, property not found, give up");
-                return 1;
-            case DTS_END_NODE_ACTUAL:
-                prln_error("node ends, give up");
-                return 1;
-            case DTS_PROP_ACTUAL:
-                len_prop = bswap_32(*(current+1));
-                name_off = bswap_32(*(current+2));
-                if (name_off == property_offset) {
-                    dts_property.len = len_prop;
-                    dts_property.value = (const uint8_t *)(current + 3);
-                    return 0;
-                }
-                dts_skip_prop_with_length(&i, len_prop);
-                break;
-            case DTS_NOP_ACTUAL:
-                break;
-            default:
-                prln_error("invalid token %"PRIu32"", bswap_32(*current));
-                return 1;
+    struct dts_scan_context *const context = context_void;
+    if (!context->in_partitions) {
+        return 0;
+    }
+    struct dts_partition_entry const *const partition = context->partition;
+    if (depth == 2) {
+        if (partition && partition->phandle && partition->linux_phandle && partition->phandle != partition->linux_phandle) {
+            prln_error("partition '%s' has different phandle (%"PRIu32") and linux,phandle (%"PRIu32")", partition->name, partition->phandle, partition->linux_phandle);
+            dts_scan_invalidate_partitions(context);
         }
+        context->partition = NULL;
+    } else if (depth == 1) {
+        struct dts_partitions_helper *const phelper = context->scan->phelper;
+        phelper->node_length = end + 4 - (node - 4); // Including both BEGIN_NODE and END_NODE token
+        context->in_partitions = false;
     }
-    prln_error("node not properly ended");
     return 0;
 }
 
-int 
-dts_get_property(
-    uint8_t const * const                   node,
-    struct stringblock_helper const * const shelper,
-    char const * const                      property
+static inline
+void
+dts_scan_prop_partitions_root(
+    struct dts_scan_context * const context,
+    uint32_t const                  name_off,
+    uint32_t const                  len_prop,
+    uint8_t const * const           value
 ){
-    off_t const property_offset = stringblock_find_string(shelper, property);
-    if (property_offset < 0) {
-        return 1;
+    struct dts_partitions_helper *const phelper = context->scan->phelper;
+    char const *const name = context->shelper->stringblock + name_off;
+    if (len_prop != 4) {
+        prln_error("%s property of partitions node is not of length 4", name);
+        dts_scan_invalidate_partitions(context);
+        return;
+    }
+    uint32_t const value_u32 = bswap_32(*(uint32_t const *)value);
+    if (name_off == context->offsets.parts) {
+        phelper->record_count = value_u32;
+    } else if (name_off == context->offsets.phandle) {
+        phelper->phandle_root = value_u32;
+    } else if (name_off == context->offsets.linux_phandle) {
+        phelper->linux_phandle_root = value_u32;
+    } else if (strncmp(name, "part-", 5)) {
+        prln_error("invalid propertey '%s' in partitions node", name);
+        dts_scan_invalidate_partitions(context);
+    } else {
+        unsigned long const phandle_id = strtoul(name + 5, NULL , 10);
+        if (phandle_id > MAX_PARTITIONS_COUNT - 1) {
+            prln_error("invalid part id %lu in partitions node", phandle_id);
+            dts_scan_invalidate_partitions(context);
+            return;
+        }
+        phelper->phandles[phandle_id] = value_u32;
+    }
+}
+
+static inline
+void
+dts_scan_prop_partitions_child(
+    struct dts_scan_context * const context,
+    uint32_t const                  name_off,
+    uint32_t const                  len_prop,
+    uint8_t const * const           value
+){
+    struct dts_partition_entry *const partition = context->partition;
+    if (name_off == context->offsets.pname) {
+        if (len_prop > MAX_PARTITION_NAME_LENGTH || strncmp(partition->name, (char const *)value, len_prop)) {
+            prln_error("pname property %.*s different from partition node name %s", (int)len_prop, (char const *)value, partition->name);
+            dts_scan_invalidate_partitions(context);
+        }
+    } else if (name_off == context->offsets.size) {
+        if (len_prop == 8) {
+            partition->size = ((uint64_t)bswap_32(*(uint32_t const *)value) << 32) | (uint64_t)bswap_32(*((uint32_t const *)value + 1));
+        } else {
+            prln_error("partition size is not of length 8");
+            dts_scan_invalidate_partitions(context);
+        }
+    } else if (name_off == context->offsets.mask || name_off == context->offsets.phandle || name_off == context->offsets.linux_phandle) {
+        if (len_prop != 4) {
+            prln_error("partition %s is not of length 4", context->shelper->stringblock + name_off);
+            dts_scan_invalidate_partitions(context);
+        } else if (name_off == context->offsets.mask) {
+            partition->mask = bswap_32(*(uint32_t const *)value);
+        } else if (name_off == context->offsets.phandle) {
+            partition->phandle = bswap_32(*(uint32_t const *)value);
+        } else {
+            partition->linux_phandle = bswap_32(*(uint32_t const *)value);
+        }
+    } else {
+        prln_error("invalid property for partition: %s", context->shelper->stringblock + name_off);
+        dts_scan_invalidate_partitions(context);
     }
-    return dts_get_property_actual(node, property_offset);
 }
 
 static inline
 int
-dts_get_node_from_path_sanity_check(
-    uint8_t const * const   dts,
-    uint32_t const          max_offset,
-    char const * const      path
+dts_scan_prop(
+    void * const            context_void,
+    uint8_t const * const   node,
+    uint32_t const          name_off,
+    uint32_t const          len_prop,
+    uint8_t const * const   value,
+    uint32_t const          depth
 ){
-    if (!dts) {
-        prln_error("no dtb to lookup");
-        return 1;
-    }
-    if (!max_offset) {
-        prln_error("max offset invalid");
-        return 1;
-    }
-    if (max_offset % 4) {
-        prln_error("offset is not multiply of 4");
+    struct dts_scan_context *const context = context_void;
+    struct dts_scan_helper *const scan = context->scan;
+    if (name_off >= context->shelper->length) {
+        prln_error("property name offset 0x%x overflows the stringblock", name_off);
         return 1;
     }
-    if (!path) {
-        prln_error("no path to lookup");
-        return 1;
+    if (scan->plist && (name_off == scan->offset_phandle || name_off == scan->offset_linux_phandle)) {
+        if (len_prop != 4) {
+            prln_error("phandle not of length 4");
+            return 2;
+        }
+        if (dts_phandle_list_add(scan->plist, bswap_32(*(uint32_t const *)value), node, name_off == scan->offset_phandle ? DTS_HAS_PHANDLE : DTS_HAS_LINUX_PHANDLE)) {
+            return 3;
+        }
     }
-    if (!path[0]) {
-        prln_error("empty path to lookup");
-        return 1;
+    if (!depth) {
+        if (name_off == context->offset_target) {
+            scan->target = value;
+            scan->len_target = len_prop;
+        }
+        return 0;
     }
-    if (path[0] != '/') {
-        prln_error("path does not start with /");
-        return 1;
+    if (context->in_partitions && !context->partitions_invalid) {
+        if (depth == 1) {
+            dts_scan_prop_partitions_root(context, name_off, len_prop, value);
+        } else if (context->partition) {
+            dts_scan_prop_partitions_child(context, name_off, len_prop, value);
+        }
     }
     return 0;
 }
 
-static inline
 int
-dts_get_path_layers(
-    char * const    path,
-    size_t const    len
-){
-    int layers = 0;
-    for (size_t i = 0; i<len; ++i) {
-        switch (path[i]) {
-            case '/':
-                path[i] = '\0';
-                ++layers;
-                break;
-            case '\0': // This should not happend
-                prln_error("path ends prematurely");
-                return -1;
+dts_scan(
+    struct dts_scan_helper * const          scan,
+    uint8_t const * const                   dts,
+    uint32_t const                          max_offset,
+    struct stringblock_helper const * const shelper
+){
+    if (!scan || !dts || !shelper) {
+        prln_error("illegal arguments");
+        return -1;
+    }
+    struct dts_scan_context context = {
+        .scan = scan,
+        .shelper = shelper,
+        .offset_target = stringblock_find_string(shelper, "amlogic-dt-id")
+    };
+    scan->target = NULL;
+    scan->len_target = 0;
+    scan->has_partitions = false;
+    scan->offset_phandle = stringblock_find_string(shelper, "phandle");
+    scan->offset_linux_phandle = stringblock_find_string(shelper, "linux,phandle");
+    if (scan->phelper) {
+        memset(scan->phelper, 0, sizeof *scan->phelper);
+    }
+    if (scan->plist) {
+        memset(scan->plist, 0, sizeof *scan->plist);
+        scan->plist->arena = scan->arena;
+        if (!(scan->plist->entries = scan->arena ? arena_alloc(scan->arena, DTS_PHANDLE_MAP_INITIAL * sizeof *scan->plist->entries) : malloc(DTS_PHANDLE_MAP_INITIAL * sizeof *scan->plist->entries))) {
+            prln_error("failed to allocate memory for phandle list");
+            return 1;
         }
+        memset(scan->plist->entries, 0, DTS_PHANDLE_MAP_INITIAL * sizeof *scan->plist->entries);
+        scan->plist->allocated = DTS_PHANDLE_MAP_INITIAL;
     }
-    return layers;
-}
-
-uint8_t *
-dts_skip_nop(
-    uint8_t const * const   dts
-){
-    uint32_t const *start = (uint32_t const *)dts;
-    while (*start == DTS_NOP_ACTUAL) {
-        ++start;
+    struct dts_walker const walker = {
+        .begin_node = dts_scan_begin_node,
+        .end_node = dts_scan_end_node,
+        .prop = dts_scan_prop
+    };
+    if (dts_walk(dts, max_offset, &walker, &context)) {
+        prln_error("failed to walk through DTS");
+        dts_phandle_list_free(scan->plist);
+        return 2;
+    }
+    if (scan->plist && dts_phandle_list_finish(scan->plist)) {
+        prln_error("failed to finish phandle list");
+        dts_phandle_list_free(scan->plist);
+        return 3;
     }
-    if (*start != DTS_BEGIN_NODE_ACTUAL) {
-        prln_error("node does not start properly");
-        return NULL;
+    if (scan->phelper && scan->phelper->node) {
+        if (context.partitions_invalid) {
+            prln_error("failed to get partitions");
+        } else {
+            dts_sort_partitions(scan->phelper);
+            scan->has_partitions = true;
+        }
     }
-    return (uint8_t *)start;
+    return 0;
 }
 
-uint8_t *
-dts_get_node_from_path(
-    uint8_t const * const   dts,
-    uint32_t const          max_offset,
-    char const * const      path,
-    size_t                  len_path
+static
+int
+dts_node_index_begin_node(
+    void * const            context_void,
+    uint8_t const * const   node,
+    uint32_t const          depth
 ){
-    if (dts_get_node_from_path_sanity_check(dts, max_offset, path)) {
-        return NULL;
-    }
-    if (!len_path) {
-        if (!(len_path = strlen(path))) { // This should not happen
-            prln_error("empty path to lookup");
-            return NULL;
+    struct dts_node_index_context *const context = context_void;
+    struct dts_node_index *const nindex = context->nindex;
+    if (nindex->count == nindex->allocated) {
+        uint32_t const allocated = nindex->allocated ? nindex->allocated * 2 : DTS_NODE_INDEX_INITIAL;
+        struct dts_node_index_entry *const entries = realloc(nindex->entries, allocated * sizeof *entries);
+        if (!entries) {
+            prln_error_with_errno("failed to allocate memory for node index");
+            return 1;
         }
+        nindex->entries = entries;
+        nindex->allocated = allocated;
     }
-    uint8_t const *const start = dts_skip_nop(dts);
-    if (!start) {
-        prln_error("node does not start properly");
-        return NULL;
-    }
-    if (len_path == 1) {
-        prln_warn("early quit for root node");
-        return (uint8_t *)start + 4;
-    }
-    char *const path_actual = strdup(path);
-    if (!path_actual) {
-        prln_error("failed to dup path");
-        return NULL;
-    }
-    int const layers = dts_get_path_layers(path_actual, len_path);
-    if (layers < 0) {
-        free(path_actual);
-        return NULL;
+    if (depth && !nindex->count) {
+        prln_error("node index does not start from the root node");
+        return 2;
     }
-    uint8_t *target = NULL;
-    uint32_t r = dts_get_node(start + 4, max_offset - (start - dts) - 4, path_actual, layers, (uint8_t const **)&target);
-    free(path_actual);
-    if (r) {
-        return target;
-    } else {
-        prln_error("error occured, can not find");
-        return NULL;
+    struct dts_node_index_entry *const entry = nindex->entries + nindex->count;
+    size_t const len_name = strlen((char const *)node) + 1;
+    entry->offset = node - context->dts;
+    entry->props = entry->offset + util_nearest_upper_bound_ulong(len_name, 4);
+    entry->end = 0;
+    entry->parent = depth ? context->stack[depth - 1] : 0;
+    entry->next = 0;
+    entry->hash = 0;
+    context->stack[depth] = nindex->count++;
+    if (context->shelper) {
+        context->hashes[depth] = util_hash64(UTIL_HASH64_INITIAL, node, len_name);
     }
+    return 0;
 }
 
-
-static inline
-off_t 
-dts_stringblock_essential_offset_get(
-    struct stringblock_helper const * const shelper,
-    char const * const                      name,
-    uint32_t * const                        invalids
+static
+int
+dts_node_index_prop(
+    void * const            context_void,
+    uint8_t const * const   node,
+    uint32_t const          name_off,
+    uint32_t const          len,
+    uint8_t const * const   value,
+    uint32_t const          depth
 ){
-    const off_t offset = stringblock_find_string(shelper, name);
-    if (offset < 0) {
-        ++(*invalids);
-        prln_error("can not find %s in stringblock", name);
+    (void)node;
+    struct dts_node_index_context *const context = context_void;
+    struct stringblock_helper const *const shelper = context->shelper;
+    if (name_off >= shelper->length) {
+        prln_error("property name offset 0x%x outside of the string block", name_off);
+        return 1;
     }
-    return offset;
+    /* Names are hashed as strings, as the same name could be at different offsets in different DTBs */
+    uint64_t hash = util_hash64(context->hashes[depth], shelper->stringblock + name_off, strnlen(shelper->stringblock + name_off, shelper->length - name_off) + 1);
+    hash = util_hash64(hash, &len, sizeof len);
+    context->hashes[depth] = util_hash64(hash, value, len);
+    return 0;
 }
 
-static inline
+static
 int
-dts_get_partitions_get_essential_offsets(
-    struct dts_stringblock_essential_offsets * const    offsets,
-    struct stringblock_helper const * const             shelper
+dts_node_index_end_node(
+    void * const            context_void,
+    uint8_t const * const   node,
+    uint8_t const * const   end,
+    uint32_t const          depth
 ){
-    uint32_t offset_invalids = 0;
-    uint32_t optional_invalids = 0;
-    offsets->parts = dts_stringblock_essential_offset_get(shelper, "parts", &offset_invalids);
-    offsets->pname = dts_stringblock_essential_offset_get(shelper, "pname", &offset_invalids);
-    offsets->size = dts_stringblock_essential_offset_get(shelper, "size", &offset_invalids);
-    offsets->mask = dts_stringblock_essential_offset_get(shelper, "mask", &offset_invalids);
-    offsets->phandle = dts_stringblock_essential_offset_get(shelper, "phandle", &offset_invalids);
-    offsets->linux_phandle = dts_stringblock_essential_offset_get(shelper, "linux,phandle", &optional_invalids);
-    return offset_invalids;
+    (void)node;
+    struct dts_node_index_context *const context = context_void;
+    struct dts_node_index_entry *const entry = context->nindex->entries + context->stack[depth];
+    entry->end = end - context->dts;
+    entry->next = context->nindex->count;
+    if (context->shelper) {
+        entry->hash = context->hashes[depth];
+        if (depth) {
+            context->hashes[depth - 1] = util_hash64(context->hashes[depth - 1], &entry->hash, sizeof entry->hash);
+        }
+    }
+    return 0;
 }
 
-static inline
+/*
+ Nodes are indexed in the order they appear, so a node's subtree is the range
+ of entries after it till its next, and its children can be iterated by jumping
+ from one child to that child's next. As the END_NODE offset is recorded, a
+ node can be skipped or measured without going through its tokens again. With shelper each node also gets a hash
+ of its whole subtree, so identical subtrees can be told without walking them
+*/
 int
-dts_parse_partitions_node_begin(
-    struct dts_partitions_helper * const        phelper,
-    bool * const                                in_partition,
-    struct dts_partition_entry * * const        partition,
-    uint32_t const * const                      current,
-    uint32_t * const                            i
-
+dts_node_index_build(
+    struct dts_node_index * const           nindex,
+    uint8_t const * const                   dts,
+    uint32_t const                          max_offset,
+    struct stringblock_helper const * const shelper
 ){
-    if (*in_partition) {
-        prln_error("encountered sub node inside partition, which is impossible");
+    if (!nindex || !dts) {
+        prln_error("illegal arguments");
+        return -1;
+    }
+    memset(nindex, 0, sizeof *nindex);
+    struct dts_node_index_context context = {
+        .nindex = nindex,
+        .dts = dts,
+        .shelper = shelper
+    };
+    struct dts_walker const walker = {
+        .begin_node = dts_node_index_begin_node,
+        .end_node = dts_node_index_end_node,
+        .prop = shelper ? dts_node_index_prop : NULL
+    };
+    if (dts_walk(dts, max_offset, &walker, &context) || !nindex->count) {
+        prln_error("failed to index nodes in DTS");
+        dts_node_index_free(nindex);
         return 1;
-    } else {
-        if (phelper->partitions_count >= MAX_PARTITIONS_COUNT) {
-            prln_error("partitions count exceeds maximum");
-            return 2;
-        }
-        *partition = phelper->partitions + phelper->partitions_count++;
-        size_t const len_node_name = strlen((const char *)(current + 1));
-        if (len_node_name > 15) {
-            prln_error("partition name '%s' too long", (const char *)(current + 1));
-            return 3;
-        }
-        *i += (len_node_name + 1) / 4;
-        if ((len_node_name + 1) % 4) {
-            ++*i;
-        }
-        strncpy((*partition)->name, (const char *)(current + 1), len_node_name);
-        *in_partition = true;
     }
     return 0;
 }
 
-static inline
-int
-dts_parse_partitions_node_end(
-    struct dts_partition_entry * const          partition
+void
+dts_node_index_free(
+    struct dts_node_index * const   nindex
 ){
-    if (partition && partition->phandle && partition->linux_phandle && partition->phandle != partition->linux_phandle) {
-        prln_error("partition '%s' has different phandle (%"PRIu32") and linux,phandle (%"PRIu32")", partition->name, partition->phandle, partition->linux_phandle);
-        return 1;
+    if (!nindex) {
+        return;
     }
-    return 0;
+    free(nindex->entries);
+    memset(nindex, 0, sizeof *nindex);
 }
 
 static inline
-int
-dts_parse_partitions_node_prop_root(
-    uint32_t const * const                              current,
-    uint32_t const                                      len_prop,
-    uint32_t const                                      name_off,
-    struct dts_stringblock_essential_offsets * const    offsets,
-    struct dts_partitions_helper * const                phelper,
-    struct stringblock_helper const * const             shelper
-
+bool
+dts_node_name_match(
+    char const * const  name,
+    char const * const  component,
+    size_t const        len_component
 ){
-    if (len_prop == 4) {
-        if (name_off == offsets->parts) {
-            phelper->record_count = bswap_32(*(current+3));
-        } else if (name_off == offsets->phandle) {
-            phelper->phandle_root = bswap_32(*(current+3));
-        } else if (name_off == offsets->linux_phandle) {
-            phelper->linux_phandle_root = bswap_32(*(current+3));
-        } else {
-            if (strncmp(shelper->stringblock + name_off, "part-", 5)) {
-                prln_error("invalid propertey '%s' in partitions node", shelper->stringblock + name_off);
-                return 1;
-            } else {
-                unsigned long phandle_id = strtoul(shelper->stringblock + name_off + 5, NULL , 10);
-                if (phandle_id > MAX_PARTITIONS_COUNT - 1) {
-                    prln_error("invalid part id %lu in partitions node", phandle_id);
-                    return 2;
-                }
-                phelper->phandles[phandle_id] = bswap_32(*(current+3));
-            }
-        }
-    } else {
-        prln_error("%s property of partitions node is not of length 4", shelper->stringblock + name_off);
-        return 3;
+    if (strncmp(name, component, len_component)) {
+        return false;
     }
-    return 0;
+    // Without unit address in the component, node@address also matches, like dtc does
+    return !name[len_component] || (name[len_component] == '@' && !memchr(component, '@', len_component));
 }
 
-static inline
-int
-dts_parse_partitions_node_prop_child(
-    uint32_t const * const                              current,
-    uint32_t const                                      len_prop,
-    uint32_t const                                      name_off,
-    struct dts_stringblock_essential_offsets * const    offsets,
-    struct dts_partition_entry * const                  partition,
-    struct dts_partitions_helper * const                phelper,
-    struct stringblock_helper const * const             shelper
+/*
+ Look up a node by its absolute path with len_path chars, e.g. /partitions/data,
+ returns its index, or -1 if it does not exist
+*/
+int64_t
+dts_node_index_find(
+    struct dts_node_index const * const nindex,
+    uint8_t const * const               dts,
+    char const * const                  path,
+    size_t const                        len_path
 ){
-    if (name_off == offsets->pname) {
-        if (len_prop > 16) {
-            prln_error("partition name '%s' too long", (const char *)(current + 3));
-            return 1;
-        }
-        if (strcmp(partition->name, (const char *)(current + 3))) {
-            prln_error("pname property %s different from partition node name %s", (const char *)(current + 3), partition->name);
-            return 2;
+    if (!nindex || !nindex->count || !dts || !path || !len_path || path[0] != '/') {
+        return -1;
+    }
+    uint32_t current = 0;
+    char const *component = path;
+    char const *const path_end = path + len_path;
+    char const *component_end;
+    struct dts_node_index_entry const *entry;
+    uint32_t child;
+    while (component < path_end) {
+        while (component < path_end && *component == '/') {
+            ++component;
         }
-    } else if (name_off == offsets->size) {
-        if (len_prop == 8) {
-            partition->size = ((uint64_t)bswap_32(*(current+3)) << 32) | (uint64_t)bswap_32(*(current+4));
-        } else {
-            prln_error("partition size is not of length 8");
-            return 3;
+        if (component == path_end) {
+            break;
         }
-    } else if (name_off == offsets->mask) {
-        if (len_prop == 4) {
-            partition->mask = bswap_32(*(current+3));
-        } else {
-            prln_error("partition mask is not of length 4");
-            return 4;
+        if (!(component_end = memchr(component, '/', path_end - component))) {
+            component_end = path_end;
         }
-    } else if (name_off == offsets->phandle) {
-        if (len_prop == 4) {
-            partition->phandle = bswap_32(*(current+3));
-        } else {
-            prln_error("partition phandle is not of length 4");
-            return 5;
+        entry = nindex->entries + current;
+        for (child = current + 1; child < entry->next; child = nindex->entries[child].next) {
+            if (dts_node_name_match((char const *)dts + nindex->entries[child].offset, component, component_end - component)) {
+                break;
+            }
         }
-    } else if (name_off == offsets->linux_phandle) {
-        if (len_prop == 4) {
-            partition->linux_phandle = bswap_32(*(current+3));
-        } else {
-            prln_error("partition phandle is not of length 4");
-            return 6;
+        if (child >= entry->next) {
+            return -1;
         }
-    } else {
-        prln_error("invalid property for partition, ignored: %s", shelper->stringblock+name_off);
-        free(phelper);
-        return 7;
-    }
-    return 0;
-}
-
-static inline
-int
-dts_parse_partitions_node_prop(
-    uint32_t const * const                              current,
-    uint32_t * const                                    i,
-    bool const                                          in_partition,
-    struct dts_stringblock_essential_offsets * const    offsets,
-    struct dts_partition_entry * const                  partition,
-    struct dts_partitions_helper * const                phelper,
-    struct stringblock_helper const * const             shelper
-){
-    uint32_t const len_prop = bswap_32(*(current+1));
-    uint32_t const name_off = bswap_32(*(current+2));
-    dts_skip_prop_with_length(i, len_prop);
-    if (in_partition) {
-        return dts_parse_partitions_node_prop_child(current, len_prop, name_off, offsets, partition, phelper, shelper);
-    } else {
-        return dts_parse_partitions_node_prop_root(current, len_prop, name_off, offsets, phelper, shelper);
+        current = child;
+        component = component_end;
     }
+    return current;
 }
 
+/*
+ Iterate through the properties of an indexed node, offset should be 0 for the
+ first call. Properties always come before sub nodes, so only the tokens right
+ after the node name need to be checked. Returns 0 for a property, 1 at the end
+*/
 int
-dts_get_partitions_from_node(
-    struct dts_partitions_helper *          phelper,
-    struct stringblock_helper const * const shelper
+dts_node_next_property(
+    uint8_t const * const                       dts,
+    struct dts_node_index_entry const * const   entry,
+    struct stringblock_helper const * const     shelper,
+    uint32_t * const                            offset,
+    char const ** const                         name,
+    uint8_t const ** const                      value,
+    uint32_t * const                            len
 ){
-    if (memcmp(phelper->node, dts_partitions_node_start, DTS_PARTITIONS_NODE_START_LENGTH)) {
-        prln_error("node does not start properly");
-        return 1;
+    if (!dts || !entry || !shelper || !offset || !name || !value || !len) {
+        return -1;
     }
-    struct dts_stringblock_essential_offsets offsets;
-    if (dts_get_partitions_get_essential_offsets(&offsets, shelper)) {
-        return 2;
+    if (!*offset) {
+        *offset = entry->props;
     }
-    uint8_t *node_temp = phelper->node;
-    memset(phelper, 0, sizeof *phelper);
-    phelper->node = node_temp;
-    uint32_t const * const start = (const uint32_t *)(phelper->node + DTS_PARTITIONS_NODE_START_LENGTH);
-    uint32_t const *current;
-    bool in_partition = false;
-    struct dts_partition_entry *partition = NULL;
-    for (uint32_t i = 0; ; ++i) {
-        current = start + i;
-        switch (*current) {
-            case DTS_BEGIN_NODE_ACTUAL:
-                if (dts_parse_partitions_node_begin(phelper, &in_partition, &partition, current, &i)) {
-                    return 3;
-                }
-                break;
-            case DTS_END_NODE_ACTUAL:
-                if (in_partition) {
-                    if (dts_parse_partitions_node_end(partition)) {
-                        return 4;
-                    }
-                    in_partition = false;
-                } else {
-                    return 0;
-                }
-                break;
+    uint32_t name_off;
+    while (*offset < entry->end) {
+        switch (*(uint32_t const *)(dts + *offset)) {
             case DTS_PROP_ACTUAL:
-                if (dts_parse_partitions_node_prop(current, &i, in_partition, &offsets, partition, phelper, shelper)) {
-                    return 5;
+                *len = bswap_32(*(uint32_t const *)(dts + *offset + 4));
+                name_off = bswap_32(*(uint32_t const *)(dts + *offset + 8));
+                *value = dts + *offset + 12;
+                *offset += 12 + util_nearest_upper_bound_ulong(*len, 4);
+                if (name_off < shelper->length) {
+                    *name = shelper->stringblock + name_off;
+                    return 0;
                 }
                 break;
             case DTS_NOP_ACTUAL:
+                *offset += 4;
                 break;
             default:
-                prln_error("invalid token 0x%08x", bswap_32(*current));
-                return 6;
+                *offset = entry->end;
+                return 1;
         }
     }
+    return 1;
 }
 
 int
-dts_sort_partitions(
-    struct dts_partitions_helper * const    phelper
+dts_node_get_property(
+    uint8_t const * const                       dts,
+    struct dts_node_index_entry const * const   entry,
+    struct stringblock_helper const * const     shelper,
+    char const * const                          name,
+    uint8_t const ** const                      value,
+    uint32_t * const                            len
 ){
-    if (!phelper) {
-        prln_error("no partitions helper to sort");
-        return 1;
-    }
-    if (phelper->record_count > MAX_PARTITIONS_COUNT) {
-        prln_error("Too many partitions");
-        return 2;
-    }
-    uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
-    if (pcount != phelper->record_count) {
-        prln_error("partitions node count (%"PRIu32") != record count (%"PRIu32")", phelper->partitions_count, phelper->record_count);
-        return 3;
+    if (!name) {
+        return -1;
     }
-    struct dts_partition_entry buffer;
-    for (uint32_t i = 0; i < pcount; ++i) {
-        if (phelper->phandles[i] != phelper->partitions[i].phandle) {
-            for (uint32_t j = i + 1; j < pcount; ++j) {
-                if (phelper->partitions[j].phandle == phelper->phandles[i]) {
-                    buffer = phelper->partitions[i];
-                    phelper->partitions[i] = phelper->partitions[j];
-                    phelper->partitions[j] = buffer;
-                    break;
-                }
-            }
+    uint32_t offset = 0;
+    char const *name_current;
+    int r;
+    while (!(r = dts_node_next_property(dts, entry, shelper, &offset, &name_current, value, len))) {
+        if (!strcmp(name_current, name)) {
+            return 0;
         }
     }
-    prln_info("partitions now in part-num order defined in partitions node's properties");
-    return 0;
+    return r;
 }
 
+static inline
 void
-dts_report_partitions(
-    struct dts_partitions_helper const * const  phelper
+dts_diff_report(
+    char const * const  prefix,
+    char const          change,
+    char const * const  path,
+    char const * const  name,
+    bool const          is_node
 ){
-    uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
-    prln_info("%u partitions in the DTB:\n=======================================================\nID| name            |            size|(   human)| masks\n-------------------------------------------------------", pcount);
-    const struct dts_partition_entry *part;
-    double num_size;
-    char suffix_size;
-    for (uint32_t i=0; i < pcount; ++i) {
-        part = phelper->partitions + i;
-        if (part->size == (uint64_t)-1) {
-            fprintf(stderr, "%2d: %-16s                  (AUTOFILL) %6"PRIu32"\n", i, part->name, part->mask);
-        } else {
-            num_size = util_size_to_human_readable(part->size, &suffix_size);
-            fprintf(stderr, "%2d: %-16s %16"PRIx64" (%7.2lf%c) %6"PRIu32"\n", i, part->name, part->size, num_size, suffix_size, part->mask);
-        }
-    }
-    fprintf(stderr, "=======================================================\n");
-    return;
+    printf("%s%c %s%s%s%s\n", prefix, change, path, path[1] ? "/" : "", name, is_node ? "/" : "");
 }
 
-
-void
-dts_report_partitions_simple(
-    struct dts_partitions_helper_simple const * phelper
+static inline
+uint32_t
+dts_diff_find_child(
+    struct dts_node_index const * const nindex,
+    uint8_t const * const               dts,
+    uint32_t const                      parent,
+    char const * const                  name
 ){
-    uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
-    prln_info("DTS report partitions: %u partitions in the DTB:\n=======================================================\nID| name            |            size|(   human)| masks\n-------------------------------------------------------", pcount);
-    const struct dts_partition_entry_simple *part;
-    double num_size;
-    char suffix_size;
-    for (uint32_t i=0; i < pcount; ++i) {
-        part = phelper->partitions + i;
-        if (part->size == (uint64_t)-1) {
-            fprintf(stderr, "%2d: %-16s                  (AUTOFILL) %6"PRIu32"\n", i, part->name, part->mask);
-        } else {
-            num_size = util_size_to_human_readable(part->size, &suffix_size);
-            fprintf(stderr, "%2d: %-16s %16"PRIx64" (%7.2lf%c) %6"PRIu32"\n", i, part->name, part->size, num_size, suffix_size, part->mask);
+    uint32_t const next = nindex->entries[parent].next;
+    for (uint32_t child = parent + 1; child < next; child = nindex->entries[child].next) {
+        if (!strcmp((char const *)dts + nindex->entries[child].offset, name)) {
+            return child;
         }
     }
-    fprintf(stderr, "=======================================================\n");
-    return;
-}
-
-int
-dts_phandle_list_realloc(
-    struct dts_phandle_list * const plist
-){
-    if (!plist || !plist->entries || !plist->allocated) {
-        return -1;
-    }
-    struct dts_phandle_entry *buffer = realloc(plist->entries, plist->allocated * 2 * sizeof *buffer);
-    if (buffer) {
-        memset(buffer + plist->allocated, 0, plist->allocated * sizeof *buffer);
-        plist->entries = buffer;
-    } else {
-        prln_error_with_errno("failed to re-allocate memory");
-        return 1;
-    }
-    plist->allocated *= 2;
-    return 0;
+    return next;
 }
 
 static inline
-int
-dts_get_phandles_recursive_parse_prop(
-    uint32_t const * const          current,
-    uint8_t const * const           node,
-    uint32_t * const                i,
-    uint32_t const                  offset_phandle,
-    uint32_t const                  offset_linux_phandle,
-    struct dts_phandle_list * const plist
+unsigned
+dts_diff_properties(
+    struct dts_diff_side const * const          a,
+    struct dts_diff_side const * const          b,
+    struct dts_node_index_entry const * const   entry_a,
+    struct dts_node_index_entry const * const   entry_b,
+    char const * const                          path,
+    char const * const                          prefix
 ){
-    uint32_t const len_prop = bswap_32(*(current+1));
-    uint32_t const name_off = bswap_32(*(current+2));
-    dts_skip_prop_with_length(i, len_prop);
-    if (name_off == offset_phandle || name_off == offset_linux_phandle) {
-        if (len_prop == 4) {
-            uint32_t const phandle = bswap_32(*(current+3));
-            while (phandle >= plist->allocated) {
-                if (dts_phandle_list_realloc(plist)) {
-                    prln_error("failed to re-allocate memory");
-                    return 1;
-                }
-            }
-            struct dts_phandle_entry * const entry = plist->entries + phandle;
-            if (entry->node) {
-                if (entry->node != node) {
-                    prln_error("phandle %"PRIu32" already encountered before, but previous node (%p) != current node (%p)", phandle, entry->node, node);
-                    return 1;
-                }
-            } else {
-                entry->node = (uint8_t *)node;
-            }
-            if (name_off == offset_phandle) {
-                entry->status |= DTS_HAS_PHANDLE;
-            } else {
-                entry->status |= DTS_HAS_LINUX_PHANDLE;
-            }
-        } else {
-            prln_error("phandle not of length 4");
-            return 1;
+    unsigned diffs = 0;
+    uint32_t offset = 0, len_a, len_b;
+    char const *name;
+    uint8_t const *value_a, *value_b;
+    while (!dts_node_next_property(a->dts, entry_a, a->shelper, &offset, &name, &value_a, &len_a)) {
+        if (dts_node_get_property(b->dts, entry_b, b->shelper, name, &value_b, &len_b)) {
+            dts_diff_report(prefix, '-', path, name, false);
+            ++diffs;
+        } else if (len_a != len_b || memcmp(value_a, value_b, len_a)) {
+            dts_diff_report(prefix, '~', path, name, false);
+            ++diffs;
         }
     }
-    return 0;
+    offset = 0;
+    while (!dts_node_next_property(b->dts, entry_b, b->shelper, &offset, &name, &value_b, &len_b)) {
+        if (dts_node_get_property(a->dts, entry_a, a->shelper, name, &value_a, &len_a)) {
+            dts_diff_report(prefix, '+', path, name, false);
+            ++diffs;
+        }
+    }
+    return diffs;
 }
 
-uint32_t
-dts_get_phandles_recursive(
-    struct dts_phandle_list * const plist,
-    uint8_t const * const           node,
-    uint32_t const                  max_offset,
-    uint32_t const                  offset_phandle,
-    uint32_t const                  offset_linux_phandle
+static inline
+unsigned
+dts_diff_added_children(
+    struct dts_diff_side const * const  a,
+    struct dts_diff_side const * const  b,
+    uint32_t const                      node_a,
+    uint32_t const                      node_b,
+    char const * const                  path,
+    char const * const                  prefix
 ){
-    uint32_t const count = dts_get_count(max_offset);
-    if (!count) {
-        return 0;
-    }
-    uint32_t const *const start = dts_get_start_without_len_name(node);
-    uint32_t const *current;
-    uint32_t offset_child;
-    for (uint32_t i = 0; i < count; ++i) {
-        current = start + i;
-        switch (*current) {
-            case DTS_BEGIN_NODE_ACTUAL:
-                offset_child = dts_get_phandles_recursive(plist, (uint8_t const*)(current + 1), max_offset - 4*i, offset_phandle, offset_linux_phandle);
-                if (offset_child) {
-                    i += offset_child + 1;
-                } else {
-                    prln_error("failed to recursively get phandles from child node");
-                    return 0;
-                }
-                break;
-            case DTS_END_NODE_ACTUAL:
-                return i + start - (const uint32_t *)node;
-            case DTS_PROP_ACTUAL:
-                if (dts_get_phandles_recursive_parse_prop(current, node, &i, offset_phandle, offset_linux_phandle, plist)) {
-                    return 0;
-                }
-                break;
-            case DTS_NOP_ACTUAL:
-                break;
-            default:
-                prln_error("invalid token %"PRIu32"", bswap_32(*current));
-                return 0;
+    unsigned diffs = 0;
+    char const *name;
+    for (uint32_t child_b = node_b + 1; child_b < b->nindex->entries[node_b].next; child_b = b->nindex->entries[child_b].next) {
+        name = (char const *)b->dts + b->nindex->entries[child_b].offset;
+        if (dts_diff_find_child(a->nindex, a->dts, node_a, name) >= a->nindex->entries[node_a].next) {
+            dts_diff_report(prefix, '+', path, name, true);
+            ++diffs;
         }
     }
-    prln_error("node not properly ended");
-    return 0;
+    return diffs;
 }
 
-
-int
-dts_phandle_list_finish(
-    struct dts_phandle_list * const plist
+/*
+ Print nodes and properties removed (-), added (+) and changed (~) from a to b,
+ both need to be indexed with their stringblocks so subtrees hashes are there.
+ Returns the count of differences
+*/
+unsigned
+dts_diff(
+    struct dts_diff_side const * const  a,
+    struct dts_diff_side const * const  b,
+    char const * const                  prefix
 ){
-    if (plist->entries->node) {
-        prln_error("phandle 0 has corresponding node, this is impossible");
-        return 1;
+    if (!a || !b || !a->nindex->count || !b->nindex->count) {
+        return 0;
     }
-    if (plist->entries->status) {
-        prln_error("phandle 0 is marked as existing (either phandle or linux,phandle), this is impossible");
-        return 2;
+    if (a->nindex->entries->hash == b->nindex->entries->hash) {
+        return 0;
     }
-    for (uint32_t i = 1; i < plist->allocated; ++i) {
-        struct dts_phandle_entry const *const entry = plist->entries + i;
-        if (entry->node) {
-            if (entry->status == DTS_NO_PHANDLE) {
-                prln_error("node %p recorded for phandle %u but status is no, this is impossible", entry->node, i);
-                return 3;
-            }
-            plist->status |= entry->status;
-            plist->max = i;
-            if (!plist->min) {
-                plist->min = i;
-            }
-        } else {
-            if (entry->status != DTS_NO_PHANDLE) {
-                prln_error("phandle %u does not have corresponding node but it's marked as existing, impossible", i);
-                return 4;
+    char const *const prefix_use = prefix ? prefix : "";
+    char path[DTS_DIFF_PATH_MAXIMUM] = "/";
+    struct dts_diff_frame stack[DTS_WALK_DEPTH_MAXIMUM];
+    struct dts_diff_frame *frame = stack;
+    *frame = (struct dts_diff_frame){0, 0, 1, 1};
+    unsigned diffs = dts_diff_properties(a, b, a->nindex->entries, b->nindex->entries, path, prefix_use);
+    struct dts_node_index_entry const *entry_a, *entry_b;
+    char const *name;
+    uint32_t child_a, child_b;
+    size_t len_name, len_path;
+    for (;;) {
+        entry_a = a->nindex->entries + frame->node_a;
+        if (frame->child_a >= entry_a->next) {
+            diffs += dts_diff_added_children(a, b, frame->node_a, frame->node_b, path, prefix_use);
+            if (frame == stack) {
+                break;
             }
+            path[(--frame)->len_path] = '\0';
+            continue;
         }
+        child_a = frame->child_a;
+        frame->child_a = a->nindex->entries[child_a].next;
+        name = (char const *)a->dts + a->nindex->entries[child_a].offset;
+        if ((child_b = dts_diff_find_child(b->nindex, b->dts, frame->node_b, name)) >= b->nindex->entries[frame->node_b].next) {
+            dts_diff_report(prefix_use, '-', path, name, true);
+            ++diffs;
+            continue;
+        }
+        entry_a = a->nindex->entries + child_a;
+        entry_b = b->nindex->entries + child_b;
+        if (entry_a->hash == entry_b->hash) {
+            continue;
+        }
+        if (frame + 1 == stack + DTS_WALK_DEPTH_MAXIMUM) {
+            prln_warn("node %s under %s nested too deep, not comparing it", name, path);
+            continue;
+        }
+        len_name = strlen(name);
+        len_path = frame->len_path + (frame->len_path > 1) + len_name;
+        if (len_path >= DTS_DIFF_PATH_MAXIMUM) {
+            prln_warn("path of node %s under %s too long, not comparing it", name, path);
+            continue;
+        }
+        if (frame->len_path > 1) {
+            path[frame->len_path] = '/';
+        }
+        memcpy(path + len_path - len_name, name, len_name + 1);
+        *(++frame) = (struct dts_diff_frame){child_a, child_b, child_a + 1, len_path};
+        diffs += dts_diff_properties(a, b, entry_a, entry_b, path, prefix_use);
     }
-    if (plist->status == DTS_NO_PHANDLE) {
-        prln_error("no phandle nor linux,phandle marked for whole DTS, which is impossible");
-        return 5;
-    }
-    if (!plist->max) {
-        prln_error("did not find max phandle, which is impossible");
-        return 6;
+    return diffs;
+}
+
+static
+int
+dts_collect_strings_prop(
+    void * const            context_void,
+    uint8_t const * const   node,
+    uint32_t const          name_off,
+    uint32_t const          len,
+    uint8_t const * const   value,
+    uint32_t const          depth
+){
+    (void)node;
+    (void)len;
+    (void)depth;
+    struct dts_collect_strings_context *const context = context_void;
+    if (name_off >= context->length) {
+        prln_error("property name offset 0x%x outside of the string block", name_off);
+        return 1;
     }
-    if (!plist->min) {
-        prln_error("did not find min phanle, which is impossible");
-        return 7;
+    if (context->used) {
+        context->used[name_off] = 1;
+    } else {
+        *(uint32_t *)(context->dts + (value - context->dts) - 4) = bswap_32(context->remap[name_off]);
     }
     return 0;
 }
 
+/*
+ Drop the strings no property in dts refers to anymore from shelper, and point
+ the properties to where their names are moved to. saved gets the bytes dropped,
+ the temporary tables come from arena
+*/
 int
-dts_get_property_string(
-    uint8_t const * const   node,
-    uint32_t const          property_offset,
-    char *                  string,
-    size_t const            max_len
-){
-    dts_property.len = 0;
-    dts_property.value = NULL;
-    if (dts_get_property_actual(node, property_offset)) {
-        prln_error("failed to get property");
+dts_collect_strings(
+    uint8_t * const                     dts,
+    uint32_t const                      max_offset,
+    struct stringblock_helper * const   shelper,
+    struct arena * const                arena,
+    size_t * const                      saved
+){
+    if (!dts || !shelper || !arena || !saved) {
+        prln_error("illegal arguments");
+        return -1;
+    }
+    *saved = 0;
+    if (!shelper->length) {
+        return 0;
+    }
+    struct dts_collect_strings_context context = {
+        .dts = dts,
+        .length = shelper->length,
+        .used = arena_calloc(arena, shelper->length, sizeof *context.used)
+    };
+    uint32_t *const remap = arena_alloc(arena, shelper->length * sizeof *remap);
+    if (!context.used || !remap) {
+        prln_error_with_errno("failed to allocate memory for string references");
         return 1;
     }
-    if (max_len && dts_property.len > max_len) {
-        prln_error("string too long");
+    struct dts_walker const walker = {.prop = dts_collect_strings_prop};
+    if (dts_walk(dts, max_offset, &walker, &context)) {
+        prln_error("failed to find strings referred to in DTS");
         return 2;
     }
-    strncpy(string, (const char *)dts_property.value, dts_property.len);
+    off_t const dropped = stringblock_compact(shelper, context.used, remap);
+    if (dropped) {
+        context.used = NULL;
+        context.remap = remap;
+        dts_walk(dts, max_offset, &walker, &context);   // Can't fail as it passed the same walk above
+    }
+    *saved = dropped;
     return 0;
 }
 
-
 uint32_t 
 dts_compare_partitions(
     struct dts_partitions_helper const * const  phelper_a, 
@@ -1047,69 +1341,43 @@ dts_dclone_parse(
     return 0;
 }
 
-int
-dts_get_phandles(
-    struct dts_phandle_list * const plist,
-    uint8_t const * const           dts,
-    uint32_t const                  max_offset,
-    uint32_t const                  offset_phandle,
-    uint32_t const                  offset_linux_phandle
-){
-    uint8_t const *const start = dts_skip_nop(dts);
-    if (!start) {
-        prln_error("node does not start properly");
-        return -1;
-    }
-    memset(plist, 0, sizeof *plist);
-    if (!(plist->entries = malloc(128 * sizeof *plist->entries))) {
-        prln_error("failed to allocate memory for phandle list");
-        return 1;
-    }
-    memset(plist->entries, 0, 128 * sizeof *plist->entries);
-    plist->allocated = 128;
-    if (!dts_get_phandles_recursive(plist, start + 4, max_offset - (start - dts) - 4, offset_phandle, offset_linux_phandle)) {
-        free(plist->entries);
-        prln_error("failed to get phandle list");
-        return 2;
-    }
-    if (dts_phandle_list_finish(plist)) {
-        free(plist->entries);
-        prln_error("failed to finish phandle list");
-        return 3;
-    }
-    return 0;
-}
-
 int
 dts_drop_partitions_phandles(
     struct dts_phandle_list * const             plist,
     struct dts_partitions_helper const * const  phelper
 ){
-    if (!plist || !phelper || !plist->entries) {
+    if (!plist || !phelper || !plist->entries || !plist->bitmap) {
         return -1;
     }
     struct dts_partition_entry const *dts_part;
-    struct dts_phandle_entry *phandle_entry;
     uint32_t phandle;
     uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
-    for (uint32_t i = 0; i < pcount; ++i) {
-        if (!(phandle = (dts_part = phelper->partitions + i)->phandle)) {
+    for (uint32_t i = 0; i <= pcount; ++i) {
+        if (i < pcount) {
+            dts_part = phelper->partitions + i;
+            phandle = dts_part->phandle;
+        } else {
+            dts_part = NULL;
+            phandle = phelper->phandle_root;
+        }
+        if (!phandle) {
             continue;
         }
-        if (phandle >= plist->allocated) {
+        struct dts_phandle_entry *const phandle_entry = dts_phandle_map_find(plist, phandle);
+        if (!phandle_entry->phandle) {
             prln_error("phandle 0x%x used by partitions not found in phandle list, which is impossible", phandle);
             return 1;
         }
-        phandle_entry = plist->entries + phandle;
         phandle_entry->node = NULL;
         phandle_entry->status = DTS_NO_PHANDLE;
-        prln_info("phandle 0x%x previously used by partition %s can be used now", phandle, dts_part->name);
-    }
-    if ((phandle = phelper->phandle_root)) {
-        phandle_entry = plist->entries + phandle;
-        phandle_entry->node = NULL;
-        phandle_entry->status = DTS_NO_PHANDLE;
-        prln_info("phandle 0x%x previously used by partitions root node can be used now", phandle);
+        if (phandle < plist->bitmap_words * 64) {
+            plist->bitmap[phandle / 64] &= ~(1ULL << (phandle % 64));
+        }
+        if (dts_part) {
+            prln_info("phandle 0x%x previously used by partition %s can be used now", phandle, dts_part->name);
+        } else {
+            prln_info("phandle 0x%x previously used by partitions root node can be used now", phandle);
+        }
     }
     return 0;
 }
@@ -1118,20 +1386,17 @@ uint32_t
 dts_assign_available_phandle(
     struct dts_phandle_list * const plist
 ){
-    if (!plist || !plist->entries || !plist->allocated) {
+    if (!plist || !plist->bitmap || !plist->bitmap_words) {
         return 0;
     }
-    for (uint32_t i = 1;; ++i){
-        while (i >= plist->allocated) {
-            if (dts_phandle_list_realloc(plist)) {
-                prln_error("failed to re-allocate memory");
-                return 0;
-            }
+    for (uint32_t i = 0;; ++i) {
+        if (i >= plist->bitmap_words && dts_phandle_bitmap_resize(plist, plist->bitmap_words * 2)) {
+            return 0;
         }
-        if (!plist->entries[i].node) {
-            plist->entries[i].node = (uint8_t *)-1;
-            plist->entries[i].status = plist->status;
-            return i;
+        if (~plist->bitmap[i]) {
+            uint32_t const bit = __builtin_ctzll(~plist->bitmap[i]);
+            plist->bitmap[i] |= 1ULL << bit;
+            return i * 64 + bit;
         }
     }
 }
@@ -1149,21 +1414,164 @@ dts_add_property_be32(
 }
 
 
+size_t
+dts_get_partitions_node_length(
+    struct dts_partitions_helper_simple const * const   phelper,
+    bool const                                          have_linux_phandle
+){
+    // Basic length of the node, excluding the start BEGIN_NODE and end END_NODE, 12 for partitions\0\0\0 as name, len 16 property (4 PROP_NODE, 4 len_prop, 4 name_off, 4 u32 value) for: 1 for parts, 1 for each part-N (storing phandle), 1 for phandle, optional 1 for linux,phandle. Then basic length of the partition sub-node, 8 (4 BEGIN_NODE + 4 END_NODE) + 12 (4 PROP_NODE, 4 len_prop, 4 name_off) for 4 or 5 props (pname, size, mask, phandle, optionally linux,phandle) + 8 for u64 size + 4 for u32 mask + 4 for u32 phandle + 4 optionally for u32 linux,phandle
+    uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
+    size_t len_node = 12 + 16 * (1 + pcount + 1 + have_linux_phandle) + pcount * (8 + 12 * (4 + have_linux_phandle) + 8 + 4 + 4 + 4 * have_linux_phandle);
+    for (uint32_t i = 0; i < pcount; ++i) {
+        len_node += 2 * util_nearest_upper_bound_ulong(strlen(phelper->partitions[i].name) + 1, 4); // Node name and pname
+    }
+    return len_node;
+}
+
+size_t
+dts_get_partitions_node_strings_length(
+    struct dts_partitions_helper_simple const * const   phelper
+){
+    // The most dts_compose_partitions_node() could append to the stringblock, if none of the strings exists yet
+    return sizeof "parts" + sizeof "pname" + sizeof "size" + sizeof "mask" + util_safe_partitions_count(phelper->partitions_count) * sizeof "part-NN";
+}
+
+static inline
+void
+dts_partn_string(
+    char * const    partn,  // At least sizeof "part-NN"
+    uint32_t const  id
+){
+    memcpy(partn, "part-", 5);
+    memset(partn + 5, 0, 3);
+    snprintf(partn + 5, 3, "%u", id % 100);
+}
+
+static inline
+uint64_t
+dts_partitions_fingerprint_add(
+    uint64_t const      hash,
+    char const * const  name,
+    uint64_t const      size,
+    uint32_t const      mask
+){
+    size_t const len_name = strnlen(name, MAX_PARTITION_NAME_LENGTH);
+    uint64_t r = util_hash64(hash, &len_name, sizeof len_name);
+    r = util_hash64(r, name, len_name);
+    r = util_hash64(r, &size, sizeof size);
+    return util_hash64(r, &mask, sizeof mask);
+}
+
+/*
+ Fingerprint of the partitions names, sizes and masks in order, the same for
+ the generic and the simple helper as long as they describe the same partitions
+*/
+uint64_t
+dts_get_partitions_fingerprint(
+    struct dts_partitions_helper const * const  phelper
+){
+    uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
+    uint64_t hash = util_hash64(UTIL_HASH64_INITIAL, &pcount, sizeof pcount);
+    for (uint32_t i = 0; i < pcount; ++i) {
+        hash = dts_partitions_fingerprint_add(hash, phelper->partitions[i].name, phelper->partitions[i].size, phelper->partitions[i].mask);
+    }
+    return hash;
+}
+
+uint64_t
+dts_get_partitions_fingerprint_simple(
+    struct dts_partitions_helper_simple const * const   phelper
+){
+    uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
+    uint64_t hash = util_hash64(UTIL_HASH64_INITIAL, &pcount, sizeof pcount);
+    for (uint32_t i = 0; i < pcount; ++i) {
+        hash = dts_partitions_fingerprint_add(hash, phelper->partitions[i].name, phelper->partitions[i].size, phelper->partitions[i].mask);
+    }
+    return hash;
+}
+
+/*
+ Everything dts_compose_partitions_node() composes depends on, but nothing else:
+ entries with the same fingerprint get byte-identical partitions nodes. Strings
+ are hashed as the offsets they are found at, or the length they would be
+ appended after. The phandle bitmap always keeps enough free slack for all
+ the phandles the node needs, so it alone decides which ones get assigned
+*/
+uint64_t
+dts_get_partitions_node_fingerprint(
+    struct dts_phandle_list const * const               plist,
+    struct dts_partitions_helper_simple const * const   phelper,
+    struct stringblock_helper const * const             shelper,
+    off_t const                                         offset_phandle,
+    off_t const                                         offset_linux_phandle
+){
+    uint64_t hash = util_hash64(UTIL_HASH64_INITIAL, plist->bitmap, plist->bitmap_words * sizeof *plist->bitmap);
+    uint8_t const have_linux_phandle = plist->status & DTS_HAS_LINUX_PHANDLE;
+    hash = util_hash64(hash, &have_linux_phandle, sizeof have_linux_phandle);
+    hash = util_hash64(hash, &offset_phandle, sizeof offset_phandle);
+    hash = util_hash64(hash, &offset_linux_phandle, sizeof offset_linux_phandle);
+    hash = util_hash64(hash, &shelper->length, sizeof shelper->length);
+    char const *const essentials[] = {"parts", "pname", "size", "mask"};
+    off_t offset;
+    for (unsigned i = 0; i < sizeof essentials / sizeof *essentials; ++i) {
+        offset = stringblock_find_string(shelper, essentials[i]);
+        hash = util_hash64(hash, &offset, sizeof offset);
+    }
+    char partn[] = "part-NN";
+    uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
+    hash = util_hash64(hash, &pcount, sizeof pcount);
+    struct dts_partition_entry_simple const *dentry;
+    for (uint32_t i = 0; i < pcount; ++i) {
+        dts_partn_string(partn, i);
+        offset = stringblock_find_string(shelper, partn);
+        hash = util_hash64(hash, &offset, sizeof offset);
+        dentry = phelper->partitions + i;
+        hash = util_hash64(hash, dentry->name, strnlen(dentry->name, MAX_PARTITION_NAME_LENGTH));
+        hash = util_hash64(hash, &dentry->size, sizeof dentry->size);
+        hash = util_hash64(hash, &dentry->mask, sizeof dentry->mask);
+    }
+    return hash;
+}
+
+/*
+ The stringblock side of dts_compose_partitions_node(), in the same order, for
+ when the node itself is reused from an entry with the same fingerprint
+*/
+void
+dts_append_partitions_node_strings(
+    struct dts_partitions_helper_simple const * const   phelper,
+    struct stringblock_helper * const                   shelper
+){
+    stringblock_append_string_safely(shelper, "parts", 0);
+    stringblock_append_string_safely(shelper, "pname", 0);
+    stringblock_append_string_safely(shelper, "size", 0);
+    stringblock_append_string_safely(shelper, "mask", 0);
+    char partn[] = "part-NN";
+    uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
+    for (uint32_t i = 0; i < pcount; ++i) {
+        dts_partn_string(partn, i);
+        stringblock_append_string_safely(shelper, partn, 0);
+    }
+}
+
+/*
+ node should have at least dts_get_partitions_node_length() bytes, and shelper
+ at least dts_get_partitions_node_strings_length() bytes of room after its length,
+ so the node and the strings can be composed in place in a bigger buffer
+*/
 int
 dts_compose_partitions_node(
-    uint8_t * * const                                   node,
-    size_t * const                                      len_node,
+    uint8_t * const                                     node,
     struct dts_phandle_list * const                     plist,
     struct dts_partitions_helper_simple const * const   phelper,
     struct stringblock_helper * const                   shelper,
     off_t const                                         offset_phandle,
     off_t const                                         offset_linux_phandle
 ){
-    if (!node || !len_node || !plist || !phelper || !shelper || !plist->entries || !plist->allocated || !phelper->partitions_count || offset_phandle < 0 || (plist->status & DTS_HAS_LINUX_PHANDLE && offset_linux_phandle < 0)) {
+    if (!node || !plist || !phelper || !shelper || !plist->bitmap || !phelper->partitions_count || offset_phandle < 0 || (plist->status & DTS_HAS_LINUX_PHANDLE && offset_linux_phandle < 0)) {
         prln_error("illegal arguments");
         return -1;
     }
-    *node = NULL;
     uint32_t const offsets[6] = {
         stringblock_append_string_safely(shelper, "parts", 0),
         stringblock_append_string_safely(shelper, "pname", 0),
@@ -1185,13 +1593,10 @@ dts_compose_partitions_node(
     struct dts_partition_entry_simple const *dentry;
     char partn[] = "part-NN";
     bool have_linux_phandle = plist->status & DTS_HAS_LINUX_PHANDLE;
-    // Basic length of the node, excluding the start BEGIN_NODE and end END_NODE, 12 for partitions\0\0\0 as name, len 16 property (4 PROP_NODE, 4 len_prop, 4 name_off, 4 u32 value) for: 1 for parts, 1 for each part-N (storing phandle), 1 for phandle, optional 1 for linux,phandle. Then basic length of the partition sub-node, 8 (4 BEGIN_NODE + 4 END_NODE) + 12 (4 PROP_NODE, 4 len_prop, 4 name_off) for 4 or 5 props (pname, size, mask, phandle, optionally linux,phandle) + 8 for u64 size + 4 for u32 mask + 4 for u32 phandle + 4 optionally for u32 linux,phandle
     uint32_t const pcount = util_safe_partitions_count(phelper->partitions_count);
-    *len_node = 12 + 16 * (1 + pcount + 1 + have_linux_phandle) + pcount * (8 + 12 * (4 + have_linux_phandle) + 8 + 4 + 4 + 4 * have_linux_phandle);
     for (uint32_t i = 0; i < pcount; ++i) {
         dentry = phelper->partitions + i;
-        memset(partn + 5, 0, 3);
-        snprintf(partn + 5, 3, "%u", i % 100);
+        dts_partn_string(partn, i);
         chelper = chelpers + i;
         chelper->len_name = strlen(dentry->name);
         chelper->len_pname = chelper->len_name + 1;
@@ -1199,16 +1604,11 @@ dts_compose_partitions_node(
         chelper->offset_partn = stringblock_append_string_safely(shelper, partn, 0);
         chelper->phandle = dts_assign_available_phandle(plist);
         chelper->phandle_be32 = bswap_32(chelper->phandle);
-        *len_node += 2 * chelper->len_node_name;
     }
     uint32_t const phandle_root = dts_assign_available_phandle(plist);
     uint32_t const phandle_root_be32 = bswap_32(phandle_root);
-    *node = malloc(*len_node); // Excluding the beginning BEGIN_NODE and endding END_NODE
-    if (!*node) {
-        return 1;
-    }
-    memcpy(*node, dts_partitions_node_start, DTS_PARTITIONS_NODE_START_LENGTH);
-    uint32_t *current = (uint32_t *)(*node + DTS_PARTITIONS_NODE_START_LENGTH);
+    memcpy(node, dts_partitions_node_start, DTS_PARTITIONS_NODE_START_LENGTH);
+    uint32_t *current = (uint32_t *)(node + DTS_PARTITIONS_NODE_START_LENGTH);
     dts_add_property_be32(&current, offsets_be32[DTS_ESSENTIAL_OFFSET_PARTS], bswap_32(pcount));
     for (uint32_t i = 0; i < pcount; ++i) {
         chelper = chelpers + i;
@@ -1223,13 +1623,13 @@ dts_compose_partitions_node(
         chelper = chelpers + i;
         // node
         *(current++) = DTS_BEGIN_NODE_ACTUAL;
-        strncpy((char *)current, dentry->name, chelper->len_pname);
+        strncpy((char *)current, dentry->name, chelper->len_node_name);
         current = (uint32_t *)((uint8_t *)current + chelper->len_node_name);
         // pname
         *(current++) = DTS_PROP_ACTUAL;
         *(current++) = bswap_32(chelper->len_pname);
         *(current++) = offsets_be32[DTS_ESSENTIAL_OFFSET_PNAME];
-        strncpy((char *)current, dentry->name, chelper->len_pname);
+        strncpy((char *)current, dentry->name, chelper->len_node_name);
         current = (uint32_t *)((uint8_t *)current + chelper->len_node_name);
         // size
         *(current++) = DTS_PROP_ACTUAL;
@@ -1250,21 +1650,6 @@ dts_compose_partitions_node(
     return 0;
 }
 
-size_t
-dts_get_node_full_length(
-    uint8_t const * const node,
-    uint32_t const         max_offset
-){
-    if (!node) {
-        return 0;
-    }
-    uint32_t const offset_child = dts_skip_node(node, max_offset);
-    if (!offset_child) {
-        return 0;
-    }
-    return 4 * (offset_child + 2);
-}
-
 int
 dts_partitions_helper_to_simple(
     struct dts_partitions_helper_simple * const simple,
@@ -1454,6 +1839,244 @@ dts_dedit_parse(
     return 0;
 }
 
+static inline
+char const *
+dts_property_value_skip_spaces(
+    char const *    literal
+){
+    while (*literal == ' ' || *literal == '\t') {
+        ++literal;
+    }
+    return literal;
+}
+
+static inline
+int
+dts_property_value_parse_string(
+    char const ** const literal,
+    uint8_t * const     value,
+    uint32_t * const    len
+){
+    char const *current = *literal + 1;
+    char byte[3] = {0};
+    for (; *current != '"'; ++current) {
+        switch (*current) {
+            case '\0':
+                prln_error("string not closed");
+                return 1;
+            case '\\':
+                switch (*++current) {
+                    case 'n':
+                        value[(*len)++] = '\n';
+                        break;
+                    case 't':
+                        value[(*len)++] = '\t';
+                        break;
+                    case 'r':
+                        value[(*len)++] = '\r';
+                        break;
+                    case '\\':
+                    case '"':
+                        value[(*len)++] = *current;
+                        break;
+                    case 'x':
+                        if (!isxdigit(current[1])) {
+                            prln_error("\\x not followed by hex digits");
+                            return 2;
+                        }
+                        byte[0] = current[1];
+                        byte[1] = isxdigit(current[2]) ? current[2] : '\0';
+                        value[(*len)++] = strtoul(byte, NULL, 16);
+                        current += byte[1] ? 2 : 1;
+                        break;
+                    default:
+                        prln_error("unknown escape sequence \\%c", *current);
+                        return 3;
+                }
+                break;
+            default:
+                value[(*len)++] = *current;
+                break;
+        }
+    }
+    value[(*len)++] = '\0';
+    *literal = current + 1;
+    return 0;
+}
+
+static inline
+int
+dts_property_value_parse_cells(
+    char const ** const literal,
+    uint8_t * const     value,
+    uint32_t * const    len
+){
+    char const *current = dts_property_value_skip_spaces(*literal + 1);
+    char *end;
+    unsigned long cell;
+    while (*current != '>') {
+        if (!isdigit(*current)) {
+            prln_error("cells not closed or containing non-numbers");
+            return 1;
+        }
+        cell = strtoul(current, &end, 0);
+        if (cell > UINT32_MAX || (*end != ' ' && *end != '\t' && *end != '>')) {
+            prln_error("illegal cell '%.*s'", (int)(end - current), current);
+            return 2;
+        }
+        *(uint32_t *)(value + *len) = bswap_32(cell);
+        *len += 4;
+        current = dts_property_value_skip_spaces(end);
+    }
+    *literal = current + 1;
+    return 0;
+}
+
+static inline
+int
+dts_property_value_parse_bytes(
+    char const ** const literal,
+    uint8_t * const     value,
+    uint32_t * const    len
+){
+    char const *current = dts_property_value_skip_spaces(*literal + 1);
+    char byte[3] = {0};
+    while (*current != ']') {
+        if (!isxdigit(current[0]) || !isxdigit(current[1])) {
+            prln_error("bytes not closed or not in pairs of hex digits");
+            return 1;
+        }
+        byte[0] = current[0];
+        byte[1] = current[1];
+        value[(*len)++] = strtoul(byte, NULL, 16);
+        current = dts_property_value_skip_spaces(current + 2);
+    }
+    *literal = current + 1;
+    return 0;
+}
+
+/* 
+ Values are written the way dtc would and dquery prints them, e.g. "a", "b" for 
+ strings, <0x1 2> for cells, [01 ab] for bytes, these can be mixed with ',',
+ and an empty value makes an empty property
+*/
+static inline
+int
+dts_property_value_parse(
+    struct dts_property_edit * const    edit,
+    char const *                        literal
+){
+    literal = dts_property_value_skip_spaces(literal);
+    // Output never takes more than 2 bytes per char, e.g. <1 2> to 8 bytes
+    if (!(edit->value = malloc(2 * strlen(literal) + 1))) {
+        prln_error_with_errno("failed to allocate memory for property value");
+        return -1;
+    }
+    edit->len = 0;
+    int r;
+    while (*literal) {
+        switch (*literal) {
+            case '"':
+                r = dts_property_value_parse_string(&literal, edit->value, &edit->len);
+                break;
+            case '<':
+                r = dts_property_value_parse_cells(&literal, edit->value, &edit->len);
+                break;
+            case '[':
+                r = dts_property_value_parse_bytes(&literal, edit->value, &edit->len);
+                break;
+            default:
+                prln_error("value must be strings in \"\", cells in <> or bytes in [], but it starts with '%c'", *literal);
+                r = 1;
+                break;
+        }
+        if (r) {
+            return r;
+        }
+        literal = dts_property_value_skip_spaces(literal);
+        if (*literal == ',') {
+            literal = dts_property_value_skip_spaces(literal + 1);
+            if (!*literal) {
+                prln_error("value ends with ','");
+                return 2;
+            }
+        } else if (*literal) {
+            prln_error("garbage '%s' after value", literal);
+            return 3;
+        }
+    }
+    return 0;
+}
+
+void
+dts_property_edits_free(
+    struct dts_property_edit * const    edits,
+    int const                           count
+){
+    if (!edits) {
+        return;
+    }
+    for (int i = 0; i < count; ++i) {
+        free(edits[i].name);
+        free(edits[i].value);
+        edits[i].name = NULL;
+        edits[i].value = NULL;
+    }
+}
+
+/*
+ Each edit is either /path/to/node/property=value to set the property, adding it if
+ it does not exist yet, or /path/to/node/property? to delete it
+*/
+int
+dts_property_edits_parse(
+    struct dts_property_edit * const    edits,
+    int const                           argc,
+    char const * const * const          argv
+){
+    if (!edits || argc <= 0 || !argv) {
+        prln_error("illegal arguments");
+        return -1;
+    }
+    memset(edits, 0, sizeof *edits * argc);
+    char const *arg, *equal, *slash;
+    size_t len_full;
+    struct dts_property_edit *edit;
+    for (int i = 0; i < argc; ++i) {
+        arg = argv[i];
+        edit = edits + i;
+        if ((equal = strchr(arg, '='))) {
+            len_full = equal - arg;
+        } else {
+            len_full = strlen(arg);
+            if (!len_full || arg[len_full - 1] != '?') {
+                prln_error("edit '%s' neither sets a value with = nor deletes with ?", arg);
+                dts_property_edits_free(edits, i);
+                return 1;
+            }
+            --len_full;
+        }
+        if (arg[0] != '/' || !(slash = memrchr(arg, '/', len_full)) || slash + 1 == arg + len_full) {
+            prln_error("edit '%s' does not have an absolute path ending with property name", arg);
+            dts_property_edits_free(edits, i);
+            return 2;
+        }
+        edit->path = arg;
+        edit->len_path = slash == arg ? 1 : (size_t)(slash - arg);
+        if (!(edit->name = strndup(slash + 1, arg + len_full - slash - 1))) {
+            prln_error_with_errno("failed to duplicate property name");
+            dts_property_edits_free(edits, i);
+            return 3;
+        }
+        if (equal && dts_property_value_parse(edit, equal + 1)) {
+            prln_error("failed to parse value of edit '%s'", arg);
+            dts_property_edits_free(edits, i + 1);
+            return 4;
+        }
+    }
+    return 0;
+}
+
 int
 dts_valid_partitions_simple(
     struct dts_partitions_helper_simple const * const   dparts
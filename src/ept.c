@@ -10,6 +10,7 @@
 
 /* Local */
 
+#include "checksum.h"
 #include "cli.h"
 #include "io.h"
 #include "parg.h"
@@ -136,16 +137,11 @@ ept_checksum_partitions(
     struct ept_partition const * const  partitions, 
     int const                           partitions_count
 ){
-    int i, j;
-    uint32_t checksum = 0, *p;
-    for (i = 0; i < partitions_count; i++) { // This is utterly wrong, but it's how amlogic does. So we have to stick with the glitch algorithm that only calculates 1 partition if we want ampart to work
-        p = (uint32_t *)partitions;
-        for (j = sizeof(struct ept_partition)/4; j > 0; --j) {
-            checksum += *p;
-            p++;
-        }
+    // This is utterly wrong, but it's how amlogic does: the first partition is summed partitions_count times. So we have to stick with the glitch algorithm if we want ampart to work, but it can be a multiplication instead of the loop
+    if (partitions_count <= 0) {
+        return 0;
     }
-    return checksum;
+    return checksum_sum32(partitions, sizeof *partitions / 4) * (uint32_t)partitions_count;
 }
 
 void
@@ -10,6 +10,7 @@
 /* Local */
 
 #include "common.h"
+#include "pool.h"
 #include "util.h"
 
 /* Definition */
@@ -22,9 +23,87 @@
 #define GZIP_FILE_FLAG_RESERVED 0b11100000U
 #define GZIP_DEFAULT_MEM_LEVEL  8U
 #define GZIP_WRAPPER            16U // Add this to the window bit will cause it to wrap around and use a gzip container
+#define GZIP_TRAILER_SIZE       8U  // CRC32 and ISIZE, both little endian
+#define GZIP_TRAILER_SEARCH     8U  // Trailing bytes of the trailer could be 0 and blend into the zero padding after it
+#define GZIP_RATIO_MAXIMUM      1032U   // Deflate can not do better than this
+#define GZIP_ISIZE_MAXIMUM      0x10000000U // 256M, way beyond any sane DTB
+#define GZIP_SEARCH_LEVELS      9U
+#define GZIP_SEARCH_MEM_LEVELS  2U  // 8 and 9
+#define GZIP_SEARCH_CANDIDATES  ((GZIP_SEARCH_LEVELS * 2U + 1U) * GZIP_SEARCH_MEM_LEVELS) // Default and filtered strategy for each level, RLE ignores level
+
+/* Structure */
+
+struct
+    gzip_candidate {
+        int         level;
+        int         mem_level;
+        int         strategy;
+        size_t      size;   // 0 if failed
+        uint64_t    time;   // CPU time in ns
+        uint8_t *   out;    // Kept until it is known whether this is the best one
+    };
+
+struct
+    gzip_search {
+        uint8_t *               in;
+        size_t                  in_size;
+        uint32_t                mtime;  // Put into the header, so candidates only differ by how they compress
+        unsigned                first;  // Of the batch being run
+        struct gzip_candidate   candidates[GZIP_SEARCH_CANDIDATES];
+    };
+
+/* Variable */
+
+char const  gzip_strategy_strings[][9] = {
+    "default",
+    "filtered",
+    "huffman",
+    "rle",
+    "fixed"
+};
 
 /* Function */
 
+static inline
+uint32_t
+gzip_get_le32(
+    uint8_t const * const   data
+){
+    return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+/*
+ The input could be followed by zero padding (e.g. the rest of the DTB partition),
+ so the trailer is not necessarily at its end. Every position the trailer could end
+ at is tried, and the smallest ISIZE that is possible for the compressed data size
+ is taken, as a window shifted into the padding yields a far too small one, and a
+ window shifted into CRC32 a far too large one
+*/
+static inline
+size_t
+gzip_guess_isize(
+    uint8_t const * const   in,
+    size_t const            in_size
+){
+    size_t last = in_size;
+    while (last && !in[last - 1]) {
+        --last;
+    }
+    size_t isize = 0;
+    size_t isize_candidate, size_compressed;
+    for (size_t end = last + 1; end <= in_size && end <= last + GZIP_TRAILER_SEARCH; ++end) {
+        if (end < GZIP_TRAILER_SIZE + 2) {
+            continue;
+        }
+        size_compressed = end - GZIP_TRAILER_SIZE;
+        isize_candidate = gzip_get_le32(in + end - 4);
+        if (isize_candidate >= size_compressed / 2 && isize_candidate <= size_compressed * GZIP_RATIO_MAXIMUM && isize_candidate <= GZIP_ISIZE_MAXIMUM && (!isize || isize_candidate < isize)) {
+            isize = isize_candidate;
+        }
+    }
+    return isize;
+}
+
 static inline 
 size_t 
 gzip_unzip_no_header(
@@ -32,8 +111,13 @@ gzip_unzip_no_header(
     size_t const        in_size,
     uint8_t * * const   out
 ){
-    size_t allocated_size = util_nearest_upper_bound_with_multiply_ulong(in_size, 64, 4); // 4 times the size, nearest multiply of 64
-    prln_info("decompressing raw deflated data, in size %ld, allocated %ld", in_size, allocated_size);
+    size_t allocated_size = gzip_guess_isize(in, in_size);
+    if (allocated_size) {
+        prln_info("decompressing raw deflated data, in size %ld, allocated %ld as recorded in trailer", in_size, allocated_size);
+    } else {
+        allocated_size = util_nearest_upper_bound_with_multiply_ulong(in_size, 64, 4); // 4 times the size, nearest multiply of 64
+        prln_warn("no sane size recorded in trailer, decompressing raw deflated data, in size %ld, allocated %ld", in_size, allocated_size);
+    }
     *out = malloc(allocated_size);
     if (!*out) {
         prln_error_with_errno("failed to allocate memory for decompression");
@@ -54,14 +138,33 @@ gzip_unzip_no_header(
     s.next_out = *out;
     s.avail_out = allocated_size;
     uint8_t *temp_buffer;
+    size_t out_size;
     int r;
     while (true) {
         r = inflate(&s, Z_FINISH);
         switch (r) {
             case Z_STREAM_END:
                 inflateEnd(&s);
-                return s.next_out - *out;
+                out_size = s.next_out - *out;
+                if (s.avail_in < GZIP_TRAILER_SIZE) {
+                    prln_error("gzip trailer truncated");
+                    break;
+                }
+                if (gzip_get_le32(s.next_in + 4) != (uint32_t)out_size) {
+                    prln_error("decompressed size 0x%lx does not match size recorded in trailer 0x%"PRIx32, out_size, gzip_get_le32(s.next_in + 4));
+                    break;
+                }
+                if (gzip_get_le32(s.next_in) != crc32(crc32(0, Z_NULL, 0), *out, out_size)) {
+                    prln_error("CRC32 of decompressed data does not match CRC32 recorded in trailer");
+                    break;
+                }
+                return out_size;
             case Z_BUF_ERROR:
+                if (s.avail_out) { // Not stuck on the output, the input ran out
+                    inflateEnd(&s);
+                    prln_error("deflated data truncated");
+                    break;
+                }
                 s.avail_out += allocated_size;
                 allocated_size *= 2;
                 temp_buffer = realloc(*out, allocated_size);
@@ -69,21 +172,20 @@ gzip_unzip_no_header(
                     s.next_out = temp_buffer + (s.next_out - *out);
                     *out = temp_buffer;
                     prln_warn("re-allocated memory, now %lu", allocated_size);
+                    continue;
                 } else {
-                    free(*out);
-                    *out = NULL;
                     inflateEnd(&s);
                     prln_error_with_errno("failed to reallocate memory for decompression");
-                    return 0;
+                    break;
                 }
-                break;
             default:
-                free(*out);
-                *out = NULL;
                 inflateEnd(&s);
                 prln_error("unknown error when decompressing, errno: %d", r);
-                return 0;
+                break;
         }
+        free(*out);
+        *out = NULL;
+        return 0;
     }
 }
 
@@ -135,28 +237,33 @@ gzip_unzip(
     return gzip_unzip_no_header(in+offset, in_size-offset, out);
 }
 
+static inline
 size_t
-gzip_zip(
+gzip_zip_with(
     uint8_t * const     in,
     size_t const        in_size,
-    uint8_t * * const   out
+    uint8_t * * const   out,
+    int const           level,
+    int const           mem_level,
+    int const           strategy,
+    uint32_t const      mtime,
+    bool const          verbose
 ){
+    *out = NULL;
     z_stream s;
     s.zalloc = Z_NULL;
     s.zfree = Z_NULL;
     s.opaque = Z_NULL;
-    if (deflateInit2(&s, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + GZIP_WRAPPER, GZIP_DEFAULT_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
-        free(*out);
-        *out = NULL;
+    if (deflateInit2(&s, level, Z_DEFLATED, MAX_WBITS + GZIP_WRAPPER, mem_level, strategy) != Z_OK) {
         prln_error("failed to initialize deflation for compression");
         return 0;
     }
     size_t allocated_size = deflateBound(&s, in_size);
-    prln_error("compressing data to gzip, size %ld, allocated %ld", in_size, allocated_size);
+    if (verbose) {
+        prln_error("compressing data to gzip, size %ld, allocated %ld", in_size, allocated_size);
+    }
     *out = malloc(allocated_size);
     if (!*out) {
-        free(*out);
-        *out = NULL;
         deflateEnd(&s);
         prln_error("failed to allocate memory for compression");
         return 0;
@@ -168,7 +275,7 @@ gzip_zip(
     int r = deflate(&s, Z_FINISH);
     deflateEnd(&s);
     if (r == Z_STREAM_END) {
-        *(uint32_t *)(*out + 4) = time(NULL);
+        *(uint32_t *)(*out + 4) = mtime;
         return s.next_out - *out;
     } else {
         free(*out);
@@ -178,4 +285,135 @@ gzip_zip(
     }
 }
 
+size_t
+gzip_zip(
+    uint8_t * const     in,
+    size_t const        in_size,
+    uint8_t * * const   out
+){
+    return gzip_zip_with(in, in_size, out, Z_DEFAULT_COMPRESSION, GZIP_DEFAULT_MEM_LEVEL, Z_DEFAULT_STRATEGY, time(NULL), true);
+}
+
+static inline
+uint64_t
+gzip_thread_time(){
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts)) {
+        return 0;
+    }
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static
+void
+gzip_search_try(
+    void * const    search_void,
+    unsigned const  index
+){
+    struct gzip_search *const search = search_void;
+    struct gzip_candidate *const candidate = search->candidates + search->first + index;
+    uint64_t const time_start = gzip_thread_time();
+    candidate->size = gzip_zip_with(search->in, search->in_size, &candidate->out, candidate->level, candidate->mem_level, candidate->strategy, search->mtime, false);
+    candidate->time = gzip_thread_time() - time_start;
+}
+
+/*
+ Candidates are ordered roughly from the fastest to the slowest, so when speed
+ is preferred they are tried batch by batch (one candidate per thread) and the
+ search stops at the first batch that produces something fitting
+*/
+static inline
+void
+gzip_search_init(
+    struct gzip_search * const  search
+){
+    struct gzip_candidate *candidate = search->candidates;
+    for (unsigned mem_level = 0; mem_level < GZIP_SEARCH_MEM_LEVELS; ++mem_level) {
+        candidate->level = Z_DEFAULT_COMPRESSION;
+        candidate->mem_level = GZIP_DEFAULT_MEM_LEVEL + mem_level;
+        (candidate++)->strategy = Z_RLE;
+    }
+    for (int level = 1; level <= (int)GZIP_SEARCH_LEVELS; ++level) {
+        for (unsigned mem_level = 0; mem_level < GZIP_SEARCH_MEM_LEVELS; ++mem_level) {
+            candidate->level = level;
+            candidate->mem_level = GZIP_DEFAULT_MEM_LEVEL + mem_level;
+            (candidate++)->strategy = Z_DEFAULT_STRATEGY;
+            candidate->level = level;
+            candidate->mem_level = GZIP_DEFAULT_MEM_LEVEL + mem_level;
+            (candidate++)->strategy = Z_FILTERED;
+        }
+    }
+}
+
+size_t
+gzip_zip_search(
+    uint8_t * const             in,
+    size_t const                in_size,
+    uint8_t * * const           out,
+    size_t const                size_max,
+    enum gzip_preference const  preference,
+    unsigned const              threads,
+    uint32_t const              mtime
+){
+    *out = NULL;
+    if (preference == GZIP_PREFER_NONE) {
+        return gzip_zip_with(in, in_size, out, Z_DEFAULT_COMPRESSION, GZIP_DEFAULT_MEM_LEVEL, Z_DEFAULT_STRATEGY, mtime, true);
+    }
+    struct gzip_search search = {
+        .in = in,
+        .in_size = in_size,
+        .mtime = mtime
+    };
+    gzip_search_init(&search);
+    unsigned const batch = preference == GZIP_PREFER_SPEED ? pool_get_threads(threads) : GZIP_SEARCH_CANDIDATES;
+    struct gzip_candidate const *best = NULL;
+    struct gzip_candidate const *best_last;
+    struct gzip_candidate const *candidate;
+    for (search.first = 0; search.first < GZIP_SEARCH_CANDIDATES; search.first += batch) {
+        unsigned const count = search.first + batch > GZIP_SEARCH_CANDIDATES ? GZIP_SEARCH_CANDIDATES - search.first : batch;
+        if (pool_run(count, threads, gzip_search_try, &search)) {
+            prln_error("failed to run compression candidates");
+            for (unsigned i = 0; i < search.first + count; ++i) {
+                free(search.candidates[i].out);
+            }
+            return 0;
+        }
+        best_last = best;
+        for (unsigned i = search.first; i < search.first + count; ++i) {
+            candidate = search.candidates + i;
+            if (!candidate->size) {
+                continue;
+            }
+            if (!best) {
+                best = candidate;
+            } else if (preference == GZIP_PREFER_SPEED && candidate->size <= size_max) {
+                if (best->size > size_max || candidate->time < best->time) {
+                    best = candidate;
+                }
+            } else if (candidate->size < best->size) {
+                best = candidate;
+            }
+        }
+        /* Only the output of the best one so far is kept */
+        if (best_last && best_last != best) {
+            free(best_last->out);
+        }
+        for (unsigned i = search.first; i < search.first + count; ++i) {
+            if (search.candidates + i != best) {
+                free(search.candidates[i].out);
+            }
+        }
+        if (preference == GZIP_PREFER_SPEED && best && best->size <= size_max) {
+            break;
+        }
+    }
+    if (!best) {
+        prln_error("all compression candidates failed");
+        return 0;
+    }
+    prln_info("chose level %d, memLevel %d, %s strategy, compressed size 0x%lx, took %"PRIu64"us", best->level, best->mem_level, gzip_strategy_strings[best->strategy], best->size, best->time / 1000);
+    *out = best->out;
+    return best->size;
+}
+
 /* gzip.c: Compressing and decompressing GZIP format stream */
\ No newline at end of file
@@ -26,6 +26,18 @@
 #include "gzip.h"
 #include "ept.h"
 
+/* Definition */
+
+#define IO_LOGICAL_BLOCK_SIZE_DEFAULT   0x200U  // Used for regular files, and when the device does not tell
+
+/* Variable */
+
+char const  io_commit_stage_strings[][11] = {
+    "DTB",
+    "DTB backup",
+    "EPT"
+};
+
 /* Function */
 
 static inline
@@ -67,6 +79,33 @@ io_read_till_finish(
     return 0;
 }
 
+/* Unlike io_read_till_finish(), the file offset is not touched, and reaching EOF early is an error */
+int
+io_pread_till_finish(
+    int const   fd,
+    void *      buffer,
+    size_t      size,
+    off_t       offset
+){
+    ssize_t r;
+    while (size) {
+        do {
+            r = pread(fd, buffer, size, offset);
+        } while (r == -1 && io_can_retry(errno));
+        if (r == -1) {
+            return 1;
+        }
+        if (!r) {
+            prln_error("unexpected EOF at offset 0x%lx", offset);
+            return 2;
+        }
+        size -= r;
+        offset += r;
+        buffer = (unsigned char *)buffer + r;
+    }
+    return 0;
+}
+
 int 
 io_write_till_finish(
     int const   fd,
@@ -87,6 +126,113 @@ io_write_till_finish(
     return 0;
 }
 
+/* Unlike io_write_till_finish(), the file offset is not touched */
+static inline
+int
+io_pwrite_till_finish(
+    int const           fd,
+    void const *        buffer,
+    size_t              size,
+    off_t               offset
+){
+    ssize_t r;
+    while (size) {
+        do {
+            r = pwrite(fd, buffer, size, offset);
+        } while (r == -1 && io_can_retry(errno));
+        if (r == -1) {
+            return 1;
+        }
+        size -= r;
+        offset += r;
+        buffer = (uint8_t const *)buffer + r;
+    }
+    return 0;
+}
+
+static inline
+size_t
+io_get_logical_block_size(
+    int const   fd
+){
+    struct stat st;
+    int size;
+    if (!fstat(fd, &st) && S_ISBLK(st.st_mode) && !ioctl(fd, BLKSSZGET, &size) && size > 0) {
+        return size;
+    }
+    return IO_LOGICAL_BLOCK_SIZE_DEFAULT;
+}
+
+/*
+ The range is read back first and only the logical blocks that differ are written,
+ anything past EOF counts as differing. written could be NULL if not interested
+*/
+int
+io_write_differing(
+    int const           fd,
+    void const * const  buffer,
+    size_t const        size,
+    off_t const         offset,
+    size_t * const      written
+){
+    if (written) {
+        *written = 0;
+    }
+    if (!size) {
+        return 0;
+    }
+    uint8_t *const old = malloc(size);
+    if (!old) {
+        prln_error_with_errno("failed to allocate memory for on-disk content");
+        return 1;
+    }
+    size_t size_old = 0;
+    ssize_t r;
+    while (size_old < size) {
+        do {
+            r = pread(fd, old + size_old, size - size_old, offset + size_old);
+        } while (r == -1 && io_can_retry(errno));
+        if (r == -1) {
+            prln_error("failed to read on-disk content at offset 0x%lx", offset + size_old);
+            free(old);
+            return 2;
+        }
+        if (!r) {
+            break;
+        }
+        size_old += r;
+    }
+    size_t const block = io_get_logical_block_size(fd);
+    uint8_t const *const new = buffer;
+    size_t start, end, len;
+    size_t total = 0;
+    for (start = 0; start < size; start = end) {
+        len = size - start < block ? size - start : block;
+        if (start + len <= size_old && !memcmp(new + start, old + start, len)) {
+            end = start + len;
+            continue;
+        }
+        for (end = start + len; end < size; end += len) {
+            len = size - end < block ? size - end : block;
+            if (end + len <= size_old && !memcmp(new + end, old + end, len)) {
+                break;
+            }
+        }
+        if (io_pwrite_till_finish(fd, new + start, end - start, offset + start)) {
+            prln_error("failed to write to offset 0x%lx", offset + start);
+            free(old);
+            return 3;
+        }
+        total += end - start;
+    }
+    free(old);
+    prln_info("wrote 0x%lx of 0x%lx bytes at offset 0x%lx, the rest are the same on disk", total, size, offset);
+    if (written) {
+        *written = total;
+    }
+    return 0;
+}
+
 char *
 io_find_disk(
     char const * const  path
@@ -398,24 +544,28 @@ io_identify_target_type(
 }
 
 off_t
-io_seek_dtb(
-    int const   fd
-){
-    off_t offset;
+io_get_dtb_offset(){
     switch (cli_options.content) {
         case CLI_CONTENT_TYPE_DTB:
-            offset = 0;
-            break;
+            return 0;
         case CLI_CONTENT_TYPE_RESERVED:
-            offset = cli_options.offset_dtb;
-            break;
+            return cli_options.offset_dtb;
         case CLI_CONTENT_TYPE_DISK:
-            offset = cli_options.offset_reserved + cli_options.offset_dtb;
-            break;
+            return cli_options.offset_reserved + cli_options.offset_dtb;
         default:
             prln_error("ilegal target content type (auto), this should not happen");
             return -1;
     }
+}
+
+off_t
+io_seek_dtb(
+    int const   fd
+){
+    off_t offset = io_get_dtb_offset();
+    if (offset < 0) {
+        return -1;
+    }
     prln_info("seeking to %ld", offset);
     if ((offset = lseek(fd, offset, SEEK_SET)) < 0) {
         prln_error_with_errno("failed to seek for DTB");
@@ -425,21 +575,26 @@ io_seek_dtb(
 }
 
 off_t
-io_seek_ept(
-    int const   fd
-){
-    off_t offset;
+io_get_ept_offset(){
     switch (cli_options.content) {
         case CLI_CONTENT_TYPE_RESERVED:
-            offset = 0;
-            break;
+            return 0;
         case CLI_CONTENT_TYPE_DISK:
-            offset = cli_options.offset_reserved;
-            break;
+            return cli_options.offset_reserved;
         default:
             prln_error("ilegal target content type (%s), this should not happen", cli_mode_strings[cli_options.content]);
             return -1;
     }
+}
+
+off_t
+io_seek_ept(
+    int const   fd
+){
+    off_t offset = io_get_ept_offset();
+    if (offset < 0) {
+        return -1;
+    }
     prln_info("seeking to %ld", offset);
     if ((offset = lseek(fd, offset, SEEK_SET)) < 0) {
         prln_error_with_errno("failed to seek for EPT");
@@ -590,4 +745,110 @@ io_rereadpart(
     return 0;
 }
 
+void
+io_commit_set_stage(
+    struct io_commit * const        commit,
+    enum io_commit_stages const     stage,
+    void * const                    buffer,
+    size_t const                    size,
+    off_t const                     offset,
+    bool const                      owned
+){
+    struct io_commit_stage *const cstage = commit->stages + stage;
+    if (cstage->owned) {
+        free(cstage->buffer);
+    }
+    cstage->buffer = buffer;
+    cstage->size = size;
+    cstage->offset = offset;
+    cstage->owned = owned;
+    cstage->truncate = false;
+}
+
+void
+io_commit_free(
+    struct io_commit * const    commit
+){
+    for (unsigned i = 0; i < IO_COMMIT_STAGE_COUNT; ++i) {
+        if (commit->stages[i].owned) {
+            free(commit->stages[i].buffer);
+        }
+    }
+    if (commit->migrate) {
+        free(commit->mhelper.entries);
+    }
+    memset(commit, 0, sizeof *commit);
+}
+
+/* 
+ Crash-safe order with as few flushes as possible: the data is migrated and
+ flushed first so the new EPT never points to data not there yet, the DTB is
+ flushed before its backup copy so at least one copy is always intact, and the
+ EPT goes along with the backup copy as u-boot rebuilds it from the DTB when
+ they mismatch anyway. Flushes are skipped if nothing was written since the last
+ one. Returns 1 + stage on failure, or 1 + IO_COMMIT_STAGE_COUNT on migration failure
+*/
+int
+io_commit_run(
+    struct io_commit * const    commit,
+    int const                   fd,
+    size_t * const              written
+){
+    if (!commit || fd < 0) {
+        return -1;
+    }
+    size_t written_stage;
+    unsigned last = 0;
+    bool dirty = false;
+    *written = 0;
+    if (commit->migrate) {
+        commit->mhelper.fd = fd;
+        if (io_migrate(&commit->mhelper)) {
+            prln_error("failed to commit: migration failed");
+            return 1 + IO_COMMIT_STAGE_COUNT;
+        }
+        if (fdatasync(fd)) {
+            prln_error_with_errno("failed to commit: flush after migration failed");
+            return 1 + IO_COMMIT_STAGE_COUNT;
+        }
+    }
+    struct io_commit_stage const *cstage;
+    struct stat st;
+    for (unsigned i = 0; i < IO_COMMIT_STAGE_COUNT; ++i) {
+        cstage = commit->stages + i;
+        if (!cstage->size) {
+            continue;
+        }
+        last = i;
+        prln_info("committing %s, size 0x%lx, offset 0x%lx", io_commit_stage_strings[i], cstage->size, cstage->offset);
+        if (io_write_differing(fd, cstage->buffer, cstage->size, cstage->offset, &written_stage)) {
+            prln_error("failed to commit %s: write failed", io_commit_stage_strings[i]);
+            return 1 + i;
+        }
+        if (written_stage) {
+            *written += written_stage;
+            dirty = true;
+        }
+        if (cstage->truncate && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size != (off_t)(cstage->offset + cstage->size)) {
+            if (ftruncate(fd, cstage->offset + cstage->size)) {
+                prln_error_with_errno("failed to commit %s: truncate failed", io_commit_stage_strings[i]);
+                return 1 + i;
+            }
+            dirty = true;
+        }
+        if (i == IO_COMMIT_STAGE_DTB && commit->stages[IO_COMMIT_STAGE_DTB_BACKUP].size && dirty) {
+            if (fdatasync(fd)) {
+                prln_error_with_errno("failed to commit %s: flush failed", io_commit_stage_strings[i]);
+                return 1 + i;
+            }
+            dirty = false;
+        }
+    }
+    if (dirty && fsync(fd)) {
+        prln_error_with_errno("failed to commit %s: flush failed", io_commit_stage_strings[last]);
+        return 1 + last;
+    }
+    return 0;
+}
+
 /* io.c: IO-related functions, type-recognition is also here */
\ No newline at end of file
@@ -0,0 +1,123 @@
+/* Self */
+
+#include "pool.h"
+
+/* System */
+
+#include <pthread.h>
+#include <unistd.h>
+
+/* Structure */
+
+struct
+    pool_log {
+        char *  buffer;
+        size_t  size;
+    };
+
+struct
+    pool_job {
+        void            (*function)(void *context, unsigned index);
+        void *          context;
+        struct pool_log *logs;  // Optional, logs of each index are kept here to be printed in order
+        unsigned        count;
+        unsigned        next;   // Taken atomically by workers
+    };
+
+/* Variable */
+
+__thread FILE * prln_stream = NULL;
+
+/* Function */
+
+unsigned
+pool_get_threads(
+    unsigned const  threads
+){
+    if (threads) {
+        return threads > POOL_THREADS_MAXIMUM ? POOL_THREADS_MAXIMUM : threads;
+    }
+    long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return (unsigned long)cpus > POOL_THREADS_MAXIMUM ? POOL_THREADS_MAXIMUM : (unsigned)cpus;
+}
+
+static
+void *
+pool_worker(
+    void * const    job_void
+){
+    struct pool_job *const job = job_void;
+    FILE *const stream = prln_stream;
+    unsigned index;
+    while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+        if (job->logs && (prln_stream = open_memstream(&job->logs[index].buffer, &job->logs[index].size))) {
+            job->function(job->context, index);
+            fclose(prln_stream);
+        } else {
+            job->function(job->context, index);
+        }
+        prln_stream = stream;
+    }
+    return NULL;
+}
+
+/*
+ Run function for index 0 to count - 1, on at most threads threads (0 for CPU count),
+ the calling thread being one of them. Each index is run exactly once, but in no
+ particular order, so results should go into per-index slots of context. When run on
+ multiple threads, logs of each index are held back and printed in index order after all
+*/
+int
+pool_run(
+    unsigned const  count,
+    unsigned const  threads,
+    void            (*function)(void *context, unsigned index),
+    void * const    context
+){
+    if (!function) {
+        prln_error("illegal arguments");
+        return -1;
+    }
+    struct pool_job job = {
+        .function = function,
+        .context = context,
+        .logs = NULL,
+        .count = count,
+        .next = 0
+    };
+    unsigned workers = pool_get_threads(threads);
+    if (workers > count) {
+        workers = count;
+    }
+    if (workers > 1 && !(job.logs = calloc(count, sizeof *job.logs))) {
+        prln_warn("failed to allocate memory for logs, they will be printed out of order");
+    }
+    pthread_t handles[POOL_THREADS_MAXIMUM];
+    unsigned started = 0;
+    for (; started + 1 < workers; ++started) {
+        if (pthread_create(handles + started, NULL, pool_worker, &job)) {
+            prln_warn("failed to create worker thread %u, continuing with %u", started + 1, started + 1);
+            break;
+        }
+    }
+    pool_worker(&job);
+    for (unsigned i = 0; i < started; ++i) {
+        pthread_join(handles[i], NULL);
+    }
+    if (job.logs) {
+        FILE *const stream = prln_stream ? prln_stream : stderr;
+        for (unsigned i = 0; i < count; ++i) {
+            if (job.logs[i].buffer) {
+                fwrite(job.logs[i].buffer, 1, job.logs[i].size, stream);
+                free(job.logs[i].buffer);
+            }
+        }
+        free(job.logs);
+    }
+    return 0;
+}
+
+/* pool.c: minimal worker pool running independent jobs on multiple threads */
@@ -1,9 +1,14 @@
 #include <assert.h>
 
+#include <linux/dm-ioctl.h>
+
+#include "dm.h"
 #include "dtb.h"
 #include "ept.h"
 #include "gzip.h"
 
+static_assert(sizeof(((struct dm_linear_device *)0)->name) <= DM_NAME_LEN, "Name of dm-linear device does not fit in device-mapper");
+
 static_assert(sizeof(struct dtb_header) == 40, "Size of struct DTB header is not 40");
 
 static_assert(sizeof(struct dtb_partition) == DTB_PARTITION_SIZE, "Size of dtb partition is not 256K");
@@ -10,6 +10,11 @@
 
 #include "util.h"
 
+/* Definition */
+
+#define STRINGBLOCK_INDEX_MINIMUM   64U     // Must be power of 2
+#define STRINGBLOCK_HASH_MULTIPLIER 0x01000193U
+
 /* Function */
 
 off_t
@@ -34,12 +39,142 @@ stringblock_find_string_raw(
     return -1;
 }
 
+/*
+ The hash of a string is computed from its end, so that while walking the
+ stringblock backwards the hash of every suffix comes in O(1) from the one after it
+*/
+static inline
+uint32_t
+stringblock_hash_step(
+    uint32_t const  hash,
+    char const      c
+){
+    return (uint8_t)c + hash * STRINGBLOCK_HASH_MULTIPLIER;
+}
+
+static inline
+uint32_t
+stringblock_hash(
+    char const * const  string
+){
+    uint32_t hash = 0;
+    for (size_t i = strlen(string); i; --i) {
+        hash = stringblock_hash_step(hash, string[i - 1]);
+    }
+    return hash;
+}
+
+static inline
+struct stringblock_index_entry *
+stringblock_index_probe(
+    struct stringblock_index const * const  index,
+    char const * const                      sblock,
+    uint32_t const                          hash,
+    char const * const                      string
+){
+    struct stringblock_index_entry *entry;
+    for (uint32_t i = hash & (index->allocated - 1); ; i = (i + 1) & (index->allocated - 1)) {
+        entry = index->entries + i;
+        if (entry->offset < 0 || (entry->hash == hash && !strcmp(sblock + entry->offset, string))) {
+            return entry;
+        }
+    }
+}
+
+static inline
+int
+stringblock_index_resize(
+    struct stringblock_index * const    index,
+    char const * const                  sblock,
+    uint32_t const                      allocated
+){
+    struct stringblock_index_entry *const entries_old = index->entries;
+    uint32_t const allocated_old = index->allocated;
+    if (!(index->entries = index->arena ? arena_alloc(index->arena, allocated * sizeof *index->entries) : malloc(allocated * sizeof *index->entries))) {
+        prln_error_with_errno("failed to allocate memory for stringblock index");
+        index->entries = entries_old;
+        return 1;
+    }
+    for (uint32_t i = 0; i < allocated; ++i) {
+        index->entries[i].offset = -1;
+    }
+    index->allocated = allocated;
+    for (uint32_t i = 0; i < allocated_old; ++i) {
+        if (entries_old[i].offset >= 0) {
+            *stringblock_index_probe(index, sblock, entries_old[i].hash, sblock + entries_old[i].offset) = entries_old[i];
+        }
+    }
+    if (!index->arena) {
+        free(entries_old);
+    }
+    return 0;
+}
+
+/*
+ Every suffix of every string is indexed, as a lookup could match the tail of a
+ longer string, e.g. phandle in linux,phandle. Like the plain scan, the lowest
+ offset wins for duplicates
+*/
+static inline
+int
+stringblock_index_update(
+    struct stringblock_helper const * const shelper
+){
+    struct stringblock_index *const index = shelper->index;
+    char const *const sblock = shelper->stringblock;
+    if (!index->entries || (uint64_t)(index->count + shelper->length - index->length_indexed) * 2 > index->allocated) {
+        uint32_t allocated = index->allocated ? index->allocated : STRINGBLOCK_INDEX_MINIMUM;
+        while ((uint64_t)(index->count + shelper->length - index->length_indexed) * 2 > allocated) {
+            allocated *= 2;
+        }
+        if (stringblock_index_resize(index, sblock, allocated)) {
+            return 1;
+        }
+    }
+    struct stringblock_index_entry *entry;
+    uint32_t hash = 0;
+    for (off_t i = shelper->length; i > index->length_indexed; --i) {
+        if (!sblock[i - 1]) {
+            hash = 0;
+            continue;
+        }
+        hash = stringblock_hash_step(hash, sblock[i - 1]);
+        entry = stringblock_index_probe(index, sblock, hash, sblock + i - 1);
+        if (entry->offset < 0) {
+            entry->hash = hash;
+            ++index->count;
+        } else if (entry->offset < i - 1) {
+            continue;
+        }
+        entry->offset = i - 1;
+    }
+    index->length_indexed = shelper->length;
+    return 0;
+}
+
+void
+stringblock_index_free(
+    struct stringblock_index * const    index
+){
+    if (!index) {
+        return;
+    }
+    if (!index->arena) {
+        free(index->entries);
+    }
+    memset(index, 0, sizeof *index);
+}
+
 off_t
 stringblock_find_string(
     struct stringblock_helper const * const shelper,
     char const * const                      string
 ){
-    return stringblock_find_string_raw(shelper->stringblock, shelper->length, string);
+    struct stringblock_index const *const index = shelper->index;
+    if (!index || !string[0] || ((!index->entries || index->length_indexed != shelper->length) && stringblock_index_update(shelper))) {
+        return stringblock_find_string_raw(shelper->stringblock, shelper->length, string);
+    }
+    return stringblock_index_probe(index, shelper->stringblock, stringblock_hash(string), string)->offset;
 }
 
 off_t
@@ -57,10 +192,18 @@ stringblock_append_string_force(
         return shelper->length - 1; // This should not be reached, but it's a failsafe
     }
     if (shelper->length + (off_t)slength + 1 > shelper->allocated_length) {
-        shelper->allocated_length *= 2;
-        char *buffer = realloc(shelper->stringblock, shelper->allocated_length);
+        if (!shelper->owned) {
+            prln_error("string buffer is borrowed and full, refuse to re-allocate it");
+            return -1;
+        }
+        off_t allocated_length = shelper->allocated_length ? shelper->allocated_length : 1;
+        while (shelper->length + (off_t)slength + 1 > allocated_length) {
+            allocated_length *= 2;
+        }
+        char *buffer = realloc(shelper->stringblock, allocated_length);
         if (buffer) {
             shelper->stringblock = buffer;
+            shelper->allocated_length = allocated_length;
         } else {
             prln_error("failed to re-allocate string buffer");
             return -1;
@@ -85,4 +228,45 @@ stringblock_append_string_safely(
     return stringblock_append_string_force(shelper, string, slength);
 }
 
+/*
+ Drop whole strings that have no used byte, the kept ones are moved down in
+ their order so suffixes shared by offsets into a string stay shared. remap
+ gets the new offset of every used offset. Returns the bytes dropped
+*/
+off_t
+stringblock_compact(
+    struct stringblock_helper * const   shelper,
+    uint8_t const * const               used,
+    uint32_t * const                    remap
+){
+    off_t start = 0, end, kept = 0;
+    bool keep;
+    while (start < shelper->length) {
+        keep = false;
+        for (end = start; end < shelper->length; ++end) {
+            keep |= used[end];
+            if (!shelper->stringblock[end]) {
+                ++end;
+                break;
+            }
+        }
+        if (keep) {
+            for (off_t i = start; i < end; ++i) {
+                if (used[i]) {
+                    remap[i] = kept + i - start;
+                }
+            }
+            memmove(shelper->stringblock + kept, shelper->stringblock + start, end - start);
+            kept += end - start;
+        }
+        start = end;
+    }
+    off_t const dropped = shelper->length - kept;
+    shelper->length = kept;
+    if (shelper->index) {
+        stringblock_index_free(shelper->index);
+    }
+    return dropped;
+}
+
 /* stringblock.c: Stingblock-related functions, used for but not only for the string block found in DTB */
\ No newline at end of file
@@ -17,6 +17,20 @@ size_t const    util_human_readable_suffixes_length = strlen(UTIL_HUMAN_READABLE
 
 /* Function */
 
+uint64_t
+util_hash64(
+    uint64_t        hash,
+    void const *    data,
+    size_t const    length
+){
+    uint8_t const *const bytes = data;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
 long 
 util_nearest_upper_bound_long(
     long const  value, 
@@ -0,0 +1,191 @@
+/* Self */
+
+#include "../src/checksum.c" // For the static kernels
+#include "../src/ept.c"      // For the static ept_checksum_partitions()
+
+/* Definition */
+
+#define TEST_CHECKSUM_WORDS     0x10000U    // 256K, the size of a DTB partition copy
+#define TEST_CHECKSUM_ROUNDS    0x1000U
+
+/* Structure */
+
+struct
+    test_checksum_kernel {
+        char const *    name;
+        uint32_t        (*sum32)(uint32_t const *words, size_t count);
+        bool            supported;
+    };
+
+/* Function */
+
+static inline
+uint64_t
+test_checksum_random(
+    uint64_t * const    state
+){
+    // xorshift64, fixed seed so a failure can be reproduced
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/*
+ Reference that does not share any code with the kernels, and reads the words
+ byte by byte so it does not care about the alignment of data
+*/
+static inline
+uint32_t
+test_checksum_reference(
+    uint8_t const * const   data,
+    size_t const            count
+){
+    uint32_t sum = 0;
+    uint32_t word;
+    for (size_t i = 0; i < count; ++i) {
+        memcpy(&word, data + i * 4, 4);
+        sum += word;
+    }
+    return sum;
+}
+
+/* The per-partition loop ept_checksum_partitions() replaced, kept as is */
+static inline
+uint32_t
+test_checksum_ept_reference(
+    struct ept_partition const * const  partitions,
+    int const                           partitions_count
+){
+    int i, j;
+    uint32_t checksum = 0, *p;
+    for (i = 0; i < partitions_count; i++) {
+        p = (uint32_t *)partitions;
+        for (j = sizeof(struct ept_partition)/4; j > 0; --j) {
+            checksum += *p;
+            p++;
+        }
+    }
+    return checksum;
+}
+
+static inline
+unsigned
+test_checksum_get_kernels(
+    struct test_checksum_kernel * const kernels
+){
+    unsigned count = 0;
+    kernels[count++] = (struct test_checksum_kernel){"scalar", checksum_sum32_scalar, true};
+#ifdef CHECKSUM_HAVE_X86
+    __builtin_cpu_init();
+#if defined(__SSE2__)
+    kernels[count++] = (struct test_checksum_kernel){"SSE2", checksum_sum32_sse2, __builtin_cpu_supports("sse2")};
+#endif
+    kernels[count++] = (struct test_checksum_kernel){"AVX2", checksum_sum32_avx2, __builtin_cpu_supports("avx2")};
+#endif
+#ifdef CHECKSUM_HAVE_NEON
+    kernels[count++] = (struct test_checksum_kernel){"NEON", checksum_sum32_neon, true};
+#endif
+    return count;
+}
+
+static inline
+int
+test_checksum_check(
+    struct test_checksum_kernel const * const   kernel,
+    uint8_t const * const                       data,
+    size_t const                                offset,
+    size_t const                                count
+){
+    uint32_t const expected = test_checksum_reference(data + offset, count);
+    uint32_t const actual = kernel->sum32((uint32_t const *)(data + offset), count);
+    if (actual != expected) {
+        fprintf(stderr, "%s kernel mismatch at offset %zu with %zu words: expected %08"PRIx32", got %08"PRIx32"\n", kernel->name, offset, count, expected, actual);
+        return 1;
+    }
+    return 0;
+}
+
+static inline
+int
+test_checksum_kernels(
+    uint8_t const * const   data,
+    uint64_t * const        state
+){
+    struct test_checksum_kernel kernels[4];
+    unsigned const kernels_count = test_checksum_get_kernels(kernels);
+    int r = 0;
+    for (unsigned i = 0; i < kernels_count; ++i) {
+        if (!kernels[i].supported) {
+            printf("%s kernel not supported by this CPU, skipped\n", kernels[i].name);
+            continue;
+        }
+        // Every length around the vector and unrolled widths, at every byte offset within a word
+        for (size_t offset = 0; offset < 4; ++offset) {
+            for (size_t count = 0; count <= 80; ++count) {
+                r += test_checksum_check(kernels + i, data, offset, count);
+            }
+        }
+        for (unsigned j = 0; j < TEST_CHECKSUM_ROUNDS; ++j) {
+            size_t const offset = test_checksum_random(state) % 64;
+            size_t const count = test_checksum_random(state) % (TEST_CHECKSUM_WORDS - 16);
+            r += test_checksum_check(kernels + i, data, offset, count);
+        }
+        r += test_checksum_check(kernels + i, data, 0, TEST_CHECKSUM_WORDS);
+        printf("%s kernel checked\n", kernels[i].name);
+    }
+    for (unsigned j = 0; j < TEST_CHECKSUM_ROUNDS; ++j) {
+        size_t const count = test_checksum_random(state) % TEST_CHECKSUM_WORDS;
+        if (checksum_sum32(data, count) != test_checksum_reference(data, count)) {
+            fprintf(stderr, "dispatched checksum mismatch with %zu words\n", count);
+            ++r;
+        }
+    }
+    return r;
+}
+
+static inline
+int
+test_checksum_ept(
+    uint64_t * const    state
+){
+    struct ept_partition partitions[MAX_PARTITIONS_COUNT];
+    int r = 0;
+    for (unsigned j = 0; j < TEST_CHECKSUM_ROUNDS / 16; ++j) {
+        for (size_t i = 0; i < sizeof partitions; ++i) {
+            ((uint8_t *)partitions)[i] = test_checksum_random(state);
+        }
+        for (int count = -1; count <= MAX_PARTITIONS_COUNT; ++count) {
+            uint32_t const expected = test_checksum_ept_reference(partitions, count);
+            uint32_t const actual = ept_checksum_partitions(partitions, count);
+            if (actual != expected) {
+                fprintf(stderr, "EPT checksum mismatch with %d partitions: expected %08"PRIx32", got %08"PRIx32"\n", count, expected, actual);
+                ++r;
+            }
+        }
+    }
+    printf("EPT checksum checked\n");
+    return r;
+}
+
+int
+main(){
+    uint8_t *const data = malloc(TEST_CHECKSUM_WORDS * 4 + 64);
+    if (!data) {
+        fprintf(stderr, "failed to allocate memory for test data\n");
+        return 1;
+    }
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < TEST_CHECKSUM_WORDS * 4 + 64; ++i) {
+        data[i] = test_checksum_random(&state);
+    }
+    int const r = test_checksum_kernels(data, &state) + test_checksum_ept(&state);
+    free(data);
+    if (r) {
+        fprintf(stderr, "%d mismatches\n", r);
+        return 1;
+    }
+    return 0;
+}
+
+/* checksum.c: Tests that every checksum kernel sums the same as the plain loop */
@@ -0,0 +1,99 @@
+/* Self */
+
+#include "../src/dtb.c" // For dtb_combine_multi_dtb(), which has no prototype
+
+/* Definition */
+
+#define TEST_DTB_BLOB_SIZE      0x180U
+#define TEST_DTB_ENTRIES_COUNT  4U
+#define TEST_DTB_UNIQUE_COUNT   3U  // Entry 2 repeats entry 0
+
+/* Function */
+
+/*
+ Entry 0 and 2 are byte-identical and must share one copy. All entries have
+ the same size and get the same (forged) fingerprint, so entry 1, and entry 3
+ which differs from entry 0 in only one byte, must still get their own copies
+*/
+static inline
+int
+test_dtb_combine_multi_shared(
+    size_t const    alignment
+){
+    static uint8_t blobs[TEST_DTB_UNIQUE_COUNT][TEST_DTB_BLOB_SIZE];
+    for (unsigned i = 0; i < TEST_DTB_UNIQUE_COUNT; ++i) {
+        for (unsigned j = 0; j < TEST_DTB_BLOB_SIZE; ++j) {
+            blobs[i][j] = (uint8_t)(i * 31 + j * 7);
+        }
+    }
+    memcpy(blobs[2], blobs[0], TEST_DTB_BLOB_SIZE);
+    blobs[2][TEST_DTB_BLOB_SIZE / 2] ^= 0xff;
+    uint8_t *const sources[TEST_DTB_ENTRIES_COUNT] = {blobs[0], blobs[1], blobs[0], blobs[2]};
+    char const *const variants[TEST_DTB_ENTRIES_COUNT] = {"a", "b", "c", "d"};
+    struct arena arena;
+    arena_init(&arena);
+    struct dtb_buffer_entry entries[TEST_DTB_ENTRIES_COUNT] = {0};
+    for (unsigned i = 0; i < TEST_DTB_ENTRIES_COUNT; ++i) {
+        entries[i].buffer = sources[i];
+        entries[i].size = TEST_DTB_BLOB_SIZE;
+        entries[i].fingerprint_blob = util_hash64(UTIL_HASH64_INITIAL, sources[0], TEST_DTB_BLOB_SIZE);
+        strcpy(entries[i].soc, "g12b");
+        strcpy(entries[i].platform, "w400");
+        strcpy(entries[i].variant, variants[i]);
+    }
+    struct dtb_buffer_helper const bhelper = {
+        .dtbs = entries,
+        .dtb_count = TEST_DTB_ENTRIES_COUNT,
+        .multi_version = 2,
+        .arena = &arena
+    };
+    static uint8_t dtb[0x10000];
+    size_t size;
+    int r = 0;
+    if (dtb_combine_multi_dtb(dtb, sizeof dtb, &size, &bhelper, alignment)) {
+        fprintf(stderr, "failed to combine multi-DTB with alignment 0x%zx\n", alignment);
+        arena_free(&arena);
+        return 1;
+    }
+    size_t const size_expected = util_nearest_upper_bound_ulong(sizeof(struct dtb_multi_header) + (DTB_MULTI_HEADER_PROPERTY_LENGTH_V2 * 3 + 8) * TEST_DTB_ENTRIES_COUNT, alignment) + util_nearest_upper_bound_ulong(TEST_DTB_BLOB_SIZE, alignment) * TEST_DTB_UNIQUE_COUNT;
+    if (size != size_expected) {
+        fprintf(stderr, "combined multi-DTB with alignment 0x%zx is 0x%zx bytes, expected 0x%zx\n", alignment, size, size_expected);
+        ++r;
+    }
+    struct dtb_multi_entries_helper mhelper;
+    if (dtb_parse_multi_entries(&mhelper, dtb, size) || mhelper.entry_count != TEST_DTB_ENTRIES_COUNT) {
+        fprintf(stderr, "failed to parse combined multi-DTB with alignment 0x%zx\n", alignment);
+        arena_free(&arena);
+        return r + 1;
+    }
+    for (unsigned i = 0; i < TEST_DTB_ENTRIES_COUNT; ++i) {
+        if (mhelper.entries[i].offset + TEST_DTB_BLOB_SIZE > size || memcmp(dtb + mhelper.entries[i].offset, sources[i], TEST_DTB_BLOB_SIZE)) {
+            fprintf(stderr, "entry %u of combined multi-DTB with alignment 0x%zx does not hold its DTB\n", i + 1, alignment);
+            ++r;
+        }
+    }
+    if (mhelper.entries[2].offset != mhelper.entries[0].offset) {
+        fprintf(stderr, "identical entries do not share one copy with alignment 0x%zx\n", alignment);
+        ++r;
+    }
+    if (mhelper.entries[3].offset == mhelper.entries[0].offset) {
+        fprintf(stderr, "entries with the same fingerprint but different content share one copy with alignment 0x%zx\n", alignment);
+        ++r;
+    }
+    free(mhelper.entries);
+    arena_free(&arena);
+    return r;
+}
+
+int
+main(){
+    int const r = test_dtb_combine_multi_shared(DTB_PAGE_SIZE) + test_dtb_combine_multi_shared(8);
+    if (r) {
+        fprintf(stderr, "%d failures\n", r);
+        return 1;
+    }
+    printf("identical DTBs shared in combined multi-DTB\n");
+    return 0;
+}
+
+/* dtb.c: Tests for combining multi-DTBs */